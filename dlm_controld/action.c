@@ -8,6 +8,9 @@
 
 #include "dlm_daemon.h"
 
+#include <pthread.h>
+#include <sys/eventfd.h>
+
 #include <corosync/corotypes.h>
 #include <corosync/cmap.h>
 
@@ -110,64 +113,390 @@ int check_uncontrolled_lockspaces(void)
 	return 0;
 }
 
-static int do_sysfs(const char *name, const char *file, char *val)
+/* Writes to dlm-kernel's sysfs and configfs files can block for a long
+   time, e.g. writing 0 to control waits for the lockspace to stop.  These
+   writes are queued as kernel_ops and done by kernel_write_threads worker
+   threads so the main loop keeps running.  Ops for the same lockspace are
+   done one at a time in the order they were queued.  Workers don't call
+   log_ functions; they save errno in the op and the main thread logs it
+   when it collects the op from done_ops.  ls->kernel_ops_pending counts
+   the ops queued for a lockspace that haven't been collected, and the
+   lockspace's changes are applied again when it reaches zero.  With
+   kernel_write_threads 0 the ops are done directly by the main thread. */
+
+enum {
+	KOP_WRITE = 1,
+	KOP_MKDIR,
+	KOP_RMDIR,
+};
+
+struct kernel_op {
+	struct list_head list;
+	struct lockspace *ls;		/* NULL after the ls is freed */
+	char name[DLM_LOCKSPACE_LEN+1];
+	char path[PATH_MAX];
+	char val[32];
+	int len;
+	int type;
+	int configfs;
+	int error;
+};
+
+static LIST_HEAD(queued_ops);
+static LIST_HEAD(running_ops);
+static LIST_HEAD(done_ops);
+static pthread_mutex_t kernel_ops_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kernel_ops_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *kernel_threads;
+static int kernel_threads_count;
+static int kernel_threads_quit;
+static int kernel_ops_fd = -1;
+
+static const char *kernel_op_str(int type)
 {
-	char fname[512];
-	int rv, fd;
+	switch (type) {
+	case KOP_WRITE:
+		return "write";
+	case KOP_MKDIR:
+		return "mkdir";
+	case KOP_RMDIR:
+		return "rmdir";
+	default:
+		return "unknown";
+	}
+}
 
-	sprintf(fname, "%s/%s/%s", DLM_SYSFS_DIR, name, file);
+/* called by workers, no log_ functions */
 
-	fd = open(fname, O_WRONLY);
-	if (fd < 0) {
-		log_error("open \"%s\" error %d %d", fname, fd, errno);
+static int run_kernel_op(struct kernel_op *op)
+{
+	int fd, rv, off = 0;
+
+	switch (op->type) {
+	case KOP_MKDIR:
+		/* umask is shared with the main thread, so don't
+		   change it like create_path() */
+		rv = mkdir(op->path, 0755);
+		if (rv < 0 && errno == EEXIST)
+			rv = 0;
+		return rv < 0 ? errno : 0;
+
+	case KOP_RMDIR:
+		rv = rmdir(op->path);
+		return rv < 0 ? errno : 0;
+
+	case KOP_WRITE:
+		fd = open(op->path, O_WRONLY);
+		if (fd < 0)
+			return errno;
+
+		while (off < op->len) {
+			rv = write(fd, op->val + off, op->len - off);
+			if (rv < 0 && errno == EINTR)
+				continue;
+			if (rv < 0) {
+				rv = errno;
+				close(fd);
+				return rv;
+			}
+			off += rv;
+		}
+		close(fd);
+		return 0;
+	}
+	return EINVAL;
+}
+
+static int name_running(const char *name)
+{
+	struct kernel_op *op;
+
+	list_for_each_entry(op, &running_ops, list) {
+		if (!strcmp(op->name, name))
+			return 1;
+	}
+	return 0;
+}
+
+/* An earlier op for the same lockspace is either running, which the
+   first check skips, or ahead in the queue, so the first op we find
+   for a lockspace is always its oldest. */
+
+static struct kernel_op *next_kernel_op(void)
+{
+	struct kernel_op *op;
+
+	list_for_each_entry(op, &queued_ops, list) {
+		if (!name_running(op->name))
+			return op;
+	}
+	return NULL;
+}
+
+static void *kernel_op_thread(void *arg)
+{
+	struct kernel_op *op;
+	uint64_t one = 1;
+	int rv;
+
+	pthread_mutex_lock(&kernel_ops_mutex);
+	for (;;) {
+		op = next_kernel_op();
+		if (!op) {
+			if (kernel_threads_quit && list_empty(&queued_ops))
+				break;
+			pthread_cond_wait(&kernel_ops_cond, &kernel_ops_mutex);
+			continue;
+		}
+		list_move_tail(&op->list, &running_ops);
+		pthread_mutex_unlock(&kernel_ops_mutex);
+
+		op->error = run_kernel_op(op);
+
+		pthread_mutex_lock(&kernel_ops_mutex);
+		list_move_tail(&op->list, &done_ops);
+
+		/* the finished op may unblock a later op for its lockspace */
+		pthread_cond_broadcast(&kernel_ops_cond);
+
+		rv = write(kernel_ops_fd, &one, sizeof(one));
+		(void)rv;
+	}
+	pthread_mutex_unlock(&kernel_ops_mutex);
+	return NULL;
+}
+
+static void kernel_op_done(struct kernel_op *op)
+{
+	struct lockspace *ls = op->ls;
+
+	if (op->error)
+		log_error("%s: %s failed: %d", op->path,
+			  kernel_op_str(op->type), op->error);
+
+	if (ls && op->error && op->configfs)
+		ls->configfs_loaded = 0;
+
+	if (ls && kernel_threads_count) {
+		ls->kernel_ops_pending--;
+		if (!ls->kernel_ops_pending)
+			kernel_ops_complete(ls);
+	}
+}
+
+static int queue_kernel_op(struct lockspace *ls, int type, int configfs,
+			   const char *path, const char *val, int len)
+{
+	struct kernel_op *op;
+	int error;
+
+	op = malloc(sizeof(struct kernel_op));
+	if (!op) {
+		log_error("%s: %s no mem", path, kernel_op_str(type));
+		return -ENOMEM;
+	}
+	memset(op, 0, sizeof(struct kernel_op));
+
+	op->ls = ls;
+	memcpy(op->name, ls->name, sizeof(op->name));
+	strncpy(op->path, path, PATH_MAX - 1);
+	if (val)
+		memcpy(op->val, val, len);
+	op->len = len;
+	op->type = type;
+	op->configfs = configfs;
+
+	if (!kernel_threads_count) {
+		op->error = run_kernel_op(op);
+		error = op->error;
+		kernel_op_done(op);
+		free(op);
+		return error ? -1 : 0;
+	}
+
+	ls->kernel_ops_pending++;
+
+	pthread_mutex_lock(&kernel_ops_mutex);
+	list_add_tail(&op->list, &queued_ops);
+	pthread_cond_signal(&kernel_ops_cond);
+	pthread_mutex_unlock(&kernel_ops_mutex);
+	return 0;
+}
+
+void process_kernel_ops(int ci)
+{
+	struct kernel_op *op, *safe;
+	uint64_t count;
+	LIST_HEAD(done);
+	int rv;
+
+	rv = read(kernel_ops_fd, &count, sizeof(count));
+	(void)rv;
+
+	pthread_mutex_lock(&kernel_ops_mutex);
+	list_splice_init(&done_ops, &done);
+	pthread_mutex_unlock(&kernel_ops_mutex);
+
+	list_for_each_entry_safe(op, safe, &done, list) {
+		list_del(&op->list);
+		kernel_op_done(op);
+		free(op);
+	}
+}
+
+/* called from free_ls, ops already queued for the ls still run */
+
+void kernel_ops_forget(struct lockspace *ls)
+{
+	struct kernel_op *op;
+
+	if (!kernel_threads_count)
+		return;
+
+	pthread_mutex_lock(&kernel_ops_mutex);
+	list_for_each_entry(op, &queued_ops, list) {
+		if (op->ls == ls)
+			op->ls = NULL;
+	}
+	list_for_each_entry(op, &running_ops, list) {
+		if (op->ls == ls)
+			op->ls = NULL;
+	}
+	list_for_each_entry(op, &done_ops, list) {
+		if (op->ls == ls)
+			op->ls = NULL;
+	}
+	pthread_mutex_unlock(&kernel_ops_mutex);
+}
+
+int setup_kernel_ops(void)
+{
+	int i, rv;
+
+	kernel_threads_count = 0;
+
+	if (!opt(kernel_write_threads_ind))
+		return 0;
+
+	kernel_ops_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (kernel_ops_fd < 0) {
+		log_error("kernel ops eventfd error %d", errno);
 		return -1;
 	}
 
+	kernel_threads = malloc(opt(kernel_write_threads_ind) *
+				sizeof(pthread_t));
+	if (!kernel_threads) {
+		close(kernel_ops_fd);
+		kernel_ops_fd = -1;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < opt(kernel_write_threads_ind); i++) {
+		rv = pthread_create(&kernel_threads[i], NULL,
+				    kernel_op_thread, NULL);
+		if (rv) {
+			log_error("can't create kernel write thread %d", rv);
+			break;
+		}
+		kernel_threads_count++;
+	}
+
+	if (!kernel_threads_count) {
+		free(kernel_threads);
+		kernel_threads = NULL;
+		close(kernel_ops_fd);
+		kernel_ops_fd = -1;
+		return 0;
+	}
+
+	log_debug("kernel write threads %d", kernel_threads_count);
+	return kernel_ops_fd;
+}
+
+/* let the workers finish what's queued, e.g. the final writes for
+   lockspaces that were just left, before exiting */
+
+void close_kernel_ops(void)
+{
+	struct kernel_op *op, *safe;
+	int i;
+
+	if (!kernel_threads_count)
+		return;
+
+	pthread_mutex_lock(&kernel_ops_mutex);
+	kernel_threads_quit = 1;
+	pthread_cond_broadcast(&kernel_ops_cond);
+	pthread_mutex_unlock(&kernel_ops_mutex);
+
+	for (i = 0; i < kernel_threads_count; i++)
+		pthread_join(kernel_threads[i], NULL);
+
+	list_for_each_entry_safe(op, safe, &done_ops, list) {
+		list_del(&op->list);
+		if (op->error)
+			log_error("%s: %s failed: %d", op->path,
+				  kernel_op_str(op->type), op->error);
+		free(op);
+	}
+
+	free(kernel_threads);
+	kernel_threads = NULL;
+	kernel_threads_count = 0;
+	close(kernel_ops_fd);
+	kernel_ops_fd = -1;
+}
+
+static int do_sysfs(struct lockspace *ls, const char *file, char *val)
+{
+	char fname[512];
+
+	sprintf(fname, "%s/%s/%s", DLM_SYSFS_DIR, ls->name, file);
+
 	log_debug("write \"%s\" to \"%s\"", val, fname);
 
-	rv = do_write(fd, val, strlen(val) + 1);
-	close(fd);
-	return rv;
+	return queue_kernel_op(ls, KOP_WRITE, 0, fname, val, strlen(val) + 1);
 }
 
-int set_sysfs_control(char *name, int val)
+int set_sysfs_control(struct lockspace *ls, int val)
 {
 	char buf[32];
 
 	memset(buf, 0, sizeof(buf));
 	snprintf(buf, 32, "%d", val);
 
-	return do_sysfs(name, "control", buf);
+	return do_sysfs(ls, "control", buf);
 }
 
-int set_sysfs_event_done(char *name, int val)
+int set_sysfs_event_done(struct lockspace *ls, int val)
 {
 	char buf[32];
 
 	memset(buf, 0, sizeof(buf));
 	snprintf(buf, 32, "%d", val);
 
-	return do_sysfs(name, "event_done", buf);
+	return do_sysfs(ls, "event_done", buf);
 }
 
-int set_sysfs_id(char *name, uint32_t id)
+int set_sysfs_id(struct lockspace *ls, uint32_t id)
 {
 	char buf[32];
 
 	memset(buf, 0, sizeof(buf));
 	snprintf(buf, 32, "%u", id);
 
-	return do_sysfs(name, "id", buf);
+	return do_sysfs(ls, "id", buf);
 }
 
-int set_sysfs_nodir(char *name, int val)
+int set_sysfs_nodir(struct lockspace *ls, int val)
 {
 	char buf[32];
 
 	memset(buf, 0, sizeof(buf));
 	snprintf(buf, 32, "%d", val);
 
-	return do_sysfs(name, "nodir", buf);
+	return do_sysfs(ls, "nodir", buf);
 }
 
 static int update_dir_members(char *name)
@@ -240,58 +569,128 @@ int path_exists(const char *path)
 	return 1;
 }
 
-/* The "renew" nodes are those that have left and rejoined since the last
-   call to set_members().  We rmdir/mkdir for these nodes so dlm-kernel
-   can notice they've left and rejoined. */
+static int write_configfs_int(struct lockspace *ls, const char *path, int val)
+{
+	char buf[32];
 
-int set_configfs_members(struct lockspace *ls, char *name,
-			 int new_count, int *new_members,
-			 int renew_count, int *renew_members)
+	memset(buf, 0, sizeof(buf));
+	snprintf(buf, 32, "%d", val);
+
+	return queue_kernel_op(ls, KOP_WRITE, 1, path, buf, strlen(buf));
+}
+
+/* ls->configfs_nodes caches the node dirs that exist under the lockspace's
+   configfs nodes dir, so each change is a diff against the cache instead
+   of a readdir.  The cache is loaded from the dir the first time, and
+   reloaded after any error since we no longer know what exists. */
+
+static void load_configfs_nodes(struct lockspace *ls, char *name)
 {
 	char path[PATH_MAX];
-	char buf[32];
-	int i, w, fd, rv, id, old_count, *old_members;
-	int do_renew;
 
-	/*
-	 * create lockspace dir if it doesn't exist yet
-	 */
+	ls->configfs_count = 0;
 
 	memset(path, 0, PATH_MAX);
 	snprintf(path, PATH_MAX, "%s/%s", SPACES_DIR, name);
 
 	if (!path_exists(path)) {
 		if (create_path(path))
-			return -1;
+			return;
 	}
 
-	/*
-	 * remove/add lockspace members
-	 */
+	if (update_dir_members(name))
+		return;
 
-	rv = update_dir_members(name);
-	if (rv)
-		return rv;
+	memcpy(ls->configfs_nodes, dir_members, sizeof(dir_members));
+	ls->configfs_count = dir_members_count;
+	ls->configfs_loaded = 1;
+}
+
+static void configfs_node_del(struct lockspace *ls, int id)
+{
+	int i;
+
+	for (i = 0; i < ls->configfs_count; i++) {
+		if (ls->configfs_nodes[i] != id)
+			continue;
+		ls->configfs_nodes[i] = ls->configfs_nodes[--ls->configfs_count];
+		return;
+	}
+}
+
+static void configfs_node_add(struct lockspace *ls, int id)
+{
+	if (ls->configfs_count < MAX_NODES)
+		ls->configfs_nodes[ls->configfs_count++] = id;
+}
+
+/* The "renew" nodes are those that have left and rejoined since the last
+   call to set_members().  We rmdir/mkdir for these nodes so dlm-kernel
+   can notice they've left and rejoined.
+
+   The changes are computed up front, then queued as kernel_ops in phases:
+   rmdir of removed nodes, mkdir of added nodes, then their nodeid/weight
+   files.  update_cluster() is called at most once, before any node dir for
+   a node quorum doesn't know yet is queued.  The cache is updated as the
+   ops are queued, and is invalidated by kernel_op_done() if one fails. */
+
+int set_configfs_members(struct lockspace *ls, char *name,
+			 int new_count, int *new_members,
+			 int renew_count, int *renew_members)
+{
+	char path[PATH_MAX];
+	int rem_ids[MAX_NODES], add_ids[MAX_NODES], add_renew[MAX_NODES];
+	int rem_count = 0, add_count = 0, need_update = 0;
+	uint64_t t_start, t_diff, t_rmdir, t_mkdir, t_attr;
+	int i, rv, id;
+
+	t_start = monotime_usec();
+
+	if (!ls->configfs_loaded) {
+		load_configfs_nodes(ls, name);
+		if (!ls->configfs_loaded)
+			return -1;
+	}
 
-	old_members = dir_members;
-	old_count = dir_members_count;
+	for (i = 0; i < ls->configfs_count; i++) {
+		id = ls->configfs_nodes[i];
+		if (!id_exists(id, new_count, new_members))
+			rem_ids[rem_count++] = id;
+	}
+
+	for (i = 0; i < new_count; i++) {
+		id = new_members[i];
 
-	for (i = 0; i < old_count; i++) {
-		id = old_members[i];
-		if (id_exists(id, new_count, new_members))
+		if (id_exists(id, renew_count, renew_members))
+			add_renew[add_count] = 1;
+		else if (id_exists(id, ls->configfs_count, ls->configfs_nodes))
 			continue;
+		else
+			add_renew[add_count] = 0;
+
+		add_ids[add_count++] = id;
+
+		if (!is_cluster_member(id))
+			need_update = 1;
+	}
 
+	t_diff = monotime_usec();
+
+	/*
+	 * remove lockspace members
+	 */
+
+	for (i = 0; i < rem_count; i++) {
 		memset(path, 0, PATH_MAX);
 		snprintf(path, PATH_MAX, "%s/%s/nodes/%d",
-			 SPACES_DIR, name, id);
+			 SPACES_DIR, name, rem_ids[i]);
 
 		log_debug("set_members rmdir \"%s\"", path);
 
-		rv = rmdir(path);
-		if (rv) {
-			log_error("%s: rmdir failed: %d", path, errno);
-			goto out;
-		}
+		rv = queue_kernel_op(ls, KOP_RMDIR, 1, path, NULL, 0);
+		if (rv)
+			goto fail;
+		configfs_node_del(ls, rem_ids[i]);
 	}
 
 	/*
@@ -305,102 +704,78 @@ int set_configfs_members(struct lockspace *ls, char *name,
 
 		log_debug("set_members lockspace rmdir \"%s\"", path);
 
-		rv = rmdir(path);
-		if (rv)
-			log_error("%s: rmdir failed: %d", path, errno);
+		queue_kernel_op(ls, KOP_RMDIR, 1, path, NULL, 0);
+		ls->configfs_loaded = 0;
 	}
 
-	for (i = 0; i < new_count; i++) {
-		id = new_members[i];
-
-		do_renew = 0;
+	t_rmdir = monotime_usec();
 
-		if (id_exists(id, renew_count, renew_members))
-			do_renew = 1;
-		else if (id_exists(id, old_count, old_members))
-			continue;
+	if (need_update)
+		update_cluster();
 
-		if (!is_cluster_member(id))
-			update_cluster();
-		/*
-		 * create node's dir
-		 */
+	/*
+	 * create added nodes' dirs
+	 */
 
+	for (i = 0; i < add_count; i++) {
 		memset(path, 0, PATH_MAX);
 		snprintf(path, PATH_MAX, "%s/%s/nodes/%d",
-			 SPACES_DIR, name, id);
+			 SPACES_DIR, name, add_ids[i]);
 
-		if (do_renew) {
+		if (add_renew[i]) {
 			log_debug("set_members renew rmdir \"%s\"", path);
-			rv = rmdir(path);
-			if (rv) {
-				log_error("%s: renew rmdir failed: %d",
-					  path, errno);
-				goto out;
-			}
+			rv = queue_kernel_op(ls, KOP_RMDIR, 1, path, NULL, 0);
+			if (rv)
+				goto fail;
+			configfs_node_del(ls, add_ids[i]);
 		}
 
 		log_debug("set_members mkdir \"%s\"", path);
 
-		rv = create_path(path);
+		rv = queue_kernel_op(ls, KOP_MKDIR, 1, path, NULL, 0);
 		if (rv)
-			goto out;
+			goto fail;
+		configfs_node_add(ls, add_ids[i]);
+	}
 
-		/*
-		 * set node's nodeid
-		 */
+	t_mkdir = monotime_usec();
+
+	/*
+	 * set added nodes' nodeid and weight
+	 */
+
+	for (i = 0; i < add_count; i++) {
+		id = add_ids[i];
 
 		memset(path, 0, PATH_MAX);
 		snprintf(path, PATH_MAX, "%s/%s/nodes/%d/nodeid",
 			 SPACES_DIR, name, id);
 
-		rv = fd = open(path, O_WRONLY);
-		if (rv < 0) {
-			log_error("%s: open failed: %d", path, errno);
-			goto out;
-		}
-
-		memset(buf, 0, 32);
-		snprintf(buf, 32, "%d", id);
-
-		rv = do_write(fd, buf, strlen(buf));
-		if (rv < 0) {
-			log_error("%s: write failed: %d, %s", path, errno, buf);
-			close(fd);
-			goto out;
-		}
-		close(fd);
-
-		/*
-		 * set node's weight
-		 */
-
-		w = get_weight(ls, id);
+		rv = write_configfs_int(ls, path, id);
+		if (rv < 0)
+			goto fail;
 
 		memset(path, 0, PATH_MAX);
 		snprintf(path, PATH_MAX, "%s/%s/nodes/%d/weight",
 			 SPACES_DIR, name, id);
 
-		rv = fd = open(path, O_WRONLY);
-		if (rv < 0) {
-			log_error("%s: open failed: %d", path, errno);
-			goto out;
-		}
+		rv = write_configfs_int(ls, path, get_weight(ls, id));
+		if (rv < 0)
+			goto fail;
+	}
 
-		memset(buf, 0, 32);
-		snprintf(buf, 32, "%d", w);
+	t_attr = monotime_usec();
 
-		rv = do_write(fd, buf, strlen(buf));
-		if (rv < 0) {
-			log_error("%s: write failed: %d, %s", path, errno, buf);
-			close(fd);
-			goto out;
-		}
-		close(fd);
-	}
+	log_group(ls, "set_members rem %d add %d usec diff %llu rmdir %llu "
+		  "mkdir %llu attr %llu", rem_count, add_count,
+		  (unsigned long long)(t_diff - t_start),
+		  (unsigned long long)(t_rmdir - t_diff),
+		  (unsigned long long)(t_mkdir - t_rmdir),
+		  (unsigned long long)(t_attr - t_mkdir));
+	return 0;
 
-	rv = 0;
- out:
+ fail:
+	ls->configfs_loaded = 0;
 	return rv;
 }
 
@@ -8,6 +8,8 @@
 
 #include "dlm_daemon.h"
 
+#include <sys/inotify.h>
+
 #if 0
 
 lockspace ls_name [ls_args]
@@ -25,122 +27,394 @@ master node=2 weight=1
 
 #define MAX_LINE 256
 
-int get_weight(struct lockspace *ls, int nodeid)
+/* dlm.conf is read and parsed once into a struct dlm_conf, instead of
+   being re-read for each new lockspace and each new fence config.
+   Lockspace sections are parsed up front and indexed by name.  Fence
+   configs are parsed by fence_config_init() the first time a nodeid is
+   looked up, and kept indexed by nodeid.  An inotify watch on the conf
+   dir replaces the whole dlm_conf when the file changes, and counts the
+   reload in config_reloads.  Daemon options are only set from the file
+   at startup. */
+
+#define CONF_HASH_SIZE 64
+
+struct conf_ls {
+	struct list_head list;
+	char name[MAX_LINE];
+	int nodir;
+	int master_count;
+	int master_nodeid[MAX_NODES];
+	int master_weight[MAX_NODES];
+};
+
+struct conf_fence {
+	struct list_head list;
+	int nodeid;
+	int rv;			/* from fence_config_init */
+	struct fence_config fc;
+};
+
+struct dlm_conf {
+	char **lines;
+	int line_count;
+	struct list_head ls_hash[CONF_HASH_SIZE];
+	struct list_head fence_hash[CONF_HASH_SIZE];
+};
+
+static struct dlm_conf *conf;
+static int conf_watch_fd = -1;
+
+static uint32_t conf_hash_name(const char *name)
 {
-	int i;
+	uint32_t h = 2166136261U;
 
-	/* if no masters are defined, everyone defaults to weight 1 */
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h & (CONF_HASH_SIZE - 1);
+}
 
-	if (!ls->master_count)
-		return 1;
+static void free_conf(struct dlm_conf *c)
+{
+	struct conf_ls *cl, *cl_safe;
+	struct conf_fence *cf, *cf_safe;
+	int i;
 
-	for (i = 0; i < ls->master_count; i++) {
-		if (ls->master_nodeid[i] == nodeid)
-			return ls->master_weight[i];
+	for (i = 0; i < CONF_HASH_SIZE; i++) {
+		list_for_each_entry_safe(cl, cl_safe, &c->ls_hash[i], list) {
+			list_del(&cl->list);
+			free(cl);
+		}
+		list_for_each_entry_safe(cf, cf_safe, &c->fence_hash[i], list) {
+			list_del(&cf->list);
+			fence_config_free(&cf->fc);
+			free(cf);
+		}
 	}
 
-	/* if masters are defined, non-masters default to weight 0 */
+	for (i = 0; i < c->line_count; i++)
+		free(c->lines[i]);
+	free(c->lines);
+	free(c);
+}
+
+static int read_conf_lines(struct dlm_conf *c)
+{
+	char line[MAX_LINE];
+	char **lines;
+	FILE *file;
+	int max = 0;
 
+	if (!path_exists(CONF_FILE_PATH))
+		return 0;
+
+	file = fopen(CONF_FILE_PATH, "r");
+	if (!file)
+		return 0;
+
+	while (fgets(line, MAX_LINE, file)) {
+		if (c->line_count == max) {
+			max = max ? max * 2 : 64;
+			lines = realloc(c->lines, max * sizeof(char *));
+			if (!lines)
+				goto fail;
+			c->lines = lines;
+		}
+		c->lines[c->line_count] = strdup(line);
+		if (!c->lines[c->line_count])
+			goto fail;
+		c->line_count++;
+	}
+
+	fclose(file);
 	return 0;
+ fail:
+	fclose(file);
+	return -ENOMEM;
 }
 
-static void read_master_config(struct lockspace *ls, FILE *file)
+/* the master lines for a lockspace immediately follow its lockspace line
+   (see the format above), any other line ends them */
+
+static int parse_master_line(struct conf_ls *cl, char *line)
 {
-	char line[MAX_LINE];
 	char name[MAX_LINE];
 	char args[MAX_LINE];
 	char *k;
-	int nodeid, weight, i;
-
-	while (fgets(line, MAX_LINE, file)) {
-		if (line[0] == '\n')
-			break;
-		if (line[0] == ' ')
-			break;
-		if (line[0] == '#')
-			continue;
+	int nodeid = 0, weight = 1, i;
 
-		if (strncmp(line, "master", strlen("master")))
-			break;
+	if (line[0] == '\n' || line[0] == ' ')
+		return 0;
 
-		memset(name, 0, sizeof(name));
-		memset(args, 0, sizeof(args));
-		nodeid = 0;
-		weight = 1;
+	if (strncmp(line, "master", strlen("master")))
+		return 0;
 
-		sscanf(line, "master %s %[^\n]s", name, args);
+	memset(name, 0, sizeof(name));
+	memset(args, 0, sizeof(args));
 
-		if (strcmp(name, ls->name))
-			break;
+	sscanf(line, "master %s %[^\n]s", name, args);
 
-		k = strstr(args, "node=");
-		if (!k)
-			break;
+	if (strcmp(name, cl->name))
+		return 0;
 
-		sscanf(k, "node=%d", &nodeid);
-		if (!nodeid)
-			break;
+	k = strstr(args, "node=");
+	if (!k)
+		return 0;
 
-		k = strstr(args, "weight=");
-		if (k)
-			sscanf(k, "weight=%d", &weight);
+	sscanf(k, "node=%d", &nodeid);
+	if (!nodeid)
+		return 0;
 
-		log_debug("config lockspace %s nodeid %d weight %d",
-			  ls->name, nodeid, weight);
+	k = strstr(args, "weight=");
+	if (k)
+		sscanf(k, "weight=%d", &weight);
 
-		i = ls->master_count++;
-		ls->master_nodeid[i] = nodeid;
-		ls->master_weight[i] = weight;
+	i = cl->master_count++;
+	cl->master_nodeid[i] = nodeid;
+	cl->master_weight[i] = weight;
 
-		if (ls->master_count >= MAX_NODES)
-			break;
-	}
+	return cl->master_count < MAX_NODES;
 }
 
-void setup_lockspace_config(struct lockspace *ls)
+static int parse_conf_lockspaces(struct dlm_conf *c)
 {
-	FILE *file;
-	char line[MAX_LINE];
-	char name[MAX_LINE];
+	struct conf_ls *cl = NULL;
 	char args[MAX_LINE];
-	char *k;
-	int val;
-
-	if (!path_exists(CONF_FILE_PATH))
-		return;
+	char *line, *k;
+	int i, val;
 
-	file = fopen(CONF_FILE_PATH, "r");
-	if (!file)
-		return;
+	for (i = 0; i < c->line_count; i++) {
+		line = c->lines[i];
 
-	while (fgets(line, MAX_LINE, file)) {
 		if (line[0] == '#')
 			continue;
-		if (line[0] == '\n')
-			continue;
+
+		if (cl) {
+			if (parse_master_line(cl, line))
+				continue;
+			cl = NULL;
+		}
 
 		if (strncmp(line, "lockspace", strlen("lockspace")))
 			continue;
 
-		memset(name, 0, sizeof(name));
+		cl = malloc(sizeof(struct conf_ls));
+		if (!cl)
+			return -ENOMEM;
+		memset(cl, 0, sizeof(struct conf_ls));
 		memset(args, 0, sizeof(args));
-		val = 0;
 
-		sscanf(line, "lockspace %s %[^\n]s", name, args);
-
-		if (strcmp(name, ls->name))
-			continue;
+		sscanf(line, "lockspace %s %[^\n]s", cl->name, args);
 
 		k = strstr(args, "nodir=");
 		if (k) {
+			val = 0;
 			sscanf(k, "nodir=%d", &val);
-			ls->nodir = val;
+			cl->nodir = val;
 		}
 
-		read_master_config(ls, file);
+		list_add_tail(&cl->list, &c->ls_hash[conf_hash_name(cl->name)]);
 	}
+	return 0;
+}
 
-	fclose(file);
+static struct dlm_conf *read_conf(void)
+{
+	struct dlm_conf *c;
+	int i;
+
+	c = malloc(sizeof(struct dlm_conf));
+	if (!c)
+		return NULL;
+	memset(c, 0, sizeof(struct dlm_conf));
+
+	for (i = 0; i < CONF_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&c->ls_hash[i]);
+		INIT_LIST_HEAD(&c->fence_hash[i]);
+	}
+
+	if (read_conf_lines(c) < 0 || parse_conf_lockspaces(c) < 0) {
+		log_error("config file %s no mem", CONF_FILE_PATH);
+		free_conf(c);
+		return NULL;
+	}
+	return c;
+}
+
+static struct dlm_conf *get_conf(void)
+{
+	if (!conf)
+		conf = read_conf();
+	return conf;
+}
+
+int get_weight(struct lockspace *ls, int nodeid)
+{
+	int i;
+
+	/* if no masters are defined, everyone defaults to weight 1 */
+
+	if (!ls->master_count)
+		return 1;
+
+	for (i = 0; i < ls->master_count; i++) {
+		if (ls->master_nodeid[i] == nodeid)
+			return ls->master_weight[i];
+	}
+
+	/* if masters are defined, non-masters default to weight 0 */
+
+	return 0;
+}
+
+void setup_lockspace_config(struct lockspace *ls)
+{
+	struct dlm_conf *c = get_conf();
+	struct conf_ls *cl;
+	int i;
+
+	if (!c)
+		return;
+
+	list_for_each_entry(cl, &c->ls_hash[conf_hash_name(ls->name)], list) {
+		if (strcmp(cl->name, ls->name))
+			continue;
+
+		ls->nodir = cl->nodir;
+
+		for (i = 0; i < cl->master_count; i++) {
+			log_debug("config lockspace %s nodeid %d weight %d",
+				  ls->name, cl->master_nodeid[i],
+				  cl->master_weight[i]);
+
+			ls->master_nodeid[ls->master_count] =
+				cl->master_nodeid[i];
+			ls->master_weight[ls->master_count] =
+				cl->master_weight[i];
+			if (++ls->master_count >= MAX_NODES)
+				return;
+		}
+	}
+}
+
+static int copy_fence_config(struct fence_config *dst, struct fence_config *src)
+{
+	int i;
+
+	memset(dst, 0, sizeof(struct fence_config));
+	dst->nodeid = src->nodeid;
+
+	for (i = 0; i < FENCE_CONFIG_DEVS_MAX; i++) {
+		if (src->dev[i]) {
+			dst->dev[i] = malloc(sizeof(struct fence_device));
+			if (!dst->dev[i])
+				goto fail;
+			memcpy(dst->dev[i], src->dev[i],
+			       sizeof(struct fence_device));
+		}
+		if (src->con[i]) {
+			dst->con[i] = malloc(sizeof(struct fence_connect));
+			if (!dst->con[i])
+				goto fail;
+			memcpy(dst->con[i], src->con[i],
+			       sizeof(struct fence_connect));
+		}
+	}
+	return 0;
+ fail:
+	fence_config_free(dst);
+	return -ENOMEM;
+}
+
+/* Same results as fence_config_init() on dlm.conf, the caller owns fc and
+   frees it with fence_config_free(). */
+
+int get_fence_config(int nodeid, struct fence_config *fc)
+{
+	struct dlm_conf *c = get_conf();
+	struct list_head *head;
+	struct conf_fence *cf;
+
+	if (!c)
+		return fence_config_init(fc, nodeid, (char *)CONF_FILE_PATH);
+
+	head = &c->fence_hash[(uint32_t)nodeid % CONF_HASH_SIZE];
+
+	list_for_each_entry(cf, head, list) {
+		if (cf->nodeid == nodeid)
+			goto found;
+	}
+
+	cf = malloc(sizeof(struct conf_fence));
+	if (!cf)
+		return -ENOMEM;
+	memset(cf, 0, sizeof(struct conf_fence));
+	cf->nodeid = nodeid;
+	cf->rv = fence_config_init(&cf->fc, nodeid, (char *)CONF_FILE_PATH);
+	list_add_tail(&cf->list, head);
+ found:
+	if (cf->rv < 0)
+		return cf->rv;
+	return copy_fence_config(fc, &cf->fc);
+}
+
+int setup_config_watch(void)
+{
+	int fd, wd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		log_error("config inotify_init error %d", errno);
+		return fd;
+	}
+
+	/* watch the dir since the file may be replaced by a rename */
+
+	wd = inotify_add_watch(fd, CONFDIR, IN_CLOSE_WRITE | IN_MOVED_TO |
+			       IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+	if (wd < 0) {
+		log_debug("config no watch on %s %d", CONFDIR, errno);
+		close(fd);
+		return 0;
+	}
+
+	conf_watch_fd = fd;
+	return fd;
+}
+
+void process_config_watch(int ci)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct dlm_conf *c;
+	int rv, off, changed = 0;
+
+	while (1) {
+		rv = read(conf_watch_fd, buf, sizeof(buf));
+		if (rv <= 0)
+			break;
+
+		for (off = 0; off < rv; off += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)(buf + off);
+			if (ev->len && !strcmp(ev->name, CONF_FILE_NAME))
+				changed = 1;
+		}
+	}
+
+	if (!changed)
+		return;
+
+	c = read_conf();
+	if (!c)
+		return;
+
+	if (conf)
+		free_conf(conf);
+	conf = c;
+	config_reloads++;
+
+	log_debug("config file %s reloaded %d", CONF_FILE_PATH, config_reloads);
 }
 
 static void get_val_int(char *line, int *val_out)
@@ -171,20 +445,18 @@ static void get_val_str(char *line, char *val_out)
 
 void set_opt_file(int update)
 {
+	struct dlm_conf *c = get_conf();
 	struct dlm_option *o;
-	FILE *file;
-	char line[MAX_LINE];
+	char *line;
 	char str[MAX_LINE];
-	int i, val;
+	int i, n, val;
 
-	if (!path_exists(CONF_FILE_PATH))
+	if (!c)
 		return;
 
-	file = fopen(CONF_FILE_PATH, "r");
-	if (!file)
-		return;
+	for (n = 0; n < c->line_count; n++) {
+		line = c->lines[n];
 
-	while (fgets(line, MAX_LINE, file)) {
 		if (line[0] == '#')
 			continue;
 		if (line[0] == '\n')
@@ -257,7 +529,5 @@ void set_opt_file(int update)
 				  o->name, o->file_str, o->cli_set, o->use_str);
 		}
 	}
-
-	fclose(file);
 }
 
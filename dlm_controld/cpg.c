@@ -60,6 +60,11 @@ struct change {
 	uint32_t seq; /* used as a reference for debugging, and for queries */
 	uint32_t combined_seq; /* for queries */
 	uint64_t create_time;
+	uint64_t create_usec;
+	uint64_t stage_usec[RS_STAGES]; /* monotime_usec when stage done */
+	struct node_map member_map;
+	struct member *member_slots[NODE_SLOTS];
+	int member_noslot; /* members without a node slot */
 };
 
 /* per lockspace change member: cg->members */
@@ -123,6 +128,13 @@ static void ids_in(struct ls_info *li, struct id_info *ids)
 static struct member *find_memb(struct change *cg, int nodeid)
 {
 	struct member *memb;
+	int slot;
+
+	slot = node_slot_find(nodeid);
+	if (slot >= 0)
+		return cg->member_slots[slot];
+	if (!cg->member_noslot)
+		return NULL;
 
 	list_for_each_entry(memb, &cg->members, list) {
 		if (memb->nodeid == nodeid)
@@ -131,28 +143,6 @@ static struct member *find_memb(struct change *cg, int nodeid)
 	return NULL;
 }
 
-static struct lockspace *find_ls_handle(cpg_handle_t h)
-{
-	struct lockspace *ls;
-
-	list_for_each_entry(ls, &lockspaces, list) {
-		if (ls->cpg_handle == h)
-			return ls;
-	}
-	return NULL;
-}
-
-static struct lockspace *find_ls_ci(int ci)
-{
-	struct lockspace *ls;
-
-	list_for_each_entry(ls, &lockspaces, list) {
-		if (ls->cpg_client == ci)
-			return ls;
-	}
-	return NULL;
-}
-
 static void free_cg(struct change *cg)
 {
 	struct member *memb, *safe;
@@ -168,6 +158,42 @@ static void free_cg(struct change *cg)
 	free(cg);
 }
 
+/* Lockspace joins are pipelined: an online uevent only queues the ls, and
+   process_lockspace_joins() starts the cpg joins for as many queued
+   lockspaces as join_concurrency allows.  A join is in progress from
+   cpg_join until start_kernel completes it (join_done), so a mount storm
+   overlaps the cpg joins, start messages and kernel setup of many
+   lockspaces instead of taking them one at a time, and a busy cpg
+   (TRY_AGAIN) is retried from the main loop rather than sleeping in
+   cpg_join while everything else waits. */
+
+static LIST_HEAD(join_queue);
+static int joins_inflight;
+
+/* the stages of a join: waiting in join_queue and for cpg_join, cpg_join
+   until our join confchg, and confchg until the kernel is started */
+
+static void join_done(struct lockspace *ls)
+{
+	uint64_t now = monotime_usec();
+	uint64_t queue_ms, confchg_ms, start_ms;
+
+	queue_ms = (ls->join_cpg_usec - ls->join_queue_usec) / 1000;
+	confchg_ms = (ls->join_confchg_usec - ls->join_cpg_usec) / 1000;
+	start_ms = (now - ls->join_confchg_usec) / 1000;
+
+	log_group(ls, "join done queue %llu ms confchg %llu ms start %llu ms "
+		  "retries %d", (unsigned long long)queue_ms,
+		  (unsigned long long)confchg_ms,
+		  (unsigned long long)start_ms, ls->join_retries);
+
+	if (ls->join_inflight) {
+		ls->join_inflight = 0;
+		joins_inflight--;
+		poll_joins = 1;
+	}
+}
+
 static void free_ls(struct lockspace *ls)
 {
 	struct change *cg, *cg_safe;
@@ -186,6 +212,13 @@ static void free_ls(struct lockspace *ls)
 		free(node);
 	}
 
+	if (ls->join_inflight) {
+		joins_inflight--;
+		poll_joins = 1;
+	}
+
+	kernel_ops_forget(ls);
+	ls_index_del(ls);
 	free(ls);
 }
 
@@ -243,6 +276,11 @@ static void free_ls(struct lockspace *ls)
 static struct node *get_node_history(struct lockspace *ls, int nodeid)
 {
 	struct node *node;
+	int slot;
+
+	slot = node_slot_find(nodeid);
+	if (slot >= 0)
+		return ls->node_history_slots[slot];
 
 	list_for_each_entry(node, &ls->node_history, list) {
 		if (node->nodeid == nodeid)
@@ -254,6 +292,7 @@ static struct node *get_node_history(struct lockspace *ls, int nodeid)
 static struct node *get_node_history_create(struct lockspace *ls, int nodeid)
 {
 	struct node *node;
+	int slot;
 
 	node = get_node_history(ls, nodeid);
 	if (node)
@@ -266,6 +305,10 @@ static struct node *get_node_history_create(struct lockspace *ls, int nodeid)
 
 	node->nodeid = nodeid;
 	list_add_tail(&node->list, &ls->node_history);
+
+	slot = node_slot(nodeid);
+	if (slot >= 0)
+		ls->node_history_slots[slot] = node;
 	return node;
 }
 
@@ -550,21 +593,22 @@ static void start_kernel(struct lockspace *ls)
 
 	/* needs to happen before setting control which starts recovery */
 	if (ls->joining)
-		set_sysfs_id(ls->name, ls->global_id);
+		set_sysfs_id(ls, ls->global_id);
 
 	if (ls->nodir)
-		set_sysfs_nodir(ls->name, 1);
+		set_sysfs_nodir(ls, 1);
 
 	format_member_ids(ls);
 	format_renew_ids(ls);
 	set_configfs_members(ls, ls->name, member_count, member_ids,
 			     renew_count, renew_ids);
-	set_sysfs_control(ls->name, 1);
+	set_sysfs_control(ls, 1);
 	ls->kernel_stopped = 0;
 
 	if (ls->joining) {
-		set_sysfs_event_done(ls->name, 0);
+		set_sysfs_event_done(ls, 0);
 		ls->joining = 0;
+		join_done(ls);
 	}
 }
 
@@ -572,14 +616,14 @@ static void stop_kernel(struct lockspace *ls, uint32_t seq)
 {
 	if (!ls->kernel_stopped) {
 		log_group(ls, "stop_kernel cg %u", seq);
-		set_sysfs_control(ls->name, 0);
+		set_sysfs_control(ls, 0);
 		ls->kernel_stopped = 1;
 	}
 }
 
-/* the first condition is that the local lockspace is stopped which we
-   don't need to check for because stop_kernel(), which is synchronous,
-   was done when the change was created */
+/* the first condition is that the local lockspace is stopped; the write
+   from stop_kernel() when the change was created is done by a kernel write
+   thread, so wait for all the lockspace's kernel_ops to finish */
 
 /* the fencing/quorum/fs conditions need to account for all the changes
    that have occured since the last change applied to dlm-kernel, not
@@ -588,12 +632,27 @@ static void stop_kernel(struct lockspace *ls, uint32_t seq)
 /* we know that the cluster_quorate value here is consistent with the cpg events
    because the ringid's are in sync per the check_ringid_done */
 
+static void stage_done(struct change *cg, int stage)
+{
+	if (!cg->stage_usec[stage])
+		cg->stage_usec[stage] = monotime_usec();
+}
+
 static int wait_conditions_done(struct lockspace *ls)
 {
+	struct change *cg = list_first_entry(&ls->changes, struct change, list);
+
+	if (ls->kernel_ops_pending) {
+		ls->wait_debug = DLMC_LS_WAIT_KERNEL;
+		return 0;
+	}
+	stage_done(cg, RS_STOP);
+
 	if (!check_ringid_done(ls)) {
 		ls->wait_debug = DLMC_LS_WAIT_RINGID;
 		return 0;
 	}
+	stage_done(cg, RS_RINGID);
 
 	if (opt(enable_quorum_lockspace_ind) && !cluster_quorate) {
 		log_group(ls, "wait for quorum");
@@ -601,18 +660,21 @@ static int wait_conditions_done(struct lockspace *ls)
 		poll_lockspaces++;
 		return 0;
 	}
+	stage_done(cg, RS_QUORUM);
 
 	if (!check_fencing_done(ls)) {
 		ls->wait_debug = DLMC_LS_WAIT_FENCING;
 		poll_lockspaces++;
 		return 0;
 	}
+	stage_done(cg, RS_FENCING);
 
 	if (!check_fs_done(ls)) {
 		ls->wait_debug = DLMC_LS_WAIT_FSDONE;
 		poll_fs++;
 		return 0;
 	}
+	stage_done(cg, RS_FS);
 
 	ls->wait_debug = 0;
 
@@ -1059,6 +1121,9 @@ static int same_members(struct change *cg1, struct change *cg2)
 {
 	struct member *memb;
 
+	if (!cg1->member_noslot)
+		return node_map_subset(&cg1->member_map, &cg2->member_map);
+
 	list_for_each_entry(memb, &cg1->members, list) {
 		if (!find_memb(cg2, memb->nodeid))
 			return 0;
@@ -1153,9 +1218,211 @@ static void prepare_plocks(struct lockspace *ls)
 	send_plocks_done(ls, cg, plocks_data);
 }
 
+/* Recovery timeline: when a change is applied to the kernel, the time
+   spent in each stage is saved in the lockspace's recovery_history ring
+   and added to the lockspace's and the daemon-wide recovery_stats, which
+   survive the lockspace.  Changes combined into the applied one by
+   cleanup_changes are not recorded separately. */
+
+static struct recovery_stats recovery_stats_all;
+
+static void add_recovery_stats(struct recovery_stats *rs,
+			       struct recovery_record *rr)
+{
+	uint64_t usec;
+	int i;
+
+	rs->count++;
+
+	for (i = 0; i <= RS_STAGES; i++) {
+		usec = (i == RS_STAGES) ? rr->total_usec : rr->stage_usec[i];
+		rs->usec_total[i] += usec;
+		if (usec > rs->usec_max[i])
+			rs->usec_max[i] = usec;
+		rs->hist[i][usec_hist_bucket(usec)]++;
+	}
+}
+
+static void record_recovery(struct lockspace *ls, struct change *cg)
+{
+	struct recovery_record *rr;
+	struct change *last;
+	uint64_t prev;
+	int i;
+
+	rr = &ls->recovery_history[ls->recovery_next];
+	ls->recovery_next = (ls->recovery_next + 1) % RECOVERY_HISTORY;
+
+	memset(rr, 0, sizeof(struct recovery_record));
+	rr->seq = cg->seq;
+	rr->combined_seq = cg->seq;
+	rr->member_count = cg->member_count;
+	rr->joined_count = cg->joined_count;
+	rr->remove_count = cg->remove_count;
+	rr->failed_count = cg->failed_count;
+	rr->walltime = time(NULL);
+
+	/* cg is first on ls->changes, the older ones after it will be
+	   combined into it */
+	last = list_entry(ls->changes.prev, struct change, list);
+	rr->combined_seq = last->seq;
+
+	prev = cg->create_usec;
+	for (i = 0; i < RS_STAGES; i++) {
+		if (!cg->stage_usec[i])
+			continue;
+		rr->stage_usec[i] = cg->stage_usec[i] - prev;
+		prev = cg->stage_usec[i];
+	}
+	rr->total_usec = prev - cg->create_usec;
+
+	add_recovery_stats(&ls->recovery_stats, rr);
+	add_recovery_stats(&recovery_stats_all, rr);
+
+	log_group(ls, "recovery cg %u done %llu ms fencing %llu ms "
+		  "messages %llu ms", cg->seq,
+		  (unsigned long long)rr->total_usec / 1000,
+		  (unsigned long long)rr->stage_usec[RS_FENCING] / 1000,
+		  (unsigned long long)rr->stage_usec[RS_MESSAGES] / 1000);
+}
+
+static const char *stage_str(int stage)
+{
+	switch (stage) {
+	case RS_STOP:
+		return "stop";
+	case RS_RINGID:
+		return "ringid";
+	case RS_QUORUM:
+		return "quorum";
+	case RS_FENCING:
+		return "fencing";
+	case RS_FS:
+		return "fs";
+	case RS_START_SENT:
+		return "start_sent";
+	case RS_MESSAGES:
+		return "messages";
+	case RS_KERNEL:
+		return "kernel";
+	case RS_PLOCKS:
+		return "plocks";
+	case RS_STAGES:
+		return "total";
+	default:
+		return "unknown";
+	}
+}
+
+static int print_recovery_stats(const char *name, struct recovery_stats *rs,
+				char *buf, int pos)
+{
+	char line[512];
+	uint64_t *h;
+	int i, ret;
+
+	if (!rs->count)
+		return pos;
+
+	for (i = 0; i <= RS_STAGES; i++) {
+		h = rs->hist[i];
+
+		memset(line, 0, sizeof(line));
+
+		snprintf(line, sizeof(line) - 1,
+			 "%s stage=%s count=%llu avg=%llu max=%llu "
+			 "hist=%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+			 name, stage_str(i),
+			 (unsigned long long)rs->count,
+			 (unsigned long long)(rs->usec_total[i] / rs->count),
+			 (unsigned long long)rs->usec_max[i],
+			 (unsigned long long)h[0], (unsigned long long)h[1],
+			 (unsigned long long)h[2], (unsigned long long)h[3],
+			 (unsigned long long)h[4], (unsigned long long)h[5],
+			 (unsigned long long)h[6], (unsigned long long)h[7]);
+
+		if (pos + strlen(line) >= LOG_DUMP_SIZE)
+			break;
+
+		ret = sprintf(buf + pos, "%s", line);
+		pos += ret;
+	}
+
+	return pos;
+}
+
+static int print_recovery_history(struct lockspace *ls, char *buf, int pos)
+{
+	struct recovery_record *rr;
+	char line[512];
+	int i, j, ret, off;
+
+	for (i = 0; i < RECOVERY_HISTORY; i++) {
+		rr = &ls->recovery_history[(ls->recovery_next + i) %
+					   RECOVERY_HISTORY];
+		if (!rr->seq)
+			continue;
+
+		memset(line, 0, sizeof(line));
+
+		off = snprintf(line, sizeof(line) - 1,
+			       "%s cg=%u combined=%u members=%d joined=%d "
+			       "removed=%d failed=%d time=%llu total=%llu",
+			       ls->name, rr->seq, rr->combined_seq,
+			       rr->member_count, rr->joined_count,
+			       rr->remove_count, rr->failed_count,
+			       (unsigned long long)rr->walltime,
+			       (unsigned long long)rr->total_usec);
+
+		for (j = 0; j < RS_STAGES; j++)
+			off += snprintf(line + off, sizeof(line) - 1 - off,
+					" %s=%llu", stage_str(j),
+					(unsigned long long)rr->stage_usec[j]);
+		strcat(line, "\n");
+
+		if (pos + strlen(line) >= LOG_DUMP_SIZE)
+			break;
+
+		ret = sprintf(buf + pos, "%s", line);
+		pos += ret;
+	}
+
+	return pos;
+}
+
+/* called from the query thread, don't log.  Without a name, the
+   daemon-wide stats are followed by the stats of each lockspace; with a
+   name, the lockspace stats are followed by its recent changes.  Times
+   are in usec. */
+
+int copy_recovery(char *name, char *buf, int *len_out)
+{
+	struct lockspace *ls;
+	int pos = 0;
+
+	if (name && name[0]) {
+		ls = find_ls(name);
+		if (!ls)
+			return -ENOENT;
+		pos = print_recovery_stats(ls->name, &ls->recovery_stats,
+					   buf, pos);
+		pos = print_recovery_history(ls, buf, pos);
+		goto out;
+	}
+
+	pos = print_recovery_stats("all", &recovery_stats_all, buf, pos);
+
+	list_for_each_entry(ls, &lockspaces, list)
+		pos = print_recovery_stats(ls->name, &ls->recovery_stats,
+					   buf, pos);
+ out:
+	*len_out = pos;
+	return 0;
+}
+
 static void apply_changes(struct lockspace *ls)
 {
-	struct change *cg;
+	struct change *cg, *oldest;
 
 	if (list_empty(&ls->changes))
 		return;
@@ -1165,17 +1432,27 @@ static void apply_changes(struct lockspace *ls)
 
 	case CGST_WAIT_CONDITIONS:
 		if (wait_conditions_done(ls)) {
+			oldest = list_entry(ls->changes.prev, struct change,
+					    list);
+			if (oldest != cg)
+				log_group(ls, "apply_changes cg %u supersedes "
+					  "cg %u", cg->seq, oldest->seq);
 			send_nacks(ls, cg);
 			send_start(ls, cg);
+			stage_done(cg, RS_START_SENT);
 			cg->state = CGST_WAIT_MESSAGES;
 		}
 		break;
 
 	case CGST_WAIT_MESSAGES:
 		if (wait_messages_done(ls)) {
+			stage_done(cg, RS_MESSAGES);
 			set_protocol_stateful();
 			start_kernel(ls);
+			stage_done(cg, RS_KERNEL);
 			prepare_plocks(ls);
+			stage_done(cg, RS_PLOCKS);
+			record_recovery(ls, cg);
 			cleanup_changes(ls);
 		}
 		break;
@@ -1185,6 +1462,14 @@ static void apply_changes(struct lockspace *ls)
 	}
 }
 
+/* the last of the lockspace's queued sysfs/configfs writes is done */
+
+void kernel_ops_complete(struct lockspace *ls)
+{
+	if (!list_empty(&ls->changes))
+		apply_changes(ls);
+}
+
 void process_lockspace_changes(void)
 {
 	struct lockspace *ls, *safe;
@@ -1209,7 +1494,7 @@ static int add_change(struct lockspace *ls,
 {
 	struct change *cg;
 	struct member *memb;
-	int i, error;
+	int i, slot, error;
 	uint64_t now = monotime();
 
 	cg = malloc(sizeof(struct change));
@@ -1220,6 +1505,7 @@ static int add_change(struct lockspace *ls,
 	INIT_LIST_HEAD(&cg->removed);
 	cg->state = CGST_WAIT_CONDITIONS;
 	cg->create_time = now;
+	cg->create_usec = monotime_usec();
 	cg->seq = ++ls->change_seq;
 	if (!cg->seq)
 		cg->seq = ++ls->change_seq;
@@ -1235,6 +1521,14 @@ static int add_change(struct lockspace *ls,
 		memset(memb, 0, sizeof(struct member));
 		memb->nodeid = member_list[i].nodeid;
 		list_add_tail(&memb->list, &cg->members);
+
+		slot = node_slot(memb->nodeid);
+		if (slot >= 0) {
+			cg->member_slots[slot] = memb;
+			node_map_set(&cg->member_map, slot);
+		} else {
+			cg->member_noslot++;
+		}
 	}
 
 	for (i = 0; i < left_list_entries; i++) {
@@ -1352,7 +1646,7 @@ static void confchg_cb(cpg_handle_t handle,
 		log_group(ls, "confchg for our leave");
 		stop_kernel(ls, 0);
 		set_configfs_members(ls, ls->name, 0, NULL, 0, NULL);
-		set_sysfs_event_done(ls->name, 0);
+		set_sysfs_event_done(ls, 0);
 		cpg_finalize(ls->cpg_handle);
 		client_dead(ls->cpg_client);
 		purge_plocks(ls, our_nodeid, 1);
@@ -1367,12 +1661,17 @@ static void confchg_cb(cpg_handle_t handle,
 	if (rv)
 		return;
 
+	if (ls->joining && !ls->join_confchg_usec)
+		ls->join_confchg_usec = monotime_usec();
+
 	stop_kernel(ls, cg->seq);
 
 	list_for_each_entry(memb, &cg->removed, list)
 		purge_plocks(ls, memb->nodeid, 0);
 
-	apply_changes(ls);
+	/* process_cpg_lockspace applies the newest change once all the
+	   queued callbacks are dispatched, see comment there */
+	ls->apply_deferred = 1;
 
 #if 0
 	deadlk_confchg(ls, member_list, member_list_entries,
@@ -1394,6 +1693,7 @@ static void deliver_cb(cpg_handle_t handle,
 {
 	struct lockspace *ls;
 	struct dlm_header *hd;
+	uint64_t start_usec = monotime_usec();
 	int ignore_plock;
 	int rv;
 
@@ -1504,35 +1804,51 @@ static void deliver_cb(cpg_handle_t handle,
 
 #if 0
 	case DLM_MSG_DEADLK_CYCLE_START:
-		if (opt(enable_deadlk))
+		if (opt(enable_deadlk_ind))
 			receive_cycle_start(ls, hd, len);
 		else
 			log_error("msg %d nodeid %d enable_deadlk %d",
-				  hd->type, nodeid, opt(enable_deadlk));
+				  hd->type, nodeid, opt(enable_deadlk_ind));
 		break;
 
 	case DLM_MSG_DEADLK_CYCLE_END:
-		if (opt(enable_deadlk))
+		if (opt(enable_deadlk_ind))
 			receive_cycle_end(ls, hd, len);
 		else
 			log_error("msg %d nodeid %d enable_deadlk %d",
-				  hd->type, nodeid, opt(enable_deadlk));
+				  hd->type, nodeid, opt(enable_deadlk_ind));
 		break;
 
-	case DLM_MSG_DEADLK_CHECKPOINT_READY:
-		if (opt(enable_deadlk))
-			receive_checkpoint_ready(ls, hd, len);
+	case DLM_MSG_DEADLK_LOCKS_DATA:
+		if (opt(enable_deadlk_ind))
+			receive_locks_data(ls, hd, len);
 		else
 			log_error("msg %d nodeid %d enable_deadlk %d",
-				  hd->type, nodeid, opt(enable_deadlk));
+				  hd->type, nodeid, opt(enable_deadlk_ind));
+		break;
+
+	case DLM_MSG_DEADLK_LOCKS_DONE:
+		if (opt(enable_deadlk_ind))
+			receive_locks_done(ls, hd, len);
+		else
+			log_error("msg %d nodeid %d enable_deadlk %d",
+				  hd->type, nodeid, opt(enable_deadlk_ind));
+		break;
+
+	case DLM_MSG_DEADLK_REFRESH:
+		if (opt(enable_deadlk_ind))
+			receive_refresh(ls, hd, len);
+		else
+			log_error("msg %d nodeid %d enable_deadlk %d",
+				  hd->type, nodeid, opt(enable_deadlk_ind));
 		break;
 
 	case DLM_MSG_DEADLK_CANCEL_LOCK:
-		if (opt(enable_deadlk))
+		if (opt(enable_deadlk_ind))
 			receive_cancel_lock(ls, hd, len);
 		else
 			log_error("msg %d nodeid %d enable_deadlk %d",
-				  hd->type, nodeid, opt(enable_deadlk));
+				  hd->type, nodeid, opt(enable_deadlk_ind));
 		break;
 #endif
 
@@ -1544,6 +1860,8 @@ static void deliver_cb(cpg_handle_t handle,
 		log_plock(ls, "msg %s nodeid %d need_plock ignore",
 			  msg_name(hd->type), nodeid);
 
+	msg_stats_recv(ls->msg_stats, hd, len, start_usec);
+
 	apply_changes(ls);
 }
 
@@ -1573,8 +1891,7 @@ static void totem_cb(cpg_handle_t handle,
 	ls->cpg_ringid.nodeid = ring_id.nodeid;
 	ls->cpg_ringid.seq = ring_id.seq;
 	ls->cpg_ringid_wait = 0;
-
-	apply_changes(ls);
+	ls->apply_deferred = 1;
 }
 
 static cpg_model_v1_data_t cpg_callbacks = {
@@ -1584,6 +1901,17 @@ static cpg_model_v1_data_t cpg_callbacks = {
 	.flags = CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF,
 };
 
+/* During a burst of failures several confchgs are often queued on the cpg
+   at once.  Each one adds a new change to the head of ls->changes, and
+   only the head change is started, so applying changes after each confchg
+   would send a start for every intermediate membership that the following
+   confchg has already superseded (and nack it again if the membership comes
+   back).  Instead confchg_cb and totem_cb just stop the kernel and record
+   the change, and the newest change is applied once after the whole batch
+   is dispatched.  deliver_cb still applies changes immediately since plock
+   messages following the last start in the same batch depend on
+   prepare_plocks() having been done. */
+
 static void process_cpg_lockspace(int ci)
 {
 	struct lockspace *ls;
@@ -1600,71 +1928,149 @@ static void process_cpg_lockspace(int ci)
 		log_error("cpg_dispatch error %d", error);
 		return;
 	}
+
+	/* the ls is freed by the confchg for our own leave */
+	ls = find_ls_ci(ci);
+	if (!ls || !ls->apply_deferred)
+		return;
+
+	ls->apply_deferred = 0;
+	apply_changes(ls);
 }
 
 /* received an "online" uevent from dlm-kernel */
 
 int dlm_join_lockspace(struct lockspace *ls)
 {
-	cs_error_t error;
-	cpg_handle_t h;
 	struct cpg_name name;
-	int i = 0, fd, ci, rv;
 
-	error = cpg_model_initialize(&h, CPG_MODEL_V1,
-				     (cpg_model_data_t *)&cpg_callbacks, NULL);
-	if (error != CS_OK) {
-		log_error("cpg_model_initialize error %d", error);
-		rv = -1;
-		goto fail_free;
+	memset(&name, 0, sizeof(name));
+	sprintf(name.value, "dlm:ls:%s", ls->name);
+	name.length = strlen(name.value) + 1;
+
+	/* TODO: allow global_id to be set in cluster.conf? */
+	ls->global_id = cpgname_to_crc(name.value, name.length);
+
+	ls_index_add(ls, LS_HASH_NAME);
+	ls_index_add(ls, LS_HASH_ID);
+
+	ls->cpg_client = -1;
+	ls->join_queue_usec = monotime_usec();
+	ls->join_queued = 1;
+	list_add_tail(&ls->join_list, &join_queue);
+	poll_joins = 1;
+
+	log_group(ls, "join queued");
+	return 0;
+}
+
+static void cancel_join(struct lockspace *ls, int result)
+{
+	list_del_init(&ls->join_list);
+	ls->join_queued = 0;
+
+	if (ls->cpg_client >= 0) {
+		client_dead(ls->cpg_client);
+		cpg_finalize(ls->cpg_handle);
 	}
 
-	cpg_fd_get(h, &fd);
+	set_sysfs_event_done(ls, result);
+	free_ls(ls);
+}
+
+/* returns 0 when joined, 1 to retry later, < 0 on error */
 
-	ci = client_add(fd, process_cpg_lockspace, NULL);
+static int start_join(struct lockspace *ls)
+{
+	cs_error_t error;
+	cpg_handle_t h;
+	struct cpg_name name;
+	int fd;
+
+	if (ls->cpg_client < 0) {
+		error = cpg_model_initialize(&h, CPG_MODEL_V1,
+					     (cpg_model_data_t *)&cpg_callbacks,
+					     NULL);
+		if (error != CS_OK) {
+			log_error("cpg_model_initialize error %d", error);
+			return -1;
+		}
 
-	list_add(&ls->list, &lockspaces);
+		cpg_fd_get(h, &fd);
 
-	ls->cpg_handle = h;
-	ls->cpg_client = ci;
-	ls->cpg_fd = fd;
-	ls->kernel_stopped = 1;
-	ls->need_plocks = 1;
-	ls->joining = 1;
+		ls->cpg_handle = h;
+		ls->cpg_client = client_add(fd, CLIENT_PRI_LS,
+					    process_cpg_lockspace, NULL);
+		ls->cpg_fd = fd;
+		ls->kernel_stopped = 1;
+		ls->need_plocks = 1;
+		ls->joining = 1;
+
+		ls_index_add(ls, LS_HASH_HANDLE);
+		ls_index_add(ls, LS_HASH_CI);
+	}
 
 	memset(&name, 0, sizeof(name));
 	sprintf(name.value, "dlm:ls:%s", ls->name);
 	name.length = strlen(name.value) + 1;
 
-	/* TODO: allow global_id to be set in cluster.conf? */
-	ls->global_id = cpgname_to_crc(name.value, name.length);
+	if (!ls->join_retries)
+		log_group(ls, "cpg_join %s ...", name.value);
 
-	log_group(ls, "cpg_join %s ...", name.value);
- retry:
-	error = cpg_join(h, &name);
+	error = cpg_join(ls->cpg_handle, &name);
 	if (error == CS_ERR_TRY_AGAIN) {
-		sleep(1);
-		if (!(++i % 10))
+		if (!(++ls->join_retries % 10))
 			log_error("cpg_join error retrying");
-		goto retry;
+		return 1;
 	}
 	if (error != CS_OK) {
 		log_error("cpg_join error %d", error);
-		cpg_finalize(h);
-		rv = -1;
-		goto fail;
+		return -1;
 	}
 
 	return 0;
+}
 
- fail:
-	list_del(&ls->list);
-	client_dead(ci);
-	cpg_finalize(h);
- fail_free:
-	set_sysfs_event_done(ls->name, rv);
-	free_ls(ls);
-	return rv;
+void process_lockspace_joins(void)
+{
+	struct lockspace *ls;
+	int max = opt(join_concurrency_ind);
+	int rv;
+
+	poll_joins = 0;
+
+	while (!list_empty(&join_queue)) {
+		if (max > 0 && joins_inflight >= max)
+			break;
+
+		ls = list_first_entry(&join_queue, struct lockspace, join_list);
+
+		rv = start_join(ls);
+		if (rv > 0) {
+			poll_joins = 1;
+			break;
+		}
+		if (rv < 0) {
+			cancel_join(ls, rv);
+			continue;
+		}
+
+		list_del_init(&ls->join_list);
+		ls->join_queued = 0;
+		list_add(&ls->list, &lockspaces);
+
+		ls->join_cpg_usec = monotime_usec();
+		ls->join_inflight = 1;
+		joins_inflight++;
+	}
+}
+
+/* lockspaces still in join_queue aren't on the lockspaces list yet, but
+   are as active for shutdown */
+
+int joins_pending(void)
+{
+	return !list_empty(&join_queue);
 }
 
 /* received an "offline" uevent from dlm-kernel */
@@ -1675,6 +2081,12 @@ int dlm_leave_lockspace(struct lockspace *ls)
 	struct cpg_name name;
 	int i = 0;
 
+	if (ls->join_queued) {
+		log_group(ls, "leave while join queued");
+		cancel_join(ls, 0);
+		return 0;
+	}
+
 	ls->leaving = 1;
 
 	memset(&name, 0, sizeof(name));
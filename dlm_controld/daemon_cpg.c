@@ -65,12 +65,22 @@ struct node_daemon {
 	int fence_pid;
 	int fence_pid_wait;
 	int fence_result_wait;
+	int fence_running;	/* agents running for the current devices */
+	int fence_group_result;	/* first failure from the current devices */
+	int fence_timeouts;	/* for status/debug */
+	int fence_pids[FENCE_CONFIG_DEVS_MAX];
+	uint64_t fence_dev_start[FENCE_CONFIG_DEVS_MAX];	/* monotime */
+	uint64_t fence_fail_usec; /* monotime_usec of these, for status */
+	uint64_t fence_request_usec;
+	uint64_t fence_agents_usec;
+	uint64_t fence_done_usec;
 	int fence_actor_done; /* for status/debug */
 	int fence_actor_last; /* for status/debug */
 	int fence_actors[MAX_NODES];
 
 	struct protocol proto;
 	struct fence_config fence_config;
+	int fence_config_reloads; /* config_reloads when read */
 
 	uint64_t daemon_add_time;
 	uint64_t daemon_rem_time;
@@ -86,6 +96,7 @@ static cpg_handle_t cpg_handle_daemon;
 static int cpg_fd_daemon;
 static struct protocol our_protocol;
 static struct list_head daemon_nodes;
+static struct node_daemon *daemon_node_slots[NODE_SLOTS];
 static struct list_head startup_nodes;
 static struct cpg_address daemon_member[MAX_NODES];
 static struct cpg_address daemon_joined[MAX_NODES];
@@ -95,6 +106,7 @@ static int daemon_joined_count;
 static int daemon_remove_count;
 static int daemon_ringid_wait;
 static struct cpg_ring_id daemon_ringid;
+static struct msg_stats daemon_msg_stats[DLM_MSG_MAX];
 static int daemon_fence_pid;
 static uint64_t daemon_last_join_monotime;
 static uint32_t last_join_seq;
@@ -238,17 +250,24 @@ const char *msg_name(int type)
 		return "deadlk_cycle_start";
 	case DLM_MSG_DEADLK_CYCLE_END:
 		return "deadlk_cycle_end";
-	case DLM_MSG_DEADLK_CHECKPOINT_READY:
-		return "deadlk_checkpoint_ready";
+	case DLM_MSG_DEADLK_LOCKS_DONE:
+		return "deadlk_locks_done";
 	case DLM_MSG_DEADLK_CANCEL_LOCK:
 		return "deadlk_cancel_lock";
+	case DLM_MSG_DEADLK_LOCKS_DATA:
+		return "deadlk_locks_data";
+	case DLM_MSG_DEADLK_REFRESH:
+		return "deadlk_refresh";
 	default:
 		return "unknown";
 	}
 }
 
-static int _send_message(cpg_handle_t h, void *buf, int len, int type)
+static int _send_message(cpg_handle_t h, struct msg_stats *stats,
+			 void *buf, int len, int type)
 {
+	struct dlm_header *hd = (struct dlm_header *)buf;
+	struct msg_stats *ms;
 	struct iovec iov;
 	cs_error_t error;
 	int retries = 0;
@@ -256,6 +275,8 @@ static int _send_message(cpg_handle_t h, void *buf, int len, int type)
 	iov.iov_base = buf;
 	iov.iov_len = len;
 
+	hd->send_time = cpu_to_le64(monotime_usec());
+
  retry:
 	error = cpg_mcast_joined(h, CPG_TYPE_AGREED, &iov, 1);
 	if (error == CS_ERR_TRY_AGAIN) {
@@ -266,12 +287,19 @@ static int _send_message(cpg_handle_t h, void *buf, int len, int type)
 				   retries, msg_name(type));
 		goto retry;
 	}
+
+	ms = &stats[(type > 0 && type < DLM_MSG_MAX) ? type : 0];
+	ms->send_retries += retries;
+
 	if (error != CS_OK) {
 		log_error("cpg_mcast_joined error %d handle %llx %s",
 			  error, (unsigned long long)h, msg_name(type));
 		return -1;
 	}
 
+	ms->send_count++;
+	ms->send_bytes += len;
+
 	if (retries)
 		log_debug("cpg_mcast_joined retried %d %s",
 			  retries, msg_name(type));
@@ -297,7 +325,7 @@ void dlm_send_message(struct lockspace *ls, char *buf, int len)
 	hd->msgdata     = cpu_to_le32(hd->msgdata);
 	hd->msgdata2    = cpu_to_le32(hd->msgdata2);
 
-	_send_message(ls->cpg_handle, buf, len, type);
+	_send_message(ls->cpg_handle, ls->msg_stats, buf, len, type);
 }
 
 void dlm_header_in(struct dlm_header *hd)
@@ -312,6 +340,7 @@ void dlm_header_in(struct dlm_header *hd)
 	hd->flags       = le32_to_cpu(hd->flags);
 	hd->msgdata     = le32_to_cpu(hd->msgdata);
 	hd->msgdata2    = le32_to_cpu(hd->msgdata2);
+	hd->send_time   = le64_to_cpu(hd->send_time);
 }
 
 int dlm_header_validate(struct dlm_header *hd, int nodeid)
@@ -334,9 +363,120 @@ int dlm_header_validate(struct dlm_header *hd, int nodeid)
 	return 0;
 }
 
+/* called after a message has been handled; start_usec is the time the
+   message was delivered to us */
+
+void msg_stats_recv(struct msg_stats *stats, struct dlm_header *hd, int len,
+		    uint64_t start_usec)
+{
+	struct msg_stats *ms;
+	uint64_t now = monotime_usec();
+	uint64_t usec;
+
+	ms = &stats[(hd->type > 0 && hd->type < DLM_MSG_MAX) ? hd->type : 0];
+
+	ms->recv_count++;
+	ms->recv_bytes += len;
+
+	usec = now - start_usec;
+	ms->handle_hist[usec_hist_bucket(usec)]++;
+	if (usec > ms->handle_usec_max)
+		ms->handle_usec_max = usec;
+
+	if (hd->nodeid != our_nodeid || !hd->send_time ||
+	    hd->send_time > start_usec)
+		return;
+
+	usec = start_usec - hd->send_time;
+	ms->latency_count++;
+	ms->latency_usec_total += usec;
+	if (usec > ms->latency_usec_max)
+		ms->latency_usec_max = usec;
+}
+
+static int print_msg_stats(const char *name, struct msg_stats *stats,
+			   char *buf, int pos)
+{
+	struct msg_stats *ms;
+	char line[512];
+	int type, ret;
+
+	for (type = 0; type < DLM_MSG_MAX; type++) {
+		ms = &stats[type];
+
+		if (!ms->send_count && !ms->recv_count && !ms->send_retries)
+			continue;
+
+		memset(line, 0, sizeof(line));
+
+		snprintf(line, sizeof(line) - 1,
+			 "%s %s send=%llu send_bytes=%llu send_retries=%llu "
+			 "recv=%llu recv_bytes=%llu latency_count=%llu "
+			 "latency_avg=%llu latency_max=%llu handle_max=%llu "
+			 "handle_hist=%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+			 name, msg_name(type),
+			 (unsigned long long)ms->send_count,
+			 (unsigned long long)ms->send_bytes,
+			 (unsigned long long)ms->send_retries,
+			 (unsigned long long)ms->recv_count,
+			 (unsigned long long)ms->recv_bytes,
+			 (unsigned long long)ms->latency_count,
+			 (unsigned long long)(ms->latency_count ?
+			 	ms->latency_usec_total / ms->latency_count : 0),
+			 (unsigned long long)ms->latency_usec_max,
+			 (unsigned long long)ms->handle_usec_max,
+			 (unsigned long long)ms->handle_hist[0],
+			 (unsigned long long)ms->handle_hist[1],
+			 (unsigned long long)ms->handle_hist[2],
+			 (unsigned long long)ms->handle_hist[3],
+			 (unsigned long long)ms->handle_hist[4],
+			 (unsigned long long)ms->handle_hist[5],
+			 (unsigned long long)ms->handle_hist[6],
+			 (unsigned long long)ms->handle_hist[7]);
+
+		if (pos + strlen(line) >= LOG_DUMP_SIZE)
+			break;
+
+		ret = sprintf(buf + pos, "%s", line);
+		pos += ret;
+	}
+
+	return pos;
+}
+
+/* called from the query thread, don't log.  With no name, the daemon cpg
+   stats are followed by every lockspace; times are in usec. */
+
+int copy_msg_stats(char *name, char *buf, int *len_out)
+{
+	struct lockspace *ls;
+	int pos = 0;
+
+	if (name && name[0]) {
+		ls = find_ls(name);
+		if (!ls)
+			return -ENOENT;
+		pos = print_msg_stats(ls->name, ls->msg_stats, buf, pos);
+		goto out;
+	}
+
+	pos = print_msg_stats("dlm_controld", daemon_msg_stats, buf, pos);
+
+	list_for_each_entry(ls, &lockspaces, list)
+		pos = print_msg_stats(ls->name, ls->msg_stats, buf, pos);
+ out:
+	*len_out = pos;
+	return 0;
+}
+
 static struct node_daemon *get_node_daemon(int nodeid)
 {
 	struct node_daemon *node;
+	int slot;
+
+	slot = node_slot_find(nodeid);
+	if (slot >= 0)
+		return daemon_node_slots[slot];
 
 	list_for_each_entry(node, &daemon_nodes, list) {
 		if (node->nodeid == nodeid)
@@ -431,11 +571,45 @@ static int clear_startup_node(int nodeid, int all)
 	return count;
 }
 
+/* called when the node is added, and again before fencing the node if
+   dlm.conf has been reloaded since */
+
+static void read_node_fence_config(struct node_daemon *node)
+{
+	struct fence_config *fc = &node->fence_config;
+	int rv;
+
+	if (fc->dev[0] == &fence_all_device)
+		memset(fc, 0, sizeof(struct fence_config));
+	else
+		fence_config_free(fc);
+
+	fc->nodeid = node->nodeid;
+	node->fence_config_reloads = config_reloads;
+
+	/* explicit config file setting */
+
+	rv = get_fence_config(node->nodeid, fc);
+	if (!rv)
+		return;
+
+	/* no config file setting, so use default */
+
+	memset(fc, 0, sizeof(struct fence_config));
+	fc->nodeid = node->nodeid;
+
+	if (rv == -ENOENT) {
+		fc->dev[0] = &fence_all_device;
+		return;
+	}
+
+	log_error("fence config %d error %d", node->nodeid, rv);
+}
+
 static struct node_daemon *add_node_daemon(int nodeid)
 {
 	struct node_daemon *node;
-	struct fence_config *fc;
-	int rv;
+	int slot;
 
 	node = get_node_daemon(nodeid);
 	if (node)
@@ -450,26 +624,11 @@ static struct node_daemon *add_node_daemon(int nodeid)
 	node->nodeid = nodeid;
 	list_add_tail(&node->list, &daemon_nodes);
 
-	/* TODO: allow the config to be reread */
-
-	fc = &node->fence_config;
-	fc->nodeid = nodeid;
-
-	/* explicit config file setting */
-
-	rv = fence_config_init(fc, (unsigned int)nodeid, (char *)CONF_FILE_PATH);
-	if (!rv)
-		goto out;
-
-	/* no config file setting, so use default */
+	slot = node_slot(nodeid);
+	if (slot >= 0)
+		daemon_node_slots[slot] = node;
 
-	if (rv == -ENOENT) {
-		fc->dev[0] = &fence_all_device;
-		goto out;
-	}
-
-	log_error("fence config %d error %d", nodeid, rv);
- out:
+	read_node_fence_config(node);
 	return node;
 }
 
@@ -632,6 +791,89 @@ static void fence_pid_cancel(int nodeid, int pid)
 		  nodeid, pid, rv, result);
 }
 
+/* number of nodes we are currently running fence agents for */
+
+static int fence_running_nodes(void)
+{
+	struct node_daemon *node;
+	int count = 0;
+
+	list_for_each_entry(node, &daemon_nodes, list) {
+		if (node->fence_running)
+			count++;
+	}
+	return count;
+}
+
+static void fence_cancel_node(struct node_daemon *node)
+{
+	int i;
+
+	for (i = 0; i < FENCE_CONFIG_DEVS_MAX; i++) {
+		if (!node->fence_pids[i])
+			continue;
+		fence_pid_cancel(node->nodeid, node->fence_pids[i]);
+		node->fence_pids[i] = 0;
+	}
+
+	node->fence_running = 0;
+	node->fence_group_result = 0;
+	node->fence_pid_wait = 0;
+	node->fence_pid = 0;
+
+	if (!fence_running_nodes())
+		daemon_fence_pid = 0;
+}
+
+/*
+ * Start agents for the device at fence_config.pos and all the devices
+ * following it with the same base name (parallel devices, e.g. two
+ * power switches.)  They all run at once, and the check loop in
+ * daemon_fence_work waits for every one of them before deciding the
+ * result for this priority level.  Returns an error only if no agent
+ * could be started.
+ */
+
+static int fence_request_devs(struct node_daemon *node)
+{
+	struct fence_config *fc = &node->fence_config;
+	int rv, pid;
+
+	while (1) {
+		log_debug("fence request %d pos %d", node->nodeid, fc->pos);
+
+		rv = fence_request(node->nodeid,
+				   node->fail_walltime,
+				   node->fail_monotime,
+				   fc,
+				   node->left_reason,
+				   &pid);
+		if (rv < 0)
+			break;
+
+		node->fence_pids[fc->pos] = pid;
+		node->fence_dev_start[fc->pos] = monotime();
+		node->fence_running++;
+		if (!node->fence_pid)
+			node->fence_pid = pid;
+		daemon_fence_pid = pid;
+
+		if (fence_config_next_parallel(fc) < 0)
+			break;
+	}
+
+	if (!node->fence_running)
+		return rv;
+
+	/* the agents already started determine when this
+	   priority level is done, and it's a failure */
+	if (rv < 0)
+		node->fence_group_result = rv;
+
+	node->fence_pid_wait = 1;
+	return 0;
+}
+
 /*
  * fence_in_progress_unknown (fipu)
  *
@@ -721,7 +963,8 @@ static void fence_pid_cancel(int nodeid, int pid)
 static void daemon_fence_work(void)
 {
 	struct node_daemon *node, *safe;
-	int rv, nodeid, pid, need, low, actor, result;
+	struct fence_device *dev;
+	int i, rv, nodeid, pid, need, low, actor, result;
 	uint32_t flags;
 
 	if (daemon_ringid_wait) {
@@ -796,10 +1039,16 @@ static void daemon_fence_work(void)
 		node->fence_pid_wait = 0;
 		node->fence_pid = 0;
 		node->fence_result_wait = 0;
+		if (node->fence_config_reloads != config_reloads)
+			read_node_fence_config(node);
 		node->fence_config.pos = 0;
 		node->left_reason = REASON_STARTUP_FENCING;
 		node->fail_monotime = cluster_joined_monotime - 1;
 		node->fail_walltime = cluster_joined_walltime - 1;
+		node->fence_fail_usec = monotime_usec();
+		node->fence_request_usec = 0;
+		node->fence_agents_usec = 0;
+		node->fence_done_usec = 0;
 		low = set_fence_actors(node, 1);
 
 		log_debug("fence startup nodeid %d act %d", node->nodeid, low);
@@ -844,6 +1093,15 @@ static void daemon_fence_work(void)
 			continue;
 		}
 
+		if (opt(enable_concurrent_fencing_ind) && opt(fence_concurrency_ind) &&
+		    fence_running_nodes() >= opt(fence_concurrency_ind)) {
+			log_debug("fence request %d delay for concurrency %d",
+				  node->nodeid, opt(fence_concurrency_ind));
+			node->delay_fencing = 1;
+			poll_fencing++;
+			continue;
+		}
+
 		if (monotime() - cluster_last_join_monotime < opt(post_join_delay_ind)) {
 			log_debug("fence request %d delay %d from %llu",
 				  node->nodeid, opt(post_join_delay_ind),
@@ -872,24 +1130,16 @@ static void daemon_fence_work(void)
 			continue;
 		}
 
-		log_debug("fence request %d pos %d",
-			  node->nodeid, node->fence_config.pos);
+		if (!node->fence_request_usec)
+			node->fence_request_usec = monotime_usec();
 
-		rv = fence_request(node->nodeid,
-				   node->fail_walltime,
-				   node->fail_monotime,
-				   &node->fence_config,
-				   node->left_reason,
-				   &pid);
+		rv = fence_request_devs(node);
 		if (rv < 0) {
+			node->fence_agents_usec = monotime_usec();
 			send_fence_result(node->nodeid, rv, 0, time(NULL));
 			node->fence_result_wait = 1;
 			continue;
 		}
-
-		node->fence_pid_wait = 1;
-		node->fence_pid = pid;
-		daemon_fence_pid = pid;
 	}
 
 	/*
@@ -922,7 +1172,6 @@ static void daemon_fence_work(void)
 		}
 
 		nodeid = node->nodeid;
-		pid = node->fence_pid;
 
 		if (is_clean_daemon_member(nodeid)) {
 			/*
@@ -931,7 +1180,8 @@ static void daemon_fence_work(void)
 			 * will see and do this, so we don't need to send
 			 * a fence result.
 			 */
-			log_debug("fence wait %d pid %d skip member", nodeid, pid);
+			log_debug("fence wait %d pid %d skip member", nodeid,
+				  node->fence_pid);
 
 			node->need_fencing = 0;
 			node->delay_fencing = 0;
@@ -939,53 +1189,89 @@ static void daemon_fence_work(void)
 			node->fence_monotime = monotime();
 			node->fence_actor_done = nodeid;
 
-			node->fence_pid_wait = 0;
-			node->fence_pid = 0;
-			daemon_fence_pid = 0;
-
-			fence_pid_cancel(nodeid, pid);
+			fence_cancel_node(node);
 			continue;
 		}
 
-		poll_fencing++;
+		for (i = 0; i < FENCE_CONFIG_DEVS_MAX; i++) {
+			pid = node->fence_pids[i];
+			if (!pid)
+				continue;
 
-		rv = fence_result(nodeid, pid, &result);
-		if (rv == -EAGAIN) {
-			/* agent pid is still running */
-			log_debug("fence wait %d pid %d running", nodeid, pid);
-			continue;
+			dev = node->fence_config.dev[i];
+
+			rv = fence_result(nodeid, pid, &result);
+			if (rv == -EAGAIN) {
+				if (!dev || !dev->timeout) {
+					/* agent pid is still running, SIGCHLD
+					   will get us back here (see
+					   process_sigchld) */
+					log_debug("fence wait %d pid %d running",
+						  nodeid, pid);
+					continue;
+				}
+
+				if (monotime() - node->fence_dev_start[i] < dev->timeout) {
+					log_debug("fence wait %d pid %d running timeout %d",
+						  nodeid, pid, dev->timeout);
+					poll_fencing++;
+					continue;
+				}
+
+				log_error("fence wait %d pid %d %s agent_timeout %d",
+					  nodeid, pid, dev->name, dev->timeout);
+				fence_pid_cancel(nodeid, pid);
+				node->fence_timeouts++;
+				rv = 0;
+				result = -ETIMEDOUT;
+			}
+
+			node->fence_pids[i] = 0;
+			node->fence_running--;
+
+			if (rv < 0) {
+				/* shouldn't happen */
+				log_error("fence wait %d pid %d error %d", nodeid, pid, rv);
+				result = rv;
+			}
+
+			log_debug("fence wait %d pid %d result %d", nodeid, pid, result);
+
+			if (result && !node->fence_group_result)
+				node->fence_group_result = result;
 		}
 
+		if (node->fence_running)
+			continue;
+
+		/* all agents for the parallel devices have finished */
+
+		result = node->fence_group_result;
+		node->fence_group_result = 0;
 		node->fence_pid_wait = 0;
 		node->fence_pid = 0;
-		daemon_fence_pid = 0;
 
-		if (rv < 0) {
-			/* shouldn't happen */
-			log_error("fence wait %d pid %d error %d", nodeid, pid, rv);
+		if (!fence_running_nodes())
+			daemon_fence_pid = 0;
+
+		if (!result) {
+			/* every agent exit 0, success */
+			node->fence_agents_usec = monotime_usec();
+			send_fence_result(nodeid, 0, 0, time(NULL));
+			node->fence_result_wait = 1;
 			continue;
 		}
 
-		log_debug("fence wait %d pid %d result %d", nodeid, pid, result);
+		/* an agent failed, if there's another device at next
+		   priority, request it next, otherwise fail */
 
-		if (!result) {
-			/* agent exit 0, if there's another agent to run in
-			   parallel, set it to run next, otherwise success */
-
-			rv = fence_config_next_parallel(&node->fence_config);
-			if (rv < 0) {
-				send_fence_result(nodeid, 0, 0, time(NULL));
-				node->fence_result_wait = 1;
-			}
+		rv = fence_config_next_priority(&node->fence_config);
+		if (rv < 0) {
+			node->fence_agents_usec = monotime_usec();
+			send_fence_result(nodeid, result, 0, time(NULL));
+			node->fence_result_wait = 1;
 		} else {
-			/* agent exit 1, if there's another agent to run at
-			   next priority, set it to run next, otherwise fail */
-
-			rv = fence_config_next_priority(&node->fence_config);
-			if (rv < 0) {
-				send_fence_result(nodeid, result, 0, time(NULL));
-				node->fence_result_wait = 1;
-			}
+			poll_fencing++;
 		}
 	}
 
@@ -1194,7 +1480,8 @@ static void send_fence_clear(int nodeid, int result, uint32_t flags, uint64_t wa
 	fr->result         = cpu_to_le32(result);
 	fr->fence_walltime = cpu_to_le64(walltime);
 
-	_send_message(cpg_handle_daemon, buf, len, DLM_MSG_FENCE_CLEAR);
+	_send_message(cpg_handle_daemon, daemon_msg_stats, buf, len,
+		      DLM_MSG_FENCE_CLEAR);
 }
 
 static void receive_fence_result(struct dlm_header *hd, int len)
@@ -1260,18 +1547,14 @@ static void receive_fence_result(struct dlm_header *hd, int len)
 		node->fence_walltime = fr->fence_walltime;
 		node->fence_monotime = now;
 		node->fence_actor_done = hd->nodeid;
+		node->fence_done_usec = monotime_usec();
 	} else {
 		/* causes the next lowest nodeid to request fencing */
 		clear_fence_actor(fr->nodeid, hd->nodeid);
 	}
 
-	if ((fr->result == -ECANCELED) && node->fence_pid_wait && node->fence_pid) {
-		fence_pid_cancel(node->nodeid, node->fence_pid);
-
-		node->fence_pid_wait = 0;
-		node->fence_pid = 0;
-		daemon_fence_pid = 0;
-	}
+	if ((fr->result == -ECANCELED) && node->fence_pid_wait && node->fence_pid)
+		fence_cancel_node(node);
 }
 
 static void send_fence_result(int nodeid, int result, uint32_t flags, uint64_t walltime)
@@ -1300,7 +1583,8 @@ static void send_fence_result(int nodeid, int result, uint32_t flags, uint64_t w
 	fr->result         = cpu_to_le32(result);
 	fr->fence_walltime = cpu_to_le64(walltime);
 
-	_send_message(cpg_handle_daemon, buf, len, DLM_MSG_FENCE_RESULT);
+	_send_message(cpg_handle_daemon, daemon_msg_stats, buf, len,
+		      DLM_MSG_FENCE_RESULT);
 }
 
 void fence_ack_node(int nodeid)
@@ -1609,7 +1893,8 @@ static void send_protocol(struct protocol *proto)
 	memcpy(pr, proto, sizeof(struct protocol));
 	protocol_out(pr);
 
-	_send_message(cpg_handle_daemon, buf, len, DLM_MSG_PROTOCOL);
+	_send_message(cpg_handle_daemon, daemon_msg_stats, buf, len,
+		      DLM_MSG_PROTOCOL);
 }
 
 int set_protocol(void)
@@ -1723,6 +2008,7 @@ static void deliver_cb_daemon(cpg_handle_t handle,
 			      void *data, size_t len)
 {
 	struct dlm_header *hd;
+	uint64_t start_usec = monotime_usec();
 
 	if (len < sizeof(*hd)) {
 		log_error("deliver_cb short message %zd", len);
@@ -1746,6 +2032,8 @@ static void deliver_cb_daemon(cpg_handle_t handle,
 		log_error("deliver_cb_daemon unknown msg type %d", hd->type);
 	}
 
+	msg_stats_recv(daemon_msg_stats, hd, len, start_usec);
+
 	daemon_fence_work();
 }
 
@@ -1897,10 +2185,16 @@ static void confchg_cb_daemon(cpg_handle_t handle,
 			node->fence_pid_wait = 0;
 			node->fence_pid = 0;
 			node->fence_result_wait = 0;
+			if (node->fence_config_reloads != config_reloads)
+				read_node_fence_config(node);
 			node->fence_config.pos = 0;
 			node->left_reason = reason;
 			node->fail_monotime = now;
 			node->fail_walltime = now_wall;
+			node->fence_fail_usec = monotime_usec();
+			node->fence_request_usec = 0;
+			node->fence_agents_usec = 0;
+			node->fence_done_usec = 0;
 			low = set_fence_actors(node, 0);
 		}
 
@@ -2043,6 +2337,18 @@ void init_daemon(void)
 
 static int print_state_daemon_node(struct node_daemon *node, char *str)
 {
+	uint64_t wait_ms = 0, agent_ms = 0, result_ms = 0;
+
+	/* time from failure to our first agent, running agents, and
+	   from agent result to the result being received by all */
+
+	if (node->fence_request_usec > node->fence_fail_usec)
+		wait_ms = (node->fence_request_usec - node->fence_fail_usec) / 1000;
+	if (node->fence_request_usec && node->fence_agents_usec > node->fence_request_usec)
+		agent_ms = (node->fence_agents_usec - node->fence_request_usec) / 1000;
+	if (node->fence_agents_usec && node->fence_done_usec > node->fence_agents_usec)
+		result_ms = (node->fence_done_usec - node->fence_agents_usec) / 1000;
+
 	snprintf(str, DLMC_STATE_MAXSTR-1,
 		 "member=%d "
 		 "killed=%d "
@@ -2059,7 +2365,12 @@ static int print_state_daemon_node(struct node_daemon *node, char *str)
 		 "fail_walltime=%llu "
 		 "fail_monotime=%llu "
 		 "fence_walltime=%llu "
-		 "fence_monotime=%llu ",
+		 "fence_monotime=%llu "
+		 "fence_running=%d "
+		 "fence_timeouts=%d "
+		 "fence_wait_ms=%llu "
+		 "fence_agent_ms=%llu "
+		 "fence_result_ms=%llu ",
 		 node->daemon_member,
 		 node->killed,
 		 reason_str(node->left_reason),
@@ -2075,7 +2386,12 @@ static int print_state_daemon_node(struct node_daemon *node, char *str)
 		 (unsigned long long)node->fail_walltime,
 		 (unsigned long long)node->fail_monotime,
 		 (unsigned long long)node->fence_walltime,
-		 (unsigned long long)node->fence_monotime);
+		 (unsigned long long)node->fence_monotime,
+		 node->fence_running,
+		 node->fence_timeouts,
+		 (unsigned long long)wait_ms,
+		 (unsigned long long)agent_ms,
+		 (unsigned long long)result_ms);
 
 	return strlen(str) + 1;
 }
@@ -9,17 +9,14 @@
 #include "dlm_daemon.h"
 #include "libdlm.h"
 
-static SaCkptHandleT global_ckpt_h;
-static SaCkptCallbacksT callbacks = { 0, 0 };
-static SaVersionT version = { 'B', 1, 1 };
-static char section_buf[10 * 1024 * 1024];  /* 10MB of pack_lock's enough? */
-static uint32_t section_len;
-static uint32_t section_max;
+#define DEADLK_SEND_SIZE (16 * 1024)
+
+static char send_buf[DEADLK_SEND_SIZE];
 
 struct node {
 	struct list_head	list;
 	int			nodeid;
-	int			checkpoint_ready; /* we've read its ckpt */
+	int			locks_done;       /* we've received all its locks */
 	int			in_cycle;         /* participating in cycle */
 };
 
@@ -33,24 +30,120 @@ enum {
 #define DLM_LKSTS_GRANTED       2
 #define DLM_LKSTS_CONVERT       3
 
+/* pack_lock is also how locks are sent to other nodes (in little endian),
+   so it has no padding that could differ between architectures */
+
 struct pack_lock {
 	uint64_t		xid;
 	uint32_t		id;
 	int			nodeid;
 	uint32_t		remid;
 	int			ownpid;
-	uint32_t		exflags;
-	uint32_t		flags;
 	int8_t			status;
 	int8_t			grmode;
 	int8_t			rqmode;
 	int8_t			copy;
+	int8_t			pad[4];
+};
+
+/*
+ * Each node sends the locks it reads from debugfs to the others in
+ * DLM_MSG_DEADLK_LOCKS_DATA messages on the lockspace cpg, then sends
+ * DLM_MSG_DEADLK_LOCKS_DONE.  A message holds a series of resources, each
+ * a pack_rsb, the name padded to 8 bytes, and lock_count pack_lock's.  The
+ * locks of a resource that don't fit in one message are continued in the
+ * next under the same name.  cpg delivers the messages from a node in
+ * order, so all of its locks have been added when its done message
+ * arrives.
+ */
+
+struct pack_rsb {
+	uint16_t		name_len;
+	uint16_t		pad;
+	uint32_t		lock_count;
+};
+
+#define PACK_NAME_LEN(len) (((len) + 7) & ~7)
+
+/*
+ * Resources, lkbs and transactions are each indexed by a chained hash
+ * table (struct dl_hash) in ls->deadlk_index, so reading a million
+ * locks from debugfs and other nodes doesn't search lists.  The tables
+ * double in size as entries are added.
+ */
+
+struct dl_hnode {
+	struct dl_hnode		*next;
+	uint64_t		hash;
+};
+
+struct dl_hash {
+	struct dl_hnode		**table;
+	unsigned int		size;	/* power of 2 */
+	unsigned int		count;
+};
+
+/*
+ * The resources, lkbs and transactions (and resource names) of the lock
+ * state are allocated from an arena, struct dl_arena, that is freed in
+ * one step with the state instead of object by object.  lkbs and trans's
+ * dropped by a refresh are kept on free lists for reuse.  The arrays of a
+ * detection run come from a second arena that is freed when the run ends.
+ * An arena is a stack of chunks, each twice the size of the last up to
+ * DL_CHUNK_MAX, so a large lockspace needs few mallocs.
+ */
+
+struct dl_chunk {
+	struct dl_chunk		*next;		/* older chunk */
+	size_t			size;
+	size_t			used;
+	char			*data;
+};
+
+struct dl_arena {
+	struct dl_chunk		*chunks;	/* newest first */
+	size_t			chunk_size;	/* of the next chunk */
+	size_t			total;
+};
+
+struct dl_arena_mark {
+	struct dl_chunk		*chunk;
+	size_t			used;
+};
+
+#define DL_CHUNK_MIN (64 * 1024)
+#define DL_CHUNK_MAX (16 * 1024 * 1024)
+#define DL_ALIGN 16
+
+struct dl_free {
+	struct dl_free		*next;
+};
+
+struct deadlk_index {
+	struct dl_hash		rsb_hash;	/* name */
+	struct dl_hash		lkb_hash;	/* master copy nodeid,id */
+	struct dl_hash		trans_hash;	/* xid */
+	int			trans_count;
+	struct dl_arena		arena;		/* rsbs, names, lkbs, trans's */
+	struct dl_free		*free_lkbs;
+	struct dl_free		*free_trans;
 };
 
+#define DL_HASH_MIN 1024
+
+/* don't log every lock and transaction when there are more than this */
+#define DEADLK_DUMP_MAX 1000
+
 struct dlm_rsb {
 	struct list_head	list;
 	struct list_head	locks;
-	char			name[DLM_RESNAME_MAXLEN];
+	struct dl_hnode		hnode;
+	struct list_head	refresh_list; /* ls->deadlk_refresh */
+	struct list_head	pending_list; /* ls->deadlk_pending */
+	uint32_t		refresh_gen;  /* refresh run it's current in */
+	uint32_t		refresh_round; /* refresh message that read it */
+	uint32_t		mark;
+	char			*name;	      /* len bytes + nul, in the arena */
 	int			len;
 };
 
@@ -59,7 +152,8 @@ struct dlm_rsb {
 
 struct dlm_lkb {
 	struct list_head        list;       /* r->locks */
-	struct pack_lock	lock;       /* data from debugfs/checkpoint */
+	struct dl_hnode		hnode;      /* master copies, nodeid,id */
+	struct pack_lock	lock;       /* data from debugfs/other node */
 	int			home;       /* node where the lock owner lives*/
 	struct dlm_rsb		*rsb;       /* lock is on resource */
 	struct trans		*trans;     /* lock owned by this transaction */
@@ -68,25 +162,61 @@ struct dlm_lkb {
 						   lock that's blocking us */
 };
 
-/* waitfor pointers alloc'ed 4 at at time */
-#define TR_NALLOC		4
-
 struct trans {
 	struct list_head	list;
 	struct list_head	locks;
+	struct dl_hnode		hnode;
 	uint64_t		xid;
+	uint32_t		graph_gen;	      /* in current waitfor_graph */
+	int			index;		      /* in waitfor_graph */
+	int			canceled;
 	int			others_waiting_on_us; /* count of trans's
-							 pointing to us in
-							 waitfor */
-	int			waitfor_alloc;
-	int			waitfor_count;        /* count of in-use
-							 waitfor slots and
-						         num of trans's we're
-						         waiting on */
-	struct trans		**waitfor;	      /* waitfor_alloc trans
-							 pointers */
+							 waiting on us */
+	int			waitfor_count;        /* num of trans's we're
+							 waiting on */
 };
 
+/*
+ * The wait-for graph is built once per detection run in compact (CSR)
+ * form: the trans's that trans[i] waits for are
+ * trans[adj[adj_start[i]]] .. trans[adj[adj_start[i+1] - 1]], without
+ * duplicates.  It holds only the trans's reachable from the seed trans's:
+ * all of them for a full cycle, and those with locks on the refreshed
+ * resources for a refresh.  Deadlocks are the strongly connected
+ * components of more than one trans, found with Tarjan's algorithm, so a
+ * run is linear in the number of locks and edges it reaches.
+ */
+
+struct waitfor_graph {
+	struct dl_arena		*arena;		/* the arrays, freed with it */
+	int			count;		/* trans's */
+	int			alloc;
+	int			edge_count;
+	struct trans		**trans;
+	int			*adj_start;	/* count + 1 */
+	int			*adj;		/* edge_count */
+};
+
+/*
+ * Incremental detection
+ *
+ * The lock state from a full cycle (every node sends all its locks) is
+ * kept after the cycle ends, along with the transactions built from it.
+ * A timewarn for a resource then starts a refresh instead of another full
+ * cycle: the node that got the timewarn sends DLM_MSG_DEADLK_REFRESH naming
+ * that resource and the resources the transactions on it hold or wait
+ * for locks on.  Every node drops its copy of those resources, reads and
+ * sends just those from debugfs, and the low nodeid searches only the part
+ * of the graph reachable from transactions on them.  A deadlock found this
+ * way is canceled only when every resource its transactions have locks on
+ * was refreshed in the run; otherwise the low nodeid sends another refresh
+ * (a continuation, msgdata 1) for the stale ones, and falls back to a full
+ * cycle after DEADLK_REFRESH_ROUNDS.  A membership change discards the
+ * kept state, so the next timewarn runs a full cycle.
+ */
+
+#define DEADLK_REFRESH_ROUNDS 8
+
 static const int __dlm_compat_matrix[8][8] = {
       /* UN NL CR CW PR PW EX PD */
         {1, 1, 1, 1, 1, 1, 1, 0},       /* UN */
@@ -117,85 +247,356 @@ static const char *status_str(int lksts)
 	return "?";
 }
 
-static void free_resources(struct lockspace *ls)
+static uint64_t dl_mix64(uint64_t v)
+{
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+	v *= 0xc4ceb9fe1a85ec53ULL;
+	v ^= v >> 33;
+	return v;
+}
+
+static uint64_t dl_name_hash(char *name, int len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t dl_lkb_hash(int nodeid, uint32_t id)
+{
+	return dl_mix64(((uint64_t)(uint32_t)nodeid << 32) | id);
+}
+
+static int dl_hash_grow(struct dl_hash *h)
 {
-	struct dlm_rsb *r, *r_safe;
-	struct dlm_lkb *lkb, *lkb_safe;
+	struct dl_hnode **table, *hn, *next;
+	unsigned int size, i, b;
+
+	size = h->size ? h->size * 2 : DL_HASH_MIN;
 
-	list_for_each_entry_safe(r, r_safe, &ls->resources, list) {
-		list_for_each_entry_safe(lkb, lkb_safe, &r->locks, list) {
-			list_del(&lkb->list);
-			if (!list_empty(&lkb->trans_list))
-				list_del(&lkb->trans_list);
-			free(lkb);
+	table = calloc(size, sizeof(struct dl_hnode *));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < h->size; i++) {
+		for (hn = h->table[i]; hn; hn = next) {
+			next = hn->next;
+			b = hn->hash & (size - 1);
+			hn->next = table[b];
+			table[b] = hn;
 		}
-		list_del(&r->list);
-		free(r);
 	}
+
+	free(h->table);
+	h->table = table;
+	h->size = size;
+	return 0;
 }
 
-static void free_transactions(struct lockspace *ls)
+static int dl_hash_add(struct dl_hash *h, struct dl_hnode *hn, uint64_t hash)
 {
-	struct trans *tr, *tr_safe;
+	unsigned int b;
 
-	list_for_each_entry_safe(tr, tr_safe, &ls->transactions, list) {
-		list_del(&tr->list);
-		if (tr->waitfor)
-			free(tr->waitfor);
-		free(tr);
+	if (h->count >= h->size && dl_hash_grow(h) < 0 && !h->size)
+		return -ENOMEM;
+
+	hn->hash = hash;
+	b = hash & (h->size - 1);
+	hn->next = h->table[b];
+	h->table[b] = hn;
+	h->count++;
+	return 0;
+}
+
+static void dl_hash_del(struct dl_hash *h, struct dl_hnode *hn)
+{
+	struct dl_hnode **pp;
+
+	if (!h->size)
+		return;
+
+	for (pp = &h->table[hn->hash & (h->size - 1)]; *pp; pp = &(*pp)->next) {
+		if (*pp == hn) {
+			*pp = hn->next;
+			h->count--;
+			return;
+		}
 	}
 }
 
-static void disable_deadlock(void)
+/* the first entry in the chain for hash, walk with dl_hash_next */
+
+static struct dl_hnode *dl_hash_first(struct dl_hash *h, uint64_t hash)
 {
-	log_error("FIXME: deadlock detection disabled");
+	struct dl_hnode *hn;
+
+	if (!h->size)
+		return NULL;
+
+	for (hn = h->table[hash & (h->size - 1)]; hn; hn = hn->next) {
+		if (hn->hash == hash)
+			return hn;
+	}
+	return NULL;
+}
+
+static struct dl_hnode *dl_hash_next(struct dl_hnode *hn)
+{
+	uint64_t hash = hn->hash;
+
+	for (hn = hn->next; hn; hn = hn->next) {
+		if (hn->hash == hash)
+			return hn;
+	}
+	return NULL;
+}
+
+/* size bytes, aligned, from the newest chunk or a new one big enough */
+
+static void *dl_alloc(struct dl_arena *a, size_t size)
+{
+	struct dl_chunk *c = a->chunks;
+	size_t csize;
+	void *p;
+
+	size = (size + DL_ALIGN - 1) & ~(size_t)(DL_ALIGN - 1);
+
+	if (!c || c->size - c->used < size) {
+		if (!a->chunk_size)
+			a->chunk_size = DL_CHUNK_MIN;
+		csize = a->chunk_size;
+		if (csize < size)
+			csize = size;
+
+		c = malloc(sizeof(struct dl_chunk) + DL_ALIGN + csize);
+		if (!c)
+			return NULL;
+		c->data = (char *)(((uintptr_t)(c + 1) + DL_ALIGN - 1) &
+				   ~(uintptr_t)(DL_ALIGN - 1));
+		c->size = csize;
+		c->used = 0;
+		c->next = a->chunks;
+		a->chunks = c;
+		a->total += csize;
+
+		if (a->chunk_size < DL_CHUNK_MAX)
+			a->chunk_size *= 2;
+	}
+
+	p = c->data + c->used;
+	c->used += size;
+	return p;
+}
+
+static void *dl_zalloc(struct dl_arena *a, size_t size)
+{
+	void *p = dl_alloc(a, size);
+
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+/* resize the array p from the arena, in place if it was the last thing
+   allocated and there's room, otherwise by copying it */
+
+static void *dl_grow(struct dl_arena *a, void *p, size_t old_size,
+		     size_t new_size)
+{
+	struct dl_chunk *c = a->chunks;
+	size_t old_aligned, new_aligned;
+	void *n;
+
+	old_aligned = (old_size + DL_ALIGN - 1) & ~(size_t)(DL_ALIGN - 1);
+	new_aligned = (new_size + DL_ALIGN - 1) & ~(size_t)(DL_ALIGN - 1);
+
+	if (p && c && (char *)p + old_aligned == c->data + c->used &&
+	    c->used - old_aligned + new_aligned <= c->size) {
+		c->used = c->used - old_aligned + new_aligned;
+		return p;
+	}
+
+	n = dl_alloc(a, new_size);
+	if (n && p)
+		memcpy(n, p, old_size);
+	return n;
+}
+
+static void dl_arena_save(struct dl_arena *a, struct dl_arena_mark *m)
+{
+	m->chunk = a->chunks;
+	m->used = a->chunks ? a->chunks->used : 0;
+}
+
+/* free everything allocated since the mark was saved */
+
+static void dl_arena_rewind(struct dl_arena *a, struct dl_arena_mark *m)
+{
+	struct dl_chunk *c;
+
+	while (a->chunks && a->chunks != m->chunk) {
+		c = a->chunks;
+		a->chunks = c->next;
+		a->total -= c->size;
+		free(c);
+	}
+	if (a->chunks)
+		a->chunks->used = m->used;
+}
+
+static void dl_arena_free(struct dl_arena *a)
+{
+	struct dl_chunk *c;
+
+	while ((c = a->chunks)) {
+		a->chunks = c->next;
+		free(c);
+	}
+	memset(a, 0, sizeof(struct dl_arena));
+}
+
+static void *dl_get_free(struct dl_arena *a, struct dl_free **list,
+			 size_t size)
+{
+	struct dl_free *f = *list;
+
+	if (!f)
+		return dl_zalloc(a, size);
+
+	*list = f->next;
+	memset(f, 0, size);
+	return f;
+}
+
+static void dl_put_free(struct dl_free **list, void *p)
+{
+	struct dl_free *f = p;
+
+	f->next = *list;
+	*list = f;
 }
 
-void setup_deadlock(void)
+static void dl_hash_free(struct dl_hash *h)
 {
-	SaAisErrorT rv;
+	free(h->table);
+	memset(h, 0, sizeof(struct dl_hash));
+}
+
+static struct deadlk_index *get_index(struct lockspace *ls)
+{
+	if (!ls->deadlk_index) {
+		ls->deadlk_index = malloc(sizeof(struct deadlk_index));
+		if (ls->deadlk_index)
+			memset(ls->deadlk_index, 0, sizeof(struct deadlk_index));
+	}
+	return ls->deadlk_index;
+}
+
+/* drop the lock state kept from the last cycle */
 
-	if (!cfgd_enable_deadlk)
+static void free_deadlk_state(struct lockspace *ls)
+{
+	struct deadlk_index *di = ls->deadlk_index;
+
+	INIT_LIST_HEAD(&ls->resources);
+	INIT_LIST_HEAD(&ls->transactions);
+	INIT_LIST_HEAD(&ls->deadlk_refresh);
+	INIT_LIST_HEAD(&ls->deadlk_pending);
+	ls->deadlk_state_valid = 0;
+
+	if (!di)
 		return;
 
-	rv = saCkptInitialize(&global_ckpt_h, &callbacks, &version);
-	if (rv != SA_AIS_OK)
-		log_error("ckpt init error %d", rv);
+	dl_hash_free(&di->rsb_hash);
+	dl_hash_free(&di->lkb_hash);
+	dl_hash_free(&di->trans_hash);
+	di->trans_count = 0;
+
+	/* every rsb, lkb and trans */
+	dl_arena_free(&di->arena);
+	di->free_lkbs = NULL;
+	di->free_trans = NULL;
 }
 
-static struct dlm_rsb *get_resource(struct lockspace *ls, char *name, int len)
+static void disable_deadlock(void)
 {
+	log_error("FIXME: deadlock detection disabled");
+}
+
+static struct dlm_rsb *search_resource(struct lockspace *ls, char *name,
+				       int len)
+{
+	struct dl_hnode *hn;
 	struct dlm_rsb *r;
+	uint64_t hash;
 
-	list_for_each_entry(r, &ls->resources, list) {
+	if (!ls->deadlk_index)
+		return NULL;
+
+	hash = dl_name_hash(name, len);
+
+	for (hn = dl_hash_first(&ls->deadlk_index->rsb_hash, hash); hn;
+	     hn = dl_hash_next(hn)) {
+		r = container_of(hn, struct dlm_rsb, hnode);
 		if (r->len == len && !strncmp(r->name, name, len))
 			return r;
 	}
+	return NULL;
+}
 
-	r = malloc(sizeof(struct dlm_rsb));
-	if (!r) {
-		log_error("get_resource: no memory");
-		disable_deadlock();
-		return NULL;
-	}
-	memset(r, 0, sizeof(struct dlm_rsb));
+static struct dlm_rsb *get_resource(struct lockspace *ls, char *name, int len)
+{
+	struct deadlk_index *di;
+	struct dlm_rsb *r;
+
+	di = get_index(ls);
+	if (!di)
+		goto fail;
+
+	r = search_resource(ls, name, len);
+	if (r)
+		return r;
+
+	/* an rsb is only freed with the arena, so its name can follow it
+	   with just the bytes it needs */
+
+	r = dl_zalloc(&di->arena, sizeof(struct dlm_rsb) + len + 1);
+	if (!r)
+		goto fail;
+	r->name = (char *)(r + 1);
 	memcpy(r->name, name, len);
 	r->len = len;
 	INIT_LIST_HEAD(&r->locks);
+	INIT_LIST_HEAD(&r->refresh_list);
+	INIT_LIST_HEAD(&r->pending_list);
+
+	if (dl_hash_add(&di->rsb_hash, &r->hnode, dl_name_hash(name, len)) < 0)
+		goto fail;
 	list_add(&r->list, &ls->resources);
 	return r;
+ fail:
+	log_error("get_resource: no memory");
+	disable_deadlock();
+	return NULL;
 }
 
-static struct dlm_lkb *create_lkb(void)
+static struct dlm_lkb *create_lkb(struct lockspace *ls)
 {
+	struct deadlk_index *di = ls->deadlk_index;
 	struct dlm_lkb *lkb;
 
-	lkb = malloc(sizeof(struct dlm_lkb));
+	lkb = dl_get_free(&di->arena, &di->free_lkbs, sizeof(struct dlm_lkb));
 	if (!lkb) {
 		log_error("create_lkb: no memory");
 		disable_deadlock();
 	} else {
-		memset(lkb, 0, sizeof(struct dlm_lkb));
 		INIT_LIST_HEAD(&lkb->list);
 		INIT_LIST_HEAD(&lkb->trans_list);
 	}
@@ -213,13 +614,13 @@ static void add_lkb(struct dlm_rsb *r, struct dlm_lkb *lkb)
 
 /* called on a lock that's just been read from debugfs */
 
-static void set_copy(struct pack_lock *lock)
+static void set_copy(struct pack_lock *lock, uint32_t flags)
 {
 	uint32_t id, remid;
 
 	if (!lock->nodeid)
 		lock->copy = LOCAL_COPY;
-	else if (lock->flags & IFL_MSTCPY)
+	else if (flags & IFL_MSTCPY)
 		lock->copy = MASTER_COPY;
 	else {
 		/* process copy lock is converted to a partial master copy
@@ -242,20 +643,45 @@ static int partial_master_copy(struct pack_lock *lock)
 	return (lock->xid != 0);
 }
 
-static struct dlm_lkb *get_lkb(struct dlm_rsb *r, struct pack_lock *lock)
+/* the partial and real master copies of a lock are combined in one lkb */
+
+static struct dlm_lkb *get_lkb(struct lockspace *ls, struct dlm_rsb *r,
+			       struct pack_lock *lock)
 {
+	struct deadlk_index *di = ls->deadlk_index;
+	struct dl_hnode *hn;
 	struct dlm_lkb *lkb;
+	uint64_t hash;
 
 	if (lock->copy != MASTER_COPY)
-		goto out;
+		return create_lkb(ls);
 
-	list_for_each_entry(lkb, &r->locks, list) {
-		if (lkb->lock.nodeid == lock->nodeid &&
+	hash = dl_lkb_hash(lock->nodeid, lock->id);
+
+	for (hn = dl_hash_first(&di->lkb_hash, hash); hn; hn = dl_hash_next(hn)) {
+		lkb = container_of(hn, struct dlm_lkb, hnode);
+		if (lkb->rsb == r &&
+		    lkb->lock.nodeid == lock->nodeid &&
 		    lkb->lock.id == lock->id)
 			return lkb;
 	}
- out:
-	return create_lkb();
+
+	lkb = create_lkb(ls);
+	if (!lkb)
+		return NULL;
+
+	/* set here so the lookup above matches before add_lkb */
+	lkb->rsb = r;
+	lkb->lock.nodeid = lock->nodeid;
+	lkb->lock.id = lock->id;
+
+	if (dl_hash_add(&di->lkb_hash, &lkb->hnode, hash) < 0) {
+		log_error("get_lkb: no memory");
+		dl_put_free(&di->free_lkbs, lkb);
+		disable_deadlock();
+		return NULL;
+	}
+	return lkb;
 }
 
 static struct dlm_lkb *add_lock(struct lockspace *ls, struct dlm_rsb *r,
@@ -263,7 +689,7 @@ static struct dlm_lkb *add_lock(struct lockspace *ls, struct dlm_rsb *r,
 {
 	struct dlm_lkb *lkb;
 
-	lkb = get_lkb(r, lock);
+	lkb = get_lkb(ls, r, lock);
 	if (!lkb)
 		return NULL;
 
@@ -274,17 +700,11 @@ static struct dlm_lkb *add_lock(struct lockspace *ls, struct dlm_rsb *r,
 		lkb->lock.id      = lock->id;
 		lkb->lock.remid   = lock->remid;
 		lkb->lock.ownpid  = lock->ownpid;
-		lkb->lock.exflags = lock->exflags;
-		lkb->lock.flags   = lock->flags;
 		lkb->lock.status  = lock->status;
 		lkb->lock.grmode  = lock->grmode;
 		lkb->lock.rqmode  = lock->rqmode;
 		lkb->lock.copy    = LOCAL_COPY;
 		lkb->home = from_nodeid;
-
-		log_group(ls, "add %s local nodeid %d id %x remid %x xid %llx",
-			  r->name, lock->nodeid, lock->id, lock->remid,
-			  (unsigned long long)lock->xid);
 		break;
 
 	case MASTER_COPY:
@@ -302,17 +722,11 @@ static struct dlm_lkb *add_lock(struct lockspace *ls, struct dlm_rsb *r,
 			lkb->lock.copy    = MASTER_COPY;
 			/* set other fields from real master copy */
 			lkb->lock.ownpid  = lock->ownpid;
-			lkb->lock.exflags = lock->exflags;
-			lkb->lock.flags   = lock->flags;
 			lkb->lock.status  = lock->status;
 			lkb->lock.grmode  = lock->grmode;
 			lkb->lock.rqmode  = lock->rqmode;
 		}
 		lkb->home = lock->nodeid;
-
-		log_group(ls, "add %s master nodeid %d id %x remid %x xid %llx",
-			  r->name, lock->nodeid, lock->id, lock->remid,
-			  (unsigned long long)lock->xid);
 		break;
 	}
 
@@ -321,489 +735,250 @@ static struct dlm_lkb *add_lock(struct lockspace *ls, struct dlm_rsb *r,
 	return lkb;
 }
 
-static void parse_r_name(char *line, char *name)
-{
-	char *p;
-	int i = 0;
-	int begin = 0;
+/* _locks is read with large reads into this rather than line by line */
+static char debugfs_buf[DLMC_DEBUGFS_BUF];
 
-	for (p = line; ; p++) {
-		if (*p == '"') {
-			if (begin)
-				break;
-			begin = 1;
-			continue;
-		}
-		if (begin)
-			name[i++] = *p;
-	}
-}
+/* for a refresh, only locks on the resources named by the current refresh
+   message are read */
 
-#define LOCK_LINE_MAX 1024
-
-static int read_debugfs_locks(struct lockspace *ls)
+static int read_debugfs_locks(struct lockspace *ls, int refresh)
 {
-	FILE *file;
-	char path[PATH_MAX];
-	char line[LOCK_LINE_MAX];
+	struct dlmc_debugfs df;
+	struct dlmc_debugfs_lock lk;
 	struct dlm_rsb *r;
 	struct pack_lock lock;
-	char r_name[65];
-	unsigned long long xid;
-	unsigned int waiting;
-	int r_nodeid;
-	int r_len;
-	int rv;
-
-	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_locks", ls->name);
+	char *line;
+	int rv, len;
 
-	file = fopen(path, "r");
-	if (!file)
+	rv = dlmc_debugfs_open(&df, ls->name, "_locks", debugfs_buf,
+			       sizeof(debugfs_buf));
+	if (rv < 0)
 		return -1;
 
 	/* skip the header on the first line */
-	if (!fgets(line, LOCK_LINE_MAX, file)) {
-		log_error("Unable to read %s: %d", path, errno);
+	if (!dlmc_debugfs_line(&df, &len)) {
+		log_error("Unable to read %s_locks: %d", ls->name, errno);
 		goto out;
 	}
 
-	while (fgets(line, LOCK_LINE_MAX, file)) {
-		memset(&lock, 0, sizeof(struct pack_lock));
+	while ((line = dlmc_debugfs_line(&df, &len))) {
+		rv = dlmc_parse_lock(line, len, &lk);
 
-		rv = sscanf(line, "%x %d %x %u %llu %x %x %hhd %hhd %hhd %u %d %d",
-			    &lock.id,
-			    &lock.nodeid,
-			    &lock.remid,
-			    &lock.ownpid,
-			    &xid,
-			    &lock.exflags,
-			    &lock.flags,
-			    &lock.status,
-			    &lock.grmode,
-			    &lock.rqmode,
-			    &waiting,
-			    &r_nodeid,
-			    &r_len);
-
-		lock.xid = xid; /* hack to avoid warning */
-
-		if (rv != 13) {
+		if (rv != DLMC_LOCK_FIELDS) {
 			log_error("invalid debugfs line %d: %s", rv, line);
 			goto out;
 		}
 
-		memset(r_name, 0, sizeof(r_name));
-		parse_r_name(line, r_name);
+		if (!lk.r_name_len || lk.r_name_len > DLM_RESNAME_MAXLEN)
+			continue;
 
-		r = get_resource(ls, r_name, r_len);
-		if (!r)
-			break;
+		if (refresh) {
+			r = search_resource(ls, lk.r_name, lk.r_name_len);
+			if (!r || r->refresh_round != ls->deadlk_refresh_round)
+				continue;
+		} else {
+			r = get_resource(ls, lk.r_name, lk.r_name_len);
+			if (!r)
+				break;
+		}
 
-		set_copy(&lock);
+		memset(&lock, 0, sizeof(struct pack_lock));
+		lock.xid = lk.xid;
+		lock.id = lk.id;
+		lock.nodeid = lk.nodeid;
+		lock.remid = lk.remid;
+		lock.ownpid = lk.ownpid;
+		lock.status = lk.status;
+		lock.grmode = lk.grmode;
+		lock.rqmode = lk.rqmode;
+
+		set_copy(&lock, lk.flags);
 		add_lock(ls, r, our_nodeid, &lock);
 	}
  out:
-	fclose(file);
+	dlmc_debugfs_close(&df);
 	return 0;
 }
 
-static int read_checkpoint_locks(struct lockspace *ls, int from_nodeid,
-			         char *numbuf, int buflen)
+static void send_locks_data(struct lockspace *ls, int len, int rsb_count,
+			    int lock_count)
 {
-	struct dlm_rsb *r;
-	struct pack_lock *lock;
-	int count = section_len / sizeof(struct pack_lock);
-	int i;
+	struct dlm_header *hd = (struct dlm_header *)send_buf;
 
-	r = get_resource(ls, numbuf, buflen - 1);
-	if (!r)
-		return -1;
+	hd->type = DLM_MSG_DEADLK_LOCKS_DATA;
+	hd->msgdata = rsb_count;
+	hd->msgdata2 = lock_count;
 
-	lock = (struct pack_lock *) &section_buf;
-
-	for (i = 0; i < count; i++) {
-		lock->xid     = le64_to_cpu(lock->xid);
-		lock->id      = le32_to_cpu(lock->id);
-		lock->nodeid  = le32_to_cpu(lock->nodeid);
-		lock->remid   = le32_to_cpu(lock->remid);
-		lock->ownpid  = le32_to_cpu(lock->ownpid);
-		lock->exflags = le32_to_cpu(lock->exflags);
-		lock->flags   = le32_to_cpu(lock->flags);
-
-		add_lock(ls, r, from_nodeid, lock);
-		lock++;
-	}
-	return 0;
+	dlm_send_message(ls, send_buf, len);
 }
 
-static int pack_lkb_list(struct list_head *q, struct pack_lock **lockp)
+struct send_state {
+	int len;
+	int rsb_count;
+	int lock_count;
+	int msg_count;
+	int total_locks;
+};
+
+static void pack_rsb_locks(struct lockspace *ls, struct dlm_rsb *r,
+			   struct send_state *st)
 {
 	struct dlm_lkb *lkb;
-	struct pack_lock *lock = *lockp;
-	int count = 0;
+	struct pack_rsb *pr = NULL;
+	struct pack_lock *lock;
+	int name_len = PACK_NAME_LEN(r->len);
+	int need, r_locks = 0;
 
-	list_for_each_entry(lkb, q, list) {
-		if (count + 1 > section_max) {
-			log_error("too many locks %d for ckpt buf", count);
-			break;
+	list_for_each_entry(lkb, &r->locks, list) {
+		need = sizeof(struct pack_lock);
+		if (!pr)
+			need += sizeof(struct pack_rsb) + name_len;
+
+		if (st->len + need > sizeof(send_buf)) {
+			send_locks_data(ls, st->len, st->rsb_count, st->lock_count);
+			st->msg_count++;
+			memset(send_buf, 0, sizeof(send_buf));
+			st->len = sizeof(struct dlm_header);
+			st->rsb_count = 0;
+			st->lock_count = 0;
+			pr = NULL;
+			r_locks = 0;
+		}
+
+		if (!pr) {
+			pr = (struct pack_rsb *)(send_buf + st->len);
+			pr->name_len = cpu_to_le16(r->len);
+			st->len += sizeof(struct pack_rsb);
+			memcpy(send_buf + st->len, r->name, r->len);
+			st->len += name_len;
+			st->rsb_count++;
 		}
 
+		lock = (struct pack_lock *)(send_buf + st->len);
 		lock->xid     = cpu_to_le64(lkb->lock.xid);
 		lock->id      = cpu_to_le32(lkb->lock.id);
 		lock->nodeid  = cpu_to_le32(lkb->lock.nodeid);
 		lock->remid   = cpu_to_le32(lkb->lock.remid);
 		lock->ownpid  = cpu_to_le32(lkb->lock.ownpid);
-		lock->exflags = cpu_to_le32(lkb->lock.exflags);
-		lock->flags   = cpu_to_le32(lkb->lock.flags);
 		lock->status  = lkb->lock.status;
 		lock->grmode  = lkb->lock.grmode;
 		lock->rqmode  = lkb->lock.rqmode;
 		lock->copy    = lkb->lock.copy;
+		st->len += sizeof(struct pack_lock);
 
-		lock++;
-		count++;
+		pr->lock_count = cpu_to_le32(++r_locks);
+		st->lock_count++;
+		st->total_locks++;
 	}
-	return count;
 }
 
-static void pack_section_buf(struct lockspace *ls, struct dlm_rsb *r)
-{
-	struct pack_lock *lock;
-	int count;
-
-	memset(&section_buf, 0, sizeof(section_buf));
-	section_max = sizeof(section_buf) / sizeof(struct pack_lock);
+/* the resources being sent only hold our own locks when this is called,
+   from receive_cycle_start or receive_refresh before any other node's
+   locks are received */
 
-	lock = (struct pack_lock *) &section_buf;
-
-	count = pack_lkb_list(&r->locks, &lock);
-
-	section_len = count * sizeof(struct pack_lock);
-}
-
-static int _unlink_checkpoint(struct lockspace *ls, SaNameT *name)
+static void send_all_locks_data(struct lockspace *ls, int refresh)
 {
-	SaCkptCheckpointHandleT h;
-	SaCkptCheckpointDescriptorT s;
-	SaAisErrorT rv;
-	int ret = 0;
-	int retries;
+	struct send_state st;
+	struct dlm_rsb *r;
 
-	h = (SaCkptCheckpointHandleT) ls->deadlk_ckpt_handle;
-	log_group(ls, "unlink ckpt %llx", (unsigned long long)h);
+	memset(&st, 0, sizeof(st));
+	memset(send_buf, 0, sizeof(send_buf));
+	st.len = sizeof(struct dlm_header);
 
-	retries = 0;
- unlink_retry:
-	rv = saCkptCheckpointUnlink(global_ckpt_h, name);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "unlink ckpt retry");
-		sleep(1);
-		if (retries++ < 10)
-			goto unlink_retry;
+	if (refresh) {
+		list_for_each_entry(r, &ls->deadlk_refresh, refresh_list) {
+			if (r->refresh_round == ls->deadlk_refresh_round)
+				pack_rsb_locks(ls, r, &st);
+		}
+	} else {
+		list_for_each_entry(r, &ls->resources, list)
+			pack_rsb_locks(ls, r, &st);
 	}
-	if (rv == SA_AIS_OK)
-		goto out_close;
-	if (!h)
-		goto out;
 
-	log_error("unlink ckpt error %d %s", rv, ls->name);
-	ret = -1;
-
-	retries = 0;
- status_retry:
-	rv = saCkptCheckpointStatusGet(h, &s);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "unlink ckpt status retry");
-		sleep(1);
-		if (retries++ < 10)
-			goto status_retry;
-	}
-	if (rv != SA_AIS_OK) {
-		log_error("unlink ckpt status error %d %s", rv, ls->name);
-		goto out_close;
-	}
-
-	log_group(ls, "unlink ckpt status: size %llu, max sections %u, "
-		      "max section size %llu, section count %u, mem %u",
-		 (unsigned long long)s.checkpointCreationAttributes.checkpointSize,
-		 s.checkpointCreationAttributes.maxSections,
-		 (unsigned long long)s.checkpointCreationAttributes.maxSectionSize,
-		 s.numberOfSections, s.memoryUsed);
-
- out_close:
-	retries = 0;
- close_retry:
-	rv = saCkptCheckpointClose(h);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "unlink ckpt close retry");
-		sleep(1);
-		if (retries++ < 10)
-			goto close_retry;
-	}
-	if (rv != SA_AIS_OK) {
-		log_error("unlink ckpt %llx close err %d %s",
-			  (unsigned long long)h, rv, ls->name);
+	if (st.lock_count) {
+		send_locks_data(ls, st.len, st.rsb_count, st.lock_count);
+		st.msg_count++;
 	}
- out:
-	ls->deadlk_ckpt_handle = 0;
-	return ret;
+
+	log_group(ls, "send_all_locks_data: locks %d messages %d",
+		  st.total_locks, st.msg_count);
 }
 
-static int unlink_checkpoint(struct lockspace *ls)
+static struct node *find_node(struct lockspace *ls, int nodeid)
 {
-	SaNameT name;
-	int len;
-
-	len = snprintf((char *)name.value, SA_MAX_NAME_LENGTH, "dlmdeadlk.%s.%d",
-		       ls->name, our_nodeid);
-	name.length = len;
+	struct node *node;
 
-	return _unlink_checkpoint(ls, &name);
+	list_for_each_entry(node, &ls->deadlk_nodes, list) {
+		if (node->nodeid == nodeid)
+			return node;
+	}
+	return NULL;
 }
 
-static void read_checkpoint(struct lockspace *ls, int nodeid)
+void receive_locks_data(struct lockspace *ls, struct dlm_header *hd, int len)
 {
-	SaCkptCheckpointHandleT h;
-	SaCkptSectionIterationHandleT itr;
-	SaCkptSectionDescriptorT desc;
-	SaCkptIOVectorElementT iov;
-	SaNameT name;
-	SaAisErrorT rv;
-	char buf[DLM_RESNAME_MAXLEN];
-	int len;
-	int retries;
+	struct node *node;
+	struct dlm_rsb *r;
+	struct pack_rsb *pr;
+	struct pack_lock *pl, lock;
+	char name[DLM_RESNAME_MAXLEN + 1];
+	char *p, *end;
+	int nodeid = hd->nodeid;
+	uint32_t count, i;
+	int name_len;
 
 	if (nodeid == our_nodeid)
 		return;
 
-	log_group(ls, "read_checkpoint %d", nodeid);
-
-	len = snprintf((char *)name.value, SA_MAX_NAME_LENGTH, "dlmdeadlk.%s.%d",
-		       ls->name, nodeid);
-	name.length = len;
-
-	retries = 0;
- open_retry:
-	rv = saCkptCheckpointOpen(global_ckpt_h, &name, NULL,
-				  SA_CKPT_CHECKPOINT_READ, 0, &h);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "read_checkpoint: %d ckpt open retry", nodeid);
-		sleep(1);
-		if (retries++ < 10)
-			goto open_retry;
-	}
-	if (rv != SA_AIS_OK) {
-		log_error("read_checkpoint: %d ckpt open error %d", nodeid, rv);
+	node = find_node(ls, nodeid);
+	if (!ls->cycle_running || !node || !node->in_cycle) {
+		log_group(ls, "receive_locks_data from %d not in cycle", nodeid);
 		return;
 	}
 
-	retries = 0;
- init_retry:
-	rv = saCkptSectionIterationInitialize(h, SA_CKPT_SECTIONS_ANY, 0, &itr);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "read_checkpoint: ckpt iterinit retry");
-		sleep(1);
-		if (retries++ < 10)
-			goto init_retry;
-	}
-	if (rv != SA_AIS_OK) {
-		log_error("read_checkpoint: %d ckpt iterinit error %d", nodeid, rv);
-		goto out;
-	}
-
-	while (1) {
-		retries = 0;
-	 next_retry:
-		rv = saCkptSectionIterationNext(itr, &desc);
-		if (rv == SA_AIS_ERR_NO_SECTIONS)
-			break;
-		if (rv == SA_AIS_ERR_TRY_AGAIN) {
-			log_group(ls, "read_checkpoint: ckpt iternext retry");
-			sleep(1);
-			if (retries++ < 10)
-				goto next_retry;
-		}
-		if (rv != SA_AIS_OK) {
-			log_error("read_checkpoint: %d ckpt iternext error %d",
-				  nodeid, rv);
-			goto out_it;
-		}
-
-		if (!desc.sectionSize)
-			continue;
-
-		iov.sectionId = desc.sectionId;
-		iov.dataBuffer = &section_buf;
-		iov.dataSize = desc.sectionSize;
-		iov.dataOffset = 0;
-
-		memset(&buf, 0, sizeof(buf));
-		snprintf(buf, sizeof(buf), "%s", desc.sectionId.id);
-
-		log_group(ls, "read_checkpoint: section size %llu id %u \"%s\"",
-			  (unsigned long long)iov.dataSize,
-			  iov.sectionId.idLen, buf);
-
-		retries = 0;
-	 read_retry:
-		rv = saCkptCheckpointRead(h, &iov, 1, NULL);
-		if (rv == SA_AIS_ERR_TRY_AGAIN) {
-			log_group(ls, "read_checkpoint: ckpt read retry");
-			sleep(1);
-			if (retries++ < 10)
-				goto read_retry;
-		}
-		if (rv != SA_AIS_OK) {
-			log_error("read_checkpoint: %d ckpt read error %d",
-				  nodeid, rv);
-			goto out_it;
-		}
-
-		section_len = iov.readSize;
-
-		if (!section_len)
-		       continue;
-
-		if (section_len % sizeof(struct pack_lock)) {
-			log_error("read_checkpoint: %d bad section len %d",
-				  nodeid, section_len);
-			continue;
-		}
-
-		read_checkpoint_locks(ls, nodeid, (char *)desc.sectionId.id,
-				      desc.sectionId.idLen);
-	}
-
- out_it:
-	saCkptSectionIterationFinalize(itr);
-	retries = 0;
- out:
-	rv = saCkptCheckpointClose(h);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "read_checkpoint: unlink ckpt close retry");
-		sleep(1);
-		if (retries++ < 10)
-			goto out;
-	}
-	if (rv != SA_AIS_OK)
-		log_error("read_checkpoint: %d close error %d", nodeid, rv);
-}
-
-static void write_checkpoint(struct lockspace *ls)
-{
-	SaCkptCheckpointCreationAttributesT attr;
-	SaCkptCheckpointHandleT h;
-	SaCkptSectionIdT section_id;
-	SaCkptSectionCreationAttributesT section_attr;
-	SaCkptCheckpointOpenFlagsT flags;
-	SaNameT name;
-	SaAisErrorT rv;
-	char buf[DLM_RESNAME_MAXLEN];
-	struct dlm_rsb *r;
-	struct dlm_lkb *lkb;
-	int r_count, lock_count, total_size, section_size, max_section_size;
-	int len;
+	p = (char *)hd + sizeof(struct dlm_header);
+	end = (char *)hd + len;
 
-	len = snprintf((char *)name.value, SA_MAX_NAME_LENGTH, "dlmdeadlk.%s.%d",
-		      ls->name, our_nodeid);
-	name.length = len;
+	while (end - p >= sizeof(struct pack_rsb)) {
+		pr = (struct pack_rsb *)p;
+		name_len = le16_to_cpu(pr->name_len);
+		count = le32_to_cpu(pr->lock_count);
+		p += sizeof(struct pack_rsb);
 
-	/* unlink an old checkpoint before we create a new one */
-	if (ls->deadlk_ckpt_handle) {
-		log_error("write_checkpoint: old ckpt");
-		if (_unlink_checkpoint(ls, &name))
+		if (!name_len || name_len > DLM_RESNAME_MAXLEN ||
+		    count > DEADLK_SEND_SIZE / sizeof(struct pack_lock) ||
+		    end - p < PACK_NAME_LEN(name_len) +
+			      count * sizeof(struct pack_lock)) {
+			log_error("receive_locks_data from %d bad len %d "
+				  "name_len %d count %u", nodeid, len,
+				  name_len, count);
 			return;
-	}
-
-	/* loop through all locks to figure out sizes to set in
-	   the attr fields */
-
-	r_count = 0;
-	lock_count = 0;
-	total_size = 0;
-	max_section_size = 0;
-
-	list_for_each_entry(r, &ls->resources, list) {
-		r_count++;
-		section_size = 0;
-		list_for_each_entry(lkb, &r->locks, list) {
-			section_size += sizeof(struct pack_lock);
-			lock_count++;
 		}
-		total_size += section_size;
-		if (section_size > max_section_size)
-			max_section_size = section_size;
-	}
-
-	log_group(ls, "write_checkpoint: r_count %d, lock_count %d",
-		  r_count, lock_count);
-
-	log_group(ls, "write_checkpoint: total %d bytes, max_section %d bytes",
-		  total_size, max_section_size);
 
-	attr.creationFlags = SA_CKPT_WR_ALL_REPLICAS;
-	attr.checkpointSize = total_size;
-	attr.retentionDuration = SA_TIME_MAX;
-	attr.maxSections = r_count + 1;      /* don't know why we need +1 */
-	attr.maxSectionSize = max_section_size;
-	attr.maxSectionIdSize = DLM_RESNAME_MAXLEN;
+		memset(name, 0, sizeof(name));
+		memcpy(name, p, name_len);
+		p += PACK_NAME_LEN(name_len);
 
-	flags = SA_CKPT_CHECKPOINT_READ |
-		SA_CKPT_CHECKPOINT_WRITE |
-		SA_CKPT_CHECKPOINT_CREATE;
-
- open_retry:
-	rv = saCkptCheckpointOpen(global_ckpt_h, &name, &attr, flags, 0, &h);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "write_checkpoint: ckpt open retry");
-		sleep(1);
-		goto open_retry;
-	}
-	if (rv == SA_AIS_ERR_EXIST) {
-		log_group(ls, "write_checkpoint: ckpt already exists");
-		return;
-	}
-	if (rv != SA_AIS_OK) {
-		log_group(ls, "write_checkpoint: ckpt open error %d", rv);
-		return;
-	}
-
-	log_group(ls, "write_checkpoint: open ckpt handle %llx",
-		  (unsigned long long)h);
-	ls->deadlk_ckpt_handle = (uint64_t) h;
+		r = get_resource(ls, name, name_len);
+		if (!r)
+			return;
 
-	list_for_each_entry(r, &ls->resources, list) {
-		memset(buf, 0, sizeof(buf));
-		len = snprintf(buf, sizeof(buf), "%s", r->name);
-
-		section_id.id = (void *)buf;
-		section_id.idLen = len + 1;
-		section_attr.sectionId = &section_id;
-		section_attr.expirationTime = SA_TIME_END;
-
-		pack_section_buf(ls, r);
-
-		log_group(ls, "write_checkpoint: section size %u id %u \"%s\"",
-			  section_len, section_id.idLen, buf);
-
-	 create_retry:
-		rv = saCkptSectionCreate(h, &section_attr, &section_buf,
-					 section_len);
-		if (rv == SA_AIS_ERR_TRY_AGAIN) {
-			log_group(ls, "write_checkpoint: ckpt create retry");
-			sleep(1);
-			goto create_retry;
-		}
-		if (rv == SA_AIS_ERR_EXIST) {
-			/* this shouldn't happen in general */
-			log_error("write_checkpoint: clearing old ckpt");
-			saCkptCheckpointClose(h);
-			_unlink_checkpoint(ls, &name);
-			goto open_retry;
-		}
-		if (rv != SA_AIS_OK) {
-			log_error("write_checkpoint: section create %d", rv);
-			break;
+		for (i = 0; i < count; i++) {
+			pl = (struct pack_lock *)p;
+			memset(&lock, 0, sizeof(lock));
+			lock.xid     = le64_to_cpu(pl->xid);
+			lock.id      = le32_to_cpu(pl->id);
+			lock.nodeid  = le32_to_cpu(pl->nodeid);
+			lock.remid   = le32_to_cpu(pl->remid);
+			lock.ownpid  = le32_to_cpu(pl->ownpid);
+			lock.status  = pl->status;
+			lock.grmode  = pl->grmode;
+			lock.rqmode  = pl->rqmode;
+			lock.copy    = pl->copy;
+			p += sizeof(struct pack_lock);
+
+			if (!add_lock(ls, r, nodeid, &lock))
+				return;
 		}
 	}
 }
@@ -834,10 +1009,10 @@ static void send_message(struct lockspace *ls, int type,
 	free(buf);
 }
 
-static void send_checkpoint_ready(struct lockspace *ls)
+static void send_locks_done(struct lockspace *ls)
 {
-	log_group(ls, "send_checkpoint_ready");
-	send_message(ls, DLM_MSG_DEADLK_CHECKPOINT_READY, 0, 0);
+	log_group(ls, "send_locks_done");
+	send_message(ls, DLM_MSG_DEADLK_LOCKS_DONE, 0, 0);
 }
 
 void send_cycle_start(struct lockspace *ls)
@@ -876,6 +1051,13 @@ static void dump_resources(struct lockspace *ls)
 	struct dlm_rsb *r;
 	struct dlm_lkb *lkb;
 
+	if (ls->deadlk_index &&
+	    ls->deadlk_index->lkb_hash.count > DEADLK_DUMP_MAX) {
+		log_group(ls, "Resource dump skipped: %u resources",
+			  ls->deadlk_index->rsb_hash.count);
+		return;
+	}
+
 	log_group(ls, "Resource dump:");
 
 	list_for_each_entry(r, &ls->resources, list) {
@@ -894,6 +1076,7 @@ static void dump_resources(struct lockspace *ls)
 	}
 }
 
+static int create_trans_list(struct lockspace *ls);
 static void find_deadlock(struct lockspace *ls);
 
 static void run_deadlock(struct lockspace *ls)
@@ -902,83 +1085,291 @@ static void run_deadlock(struct lockspace *ls)
 	int not_ready = 0;
 	int low = -1;
 
-	if (ls->all_checkpoints_ready)
-		log_group(ls, "WARNING: run_deadlock all_checkpoints_ready");
+	if (ls->all_locks_done)
+		log_group(ls, "WARNING: run_deadlock all_locks_done");
 
 	list_for_each_entry(node, &ls->deadlk_nodes, list) {
 		if (!node->in_cycle)
 			continue;
-		if (!node->checkpoint_ready)
+		if (!node->locks_done)
 			not_ready++;
 
-		log_group(ls, "nodeid %d checkpoint_ready = %d",
-			  node->nodeid, node->checkpoint_ready);
-	}
-	if (not_ready)
-		return;
+		log_group(ls, "nodeid %d locks_done = %d",
+			  node->nodeid, node->locks_done);
+	}
+	if (not_ready)
+		return;
+
+	ls->all_locks_done = 1;
+
+	/* every node keeps the transactions so any of them can find the
+	   neighbours of a resource for the next refresh */
+
+	create_trans_list(ls);
+
+	list_for_each_entry(node, &ls->deadlk_nodes, list) {
+		if (!node->in_cycle)
+			continue;
+		if (node->nodeid < low || low == -1)
+			low = node->nodeid;
+	}
+	ls->deadlk_low_nodeid = low;
+
+	if (low == our_nodeid)
+		find_deadlock(ls);
+	else
+		log_group(ls, "defer resolution to low nodeid %d", low);
+}
+
+void receive_locks_done(struct lockspace *ls, struct dlm_header *hd, int len)
+{
+	struct node *node;
+	int nodeid = hd->nodeid;
+
+	log_group(ls, "receive_locks_done from %d", nodeid);
+
+	node = find_node(ls, nodeid);
+	if (node)
+		node->locks_done = 1;
+
+	run_deadlock(ls);
+}
+
+void receive_cycle_start(struct lockspace *ls, struct dlm_header *hd, int len)
+{
+	struct node *node;
+	int nodeid = hd->nodeid;
+	int rv;
+
+	log_group(ls, "receive_cycle_start from %d", nodeid);
+
+	if (ls->cycle_running) {
+		log_group(ls, "cycle already running");
+		return;
+	}
+	ls->cycle_running = 1;
+	ls->cycle_refresh = 0;
+	ls->deadlk_confchg_seen = 0;
+	gettimeofday(&ls->cycle_start_time, NULL);
+
+	/* a full cycle starts over from no lock state */
+	free_deadlk_state(ls);
+
+	list_for_each_entry(node, &ls->deadlk_nodes, list)
+		node->in_cycle = 1;
+
+	rv = read_debugfs_locks(ls, 0);
+	if (rv < 0) {
+		log_error("can't read dlm debugfs file: %s", strerror(errno));
+		return;
+	}
+
+	send_all_locks_data(ls, 0);
+	send_locks_done(ls);
+}
+
+static void add_pending(struct lockspace *ls, struct dlm_rsb *r)
+{
+	if (list_empty(&r->pending_list))
+		list_add_tail(&r->pending_list, &ls->deadlk_pending);
+}
+
+/* send the names of pending resources, as many as fit in one message,
+   the rest stay pending for the next refresh */
+
+static void send_refresh(struct lockspace *ls, int cont)
+{
+	struct dlm_header *hd;
+	struct dlm_rsb *r, *safe;
+	struct pack_rsb *pr;
+	int len, count = 0;
+
+	memset(send_buf, 0, sizeof(send_buf));
+	len = sizeof(struct dlm_header);
+
+	list_for_each_entry_safe(r, safe, &ls->deadlk_pending, pending_list) {
+		if (len + sizeof(struct pack_rsb) + PACK_NAME_LEN(r->len) >
+		    sizeof(send_buf))
+			break;
+
+		pr = (struct pack_rsb *)(send_buf + len);
+		pr->name_len = cpu_to_le16(r->len);
+		len += sizeof(struct pack_rsb);
+		memcpy(send_buf + len, r->name, r->len);
+		len += PACK_NAME_LEN(r->len);
+
+		list_del_init(&r->pending_list);
+		count++;
+	}
+
+	if (!count)
+		return;
+
+	log_group(ls, "send_refresh %d resources cont %d", count, cont);
+
+	hd = (struct dlm_header *)send_buf;
+	hd->type = DLM_MSG_DEADLK_REFRESH;
+	hd->msgdata = cont;
+	hd->msgdata2 = count;
+
+	dlm_send_message(ls, send_buf, len);
+}
+
+/* add a resource and the resources that the transactions with locks on it
+   have other locks on */
 
-	ls->all_checkpoints_ready = 1;
+static void add_pending_neighbours(struct lockspace *ls, struct dlm_rsb *r)
+{
+	static uint32_t mark;
+	struct dlm_lkb *lkb, *tr_lkb;
 
-	list_for_each_entry(node, &ls->deadlk_nodes, list) {
-		if (!node->in_cycle)
+	mark++;
+	r->mark = mark;
+	add_pending(ls, r);
+
+	list_for_each_entry(lkb, &r->locks, list) {
+		if (!lkb->trans)
 			continue;
-		if (node->nodeid < low || low == -1)
-			low = node->nodeid;
+		list_for_each_entry(tr_lkb, &lkb->trans->locks, trans_list) {
+			if (tr_lkb->rsb->mark == mark)
+				continue;
+			tr_lkb->rsb->mark = mark;
+			add_pending(ls, tr_lkb->rsb);
+		}
 	}
-	ls->deadlk_low_nodeid = low;
-
-	if (low == our_nodeid)
-		find_deadlock(ls);
-	else
-		log_group(ls, "defer resolution to low nodeid %d", low);
 }
 
-void receive_checkpoint_ready(struct lockspace *ls, struct dlm_header *hd,
-			      int len)
+/* Called for a timewarn on a resource.  Returns 0 if a refresh covers it,
+   or -1 if there's no kept lock state and a full cycle is needed. */
+
+int deadlk_timewarn(struct lockspace *ls, char *name, int len)
 {
-	struct node *node;
-	int nodeid = hd->nodeid;
+	struct dlm_rsb *r;
 
-	log_group(ls, "receive_checkpoint_ready from %d", nodeid);
+	if (!opt(enable_deadlk_ind) || !ls->deadlk_state_valid)
+		return -1;
 
-	read_checkpoint(ls, nodeid);
+	if (len <= 0 || len > DLM_RESNAME_MAXLEN)
+		return -1;
 
-	list_for_each_entry(node, &ls->deadlk_nodes, list) {
-		if (node->nodeid == nodeid) {
-			node->checkpoint_ready = 1;
-			break;
-		}
-	}
+	r = get_resource(ls, name, len);
+	if (!r)
+		return -1;
 
-	run_deadlock(ls);
+	add_pending_neighbours(ls, r);
+
+	/* sent when the running cycle ends */
+	if (ls->cycle_running)
+		return 0;
+
+	send_refresh(ls, 0);
+	return 0;
 }
 
-void receive_cycle_start(struct lockspace *ls, struct dlm_header *hd, int len)
+static void purge_rsb_locks(struct lockspace *ls, struct dlm_rsb *r);
+
+void receive_refresh(struct lockspace *ls, struct dlm_header *hd, int len)
 {
 	struct node *node;
+	struct dlm_rsb *r;
+	struct pack_rsb *pr;
+	char name[DLM_RESNAME_MAXLEN + 1];
+	char *p, *end;
 	int nodeid = hd->nodeid;
+	int cont = hd->msgdata;
+	int name_len, count = 0;
 	int rv;
 
-	log_group(ls, "receive_cycle_start from %d", nodeid);
+	if (!ls->deadlk_state_valid) {
+		log_group(ls, "receive_refresh from %d no lock state", nodeid);
+		return;
+	}
+
+	p = (char *)hd + sizeof(struct dlm_header);
+	end = (char *)hd + len;
 
 	if (ls->cycle_running) {
-		log_group(ls, "cycle already running");
+		/* our own refresh will be sent again after the cycle */
+		log_group(ls, "receive_refresh from %d cycle running", nodeid);
+		if (nodeid != our_nodeid)
+			return;
+		while (end - p >= sizeof(struct pack_rsb)) {
+			pr = (struct pack_rsb *)p;
+			name_len = le16_to_cpu(pr->name_len);
+			p += sizeof(struct pack_rsb);
+			if (!name_len || name_len > DLM_RESNAME_MAXLEN ||
+			    end - p < PACK_NAME_LEN(name_len))
+				break;
+			r = get_resource(ls, p, name_len);
+			if (!r)
+				break;
+			add_pending(ls, r);
+			p += PACK_NAME_LEN(name_len);
+		}
 		return;
 	}
+
+	if (!cont) {
+		ls->deadlk_refresh_gen++;
+		ls->deadlk_refresh_rounds = 0;
+		while (!list_empty(&ls->deadlk_refresh)) {
+			r = list_first_entry(&ls->deadlk_refresh,
+					     struct dlm_rsb, refresh_list);
+			list_del_init(&r->refresh_list);
+		}
+	}
+	ls->deadlk_refresh_round++;
+	ls->deadlk_refresh_rounds++;
+
 	ls->cycle_running = 1;
+	ls->cycle_refresh = 1;
 	gettimeofday(&ls->cycle_start_time, NULL);
 
 	list_for_each_entry(node, &ls->deadlk_nodes, list)
 		node->in_cycle = 1;
 
-	rv = read_debugfs_locks(ls);
+	/* forget the locks we have on the named resources from all nodes,
+	   each node sends its current ones */
+
+	while (end - p >= sizeof(struct pack_rsb)) {
+		pr = (struct pack_rsb *)p;
+		name_len = le16_to_cpu(pr->name_len);
+		p += sizeof(struct pack_rsb);
+
+		if (!name_len || name_len > DLM_RESNAME_MAXLEN ||
+		    end - p < PACK_NAME_LEN(name_len)) {
+			log_error("receive_refresh from %d bad len %d", nodeid, len);
+			break;
+		}
+
+		memset(name, 0, sizeof(name));
+		memcpy(name, p, name_len);
+		p += PACK_NAME_LEN(name_len);
+
+		r = get_resource(ls, name, name_len);
+		if (!r)
+			break;
+
+		if (r->refresh_gen == ls->deadlk_refresh_gen)
+			continue;
+		r->refresh_gen = ls->deadlk_refresh_gen;
+		r->refresh_round = ls->deadlk_refresh_round;
+		list_add_tail(&r->refresh_list, &ls->deadlk_refresh);
+		purge_rsb_locks(ls, r);
+		count++;
+	}
+
+	log_group(ls, "receive_refresh from %d cont %d resources %d round %d",
+		  nodeid, cont, count, ls->deadlk_refresh_rounds);
+
+	rv = read_debugfs_locks(ls, 1);
 	if (rv < 0) {
 		log_error("can't read dlm debugfs file: %s", strerror(errno));
 		return;
 	}
 
-	write_checkpoint(ls);
-	send_checkpoint_ready(ls);
+	send_all_locks_data(ls, 1);
+	send_locks_done(ls);
 }
 
 static uint64_t dt_usec(struct timeval *start, struct timeval *stop)
@@ -1008,18 +1399,28 @@ void receive_cycle_end(struct lockspace *ls, struct dlm_header *hd, int len)
 
 	gettimeofday(&ls->cycle_end_time, NULL);
 	usec = dt_usec(&ls->cycle_start_time, &ls->cycle_end_time);
-	log_group(ls, "receive_cycle_end: from %d cycle time %.2f s",
-		  nodeid, usec * 1.e-6);
+	log_group(ls, "receive_cycle_end: from %d %s time %.3f s",
+		  nodeid, ls->cycle_refresh ? "refresh" : "cycle",
+		  usec * 1.e-6);
 
 	ls->cycle_running = 0;
-	ls->all_checkpoints_ready = 0;
+	ls->all_locks_done = 0;
 
 	list_for_each_entry(node, &ls->deadlk_nodes, list)
-		node->checkpoint_ready = 0;
+		node->locks_done = 0;
+
+	/* keep the lock state for refreshes unless the members changed
+	   while it was being collected */
+
+	if (ls->deadlk_confchg_seen)
+		free_deadlk_state(ls);
+	else if (!ls->cycle_refresh)
+		ls->deadlk_state_valid = 1;
+	ls->deadlk_confchg_seen = 0;
 
-	free_resources(ls);
-	free_transactions(ls);
-	unlink_checkpoint(ls);
+	/* timewarns that arrived during the cycle */
+	if (ls->deadlk_state_valid)
+		send_refresh(ls, 0);
 }
 
 void receive_cancel_lock(struct lockspace *ls, struct dlm_header *hd, int len)
@@ -1081,6 +1482,7 @@ static void node_left(struct lockspace *ls, int nodeid, int reason)
 }
 
 static void purge_locks(struct lockspace *ls, int nodeid);
+static void free_lkb(struct lockspace *ls, struct dlm_lkb *lkb);
 
 void deadlk_confchg(struct lockspace *ls,
 		const struct cpg_address *member_list,
@@ -1092,7 +1494,7 @@ void deadlk_confchg(struct lockspace *ls,
 {
 	int i;
 
-	if (!cfgd_enable_deadlk)
+	if (!opt(enable_deadlk_ind))
 		return;
 
 	if (!ls->deadlk_confchg_init) {
@@ -1111,20 +1513,32 @@ void deadlk_confchg(struct lockspace *ls,
 	for (i = 0; i < left_list_entries; i++)
 		node_left(ls, left_list[i].nodeid, left_list[i].reason);
 
+	/* the kept lock state doesn't include new nodes, and the locks of
+	   nodes that left are released by recovery */
+
+	if (joined_list_entries || left_list_entries) {
+		if (ls->cycle_running)
+			ls->deadlk_confchg_seen = 1;
+		else
+			free_deadlk_state(ls);
+	}
+
 	if (!ls->cycle_running)
 		return;
 
 	if (!left_list_entries)
 		return;
 
-	if (!ls->all_checkpoints_ready) {
-		run_deadlock(ls);
-		return;
-	}
+	/* a node that left may have sent some of its locks but not all */
 
 	for (i = 0; i < left_list_entries; i++)
 		purge_locks(ls, left_list[i].nodeid);
 
+	if (!ls->all_locks_done) {
+		run_deadlock(ls);
+		return;
+	}
+
 	for (i = 0; i < left_list_entries; i++) {
 		if (left_list[i].nodeid != ls->deadlk_low_nodeid)
 			continue;
@@ -1135,8 +1549,8 @@ void deadlk_confchg(struct lockspace *ls,
 }
 
 /* would we ever call this after we've created the transaction lists?
-   I don't think so; I think it can only be called between reading
-   checkpoints */
+   I don't think so; I think it can only be called while locks are still
+   being received from other nodes */
 
 static void purge_locks(struct lockspace *ls, int nodeid)
 {
@@ -1145,18 +1559,20 @@ static void purge_locks(struct lockspace *ls, int nodeid)
 
 	list_for_each_entry(r, &ls->resources, list) {
 		list_for_each_entry_safe(lkb, safe, &r->locks, list) {
-			if (lkb->home == nodeid) {
-				list_del(&lkb->list);
-				if (list_empty(&lkb->trans_list))
-					free(lkb);
-				else
-					log_group(ls, "purge %d %x on trans",
-						  nodeid, lkb->lock.id);
-			}
+			if (lkb->home == nodeid)
+				free_lkb(ls, lkb);
 		}
 	}
 }
 
+static void purge_rsb_locks(struct lockspace *ls, struct dlm_rsb *r)
+{
+	struct dlm_lkb *lkb, *safe;
+
+	list_for_each_entry_safe(lkb, safe, &r->locks, list)
+		free_lkb(ls, lkb);
+}
+
 static void add_lkb_trans(struct trans *tr, struct dlm_lkb *lkb)
 {
 	list_add(&lkb->trans_list, &tr->locks);
@@ -1165,51 +1581,117 @@ static void add_lkb_trans(struct trans *tr, struct dlm_lkb *lkb)
 
 static struct trans *get_trans(struct lockspace *ls, uint64_t xid)
 {
+	struct deadlk_index *di = ls->deadlk_index;
+	struct dl_hnode *hn;
 	struct trans *tr;
+	uint64_t hash = dl_mix64(xid);
 
-	list_for_each_entry(tr, &ls->transactions, list) {
+	for (hn = dl_hash_first(&di->trans_hash, hash); hn; hn = dl_hash_next(hn)) {
+		tr = container_of(hn, struct trans, hnode);
 		if (tr->xid == xid)
 			return tr;
 	}
 
-	tr = malloc(sizeof(struct trans));
-	if (!tr) {
-		log_error("get_trans: no memory");
-		disable_deadlock();
-		return NULL;
-	}
-	memset(tr, 0, sizeof(struct trans));
+	tr = dl_get_free(&di->arena, &di->free_trans, sizeof(struct trans));
+	if (!tr)
+		goto fail;
 	tr->xid = xid;
-	tr->waitfor = NULL;
-	tr->waitfor_alloc = 0;
-	tr->waitfor_count = 0;
 	INIT_LIST_HEAD(&tr->locks);
-	list_add(&tr->list, &ls->transactions);
+
+	if (dl_hash_add(&di->trans_hash, &tr->hnode, hash) < 0) {
+		dl_put_free(&di->free_trans, tr);
+		goto fail;
+	}
+	list_add_tail(&tr->list, &ls->transactions);
+	di->trans_count++;
 	return tr;
+ fail:
+	log_error("get_trans: no memory");
+	disable_deadlock();
+	return NULL;
 }
 
-/* for each rsb, for each lock, find/create trans, add lkb to the trans list */
+/* a trans is freed with its last lock */
 
-static void create_trans_list(struct lockspace *ls)
+static void detach_trans(struct lockspace *ls, struct dlm_lkb *lkb)
+{
+	struct trans *tr = lkb->trans;
+
+	if (!tr)
+		return;
+
+	list_del_init(&lkb->trans_list);
+	lkb->trans = NULL;
+	lkb->waitfor_trans = NULL;
+
+	if (!list_empty(&tr->locks))
+		return;
+
+	dl_hash_del(&ls->deadlk_index->trans_hash, &tr->hnode);
+	list_del(&tr->list);
+	ls->deadlk_index->trans_count--;
+	dl_put_free(&ls->deadlk_index->free_trans, tr);
+}
+
+static void free_lkb(struct lockspace *ls, struct dlm_lkb *lkb)
+{
+	list_del(&lkb->list);
+	if (lkb->lock.copy == MASTER_COPY)
+		dl_hash_del(&ls->deadlk_index->lkb_hash, &lkb->hnode);
+	detach_trans(ls, lkb);
+	dl_put_free(&ls->deadlk_index->free_lkbs, lkb);
+}
+
+static int add_rsb_trans(struct lockspace *ls, struct dlm_rsb *r,
+			 int *lkb_count)
 {
-	struct dlm_rsb *r;
 	struct dlm_lkb *lkb;
 	struct trans *tr;
+
+	list_for_each_entry(lkb, &r->locks, list) {
+		if (lkb->trans)
+			continue;
+		tr = get_trans(ls, lkb->lock.xid);
+		if (!tr)
+			return -ENOMEM;
+		add_lkb_trans(tr, lkb);
+		(*lkb_count)++;
+	}
+	return 0;
+}
+
+/* for each rsb, for each lock not yet on a trans, find/create trans, add
+   lkb to the trans list.  Locks only change on refreshed resources after
+   a full cycle. */
+
+static int create_trans_list(struct lockspace *ls)
+{
+	struct dlm_rsb *r;
 	int r_count = 0, lkb_count = 0;
+	int rv = 0;
 
-	list_for_each_entry(r, &ls->resources, list) {
-		r_count++;
-		list_for_each_entry(lkb, &r->locks, list) {
-			lkb_count++;
-			tr = get_trans(ls, lkb->lock.xid);
-			if (!tr)
+	if (!get_index(ls))
+		return -ENOMEM;
+
+	if (ls->cycle_refresh) {
+		list_for_each_entry(r, &ls->deadlk_refresh, refresh_list) {
+			r_count++;
+			rv = add_rsb_trans(ls, r, &lkb_count);
+			if (rv < 0)
+				goto out;
+		}
+	} else {
+		list_for_each_entry(r, &ls->resources, list) {
+			r_count++;
+			rv = add_rsb_trans(ls, r, &lkb_count);
+			if (rv < 0)
 				goto out;
-			add_lkb_trans(tr, lkb);
 		}
 	}
  out:
-	log_group(ls, "create_trans_list: r_count %d lkb_count %d",
-		  r_count, lkb_count);
+	log_group(ls, "create_trans_list: r_count %d lkb_count %d trans %d",
+		  r_count, lkb_count, ls->deadlk_index->trans_count);
+	return rv;
 }
 
 static int locks_compat(struct dlm_lkb *waiting_lkb,
@@ -1230,249 +1712,352 @@ static int locks_compat(struct dlm_lkb *waiting_lkb,
 				waiting_lkb->lock.rqmode);
 }
 
-static int in_waitfor(struct trans *tr, struct trans *add_tr)
-{
-	int i;
+/* edges are collected as (waiting trans, granted trans) index pairs */
 
-	for (i = 0; i < tr->waitfor_alloc; i++) {
-		if (!tr->waitfor[i])
-			continue;
-		if (tr->waitfor[i] == add_tr)
-			return 1;
-	}
-	return 0;
-}
+struct waitfor_edge {
+	int from;
+	int to;
+};
 
-static void add_waitfor(struct lockspace *ls, struct dlm_lkb *waiting_lkb,
-			struct dlm_lkb *granted_lkb)
+static int add_edge(struct waitfor_graph *g, struct waitfor_edge **edges,
+		    int *count, int *alloc, int from, int to)
 {
-	struct trans *tr = waiting_lkb->trans;
-	int i;
-
-	if (locks_compat(waiting_lkb, granted_lkb))
-		return;
+	struct waitfor_edge *e;
+	int n;
+
+	if (*count == *alloc) {
+		n = *alloc ? *alloc * 2 : 4096;
+		e = dl_grow(g->arena, *edges,
+			    *alloc * sizeof(struct waitfor_edge),
+			    n * sizeof(struct waitfor_edge));
+		if (!e)
+			return -ENOMEM;
+		*edges = e;
+		*alloc = n;
+	}
+
+	(*edges)[*count].from = from;
+	(*edges)[*count].to = to;
+	(*count)++;
+	return 0;
+}
 
-	/* this shouldn't happen AFAIK */
-	if (tr == granted_lkb->trans) {
-		log_group(ls, "trans %llx waiting on self",
-			  (unsigned long long)tr->xid);
-		return;
-	}
+/* add a trans to the graph the first time it's reached */
 
-	/* don't add the same trans to the waitfor list multiple times */
-	if (tr->waitfor_count && in_waitfor(tr, granted_lkb->trans)) {
-		log_group(ls, "trans %llx already waiting for trans %llx, "
-			  "waiting %x %s, granted %x %s",
-			  (unsigned long long)waiting_lkb->trans->xid,
-			  (unsigned long long)granted_lkb->trans->xid,
-			  waiting_lkb->lock.id, waiting_lkb->rsb->name,
-			  granted_lkb->lock.id, granted_lkb->rsb->name);
-		return;
-	}
+static int visit_trans(struct waitfor_graph *g, struct trans *tr,
+		       uint32_t graph_gen)
+{
+	struct trans **t;
+	struct dlm_lkb *lkb;
+	int n;
 
-	if (tr->waitfor_count == tr->waitfor_alloc) {
-		struct trans **old_waitfor = tr->waitfor;
-		tr->waitfor_alloc += TR_NALLOC;
-		tr->waitfor = malloc(tr->waitfor_alloc * sizeof(tr));
-		if (!tr->waitfor) {
-			log_error("add_waitfor no mem %u", tr->waitfor_alloc);
-			return;
-		}
-		memset(tr->waitfor, 0, tr->waitfor_alloc * sizeof(tr));
+	if (tr->graph_gen == graph_gen)
+		return 0;
 
-		/* copy then free old set of pointers */
-		for (i = 0; i < tr->waitfor_count; i++)
-			tr->waitfor[i] = old_waitfor[i];
-		if (old_waitfor)
-			free(old_waitfor);
-	}
+	if (g->count == g->alloc) {
+		n = g->alloc ? g->alloc * 2 : 1024;
+		t = dl_grow(g->arena, g->trans,
+			    g->alloc * sizeof(struct trans *),
+			    n * sizeof(struct trans *));
+		if (!t)
+			return -ENOMEM;
+		g->trans = t;
+		g->alloc = n;
+	}
+
+	tr->graph_gen = graph_gen;
+	tr->index = g->count;
+	tr->canceled = 0;
+	tr->others_waiting_on_us = 0;
+	tr->waitfor_count = 0;
+	list_for_each_entry(lkb, &tr->locks, trans_list)
+		lkb->waitfor_trans = NULL;
 
-	tr->waitfor[tr->waitfor_count++] = granted_lkb->trans;
-	granted_lkb->trans->others_waiting_on_us++;
-	waiting_lkb->waitfor_trans = granted_lkb->trans;
+	g->trans[g->count++] = tr;
+	return 0;
 }
 
-/* for each trans, for each waiting lock, go to rsb of the lock,
-   find granted locks on that rsb, then find the trans the
-   granted lock belongs to, add that trans to our waitfor list */
+/* The seed trans's are all trans's for a full cycle, or those with locks
+   on refreshed resources.  The graph is extended breadth first from them:
+   each waiting lock of a trans waits for the trans of each incompatible
+   granted (or converting) lock on its resource. */
 
-static void create_waitfor_graph(struct lockspace *ls)
+static int collect_edges(struct lockspace *ls, struct waitfor_graph *g,
+			 struct waitfor_edge **edges_out, int *count_out)
 {
-	struct dlm_lkb *waiting_lkb, *granted_lkb;
+	static uint32_t graph_gen;
+	struct waitfor_edge *edges = NULL;
+	struct dlm_lkb *waiting_lkb, *lkb;
 	struct dlm_rsb *r;
 	struct trans *tr;
+	int count = 0, alloc = 0, head = 0;
 	int depend_count = 0;
 
-	list_for_each_entry(tr, &ls->transactions, list) {
+	graph_gen++;
+
+	if (ls->cycle_refresh) {
+		list_for_each_entry(r, &ls->deadlk_refresh, refresh_list) {
+			list_for_each_entry(lkb, &r->locks, list) {
+				if (lkb->trans &&
+				    visit_trans(g, lkb->trans, graph_gen) < 0)
+					goto fail;
+			}
+		}
+	} else {
+		list_for_each_entry(tr, &ls->transactions, list) {
+			if (visit_trans(g, tr, graph_gen) < 0)
+				goto fail;
+		}
+	}
+
+	while (head < g->count) {
+		tr = g->trans[head++];
+
 		list_for_each_entry(waiting_lkb, &tr->locks, trans_list) {
 			if (waiting_lkb->lock.status == DLM_LKSTS_GRANTED)
 				continue;
 			/* waiting_lkb status is CONVERT or WAITING */
 
-			r = waiting_lkb->rsb;
+			list_for_each_entry(lkb, &waiting_lkb->rsb->locks, list) {
+				if (lkb->lock.status == DLM_LKSTS_WAITING)
+					continue;
+				/* lkb status is GRANTED or CONVERT */
 
-			list_for_each_entry(granted_lkb, &r->locks, list) {
-				if (granted_lkb->lock.status==DLM_LKSTS_WAITING)
+				if (!lkb->trans)
 					continue;
-				/* granted_lkb status is GRANTED or CONVERT */
-				add_waitfor(ls, waiting_lkb, granted_lkb);
+
 				depend_count++;
+
+				if (locks_compat(waiting_lkb, lkb))
+					continue;
+
+				/* this shouldn't happen AFAIK */
+				if (tr == lkb->trans)
+					continue;
+
+				if (visit_trans(g, lkb->trans, graph_gen) < 0)
+					goto fail;
+
+				if (add_edge(g, &edges, &count, &alloc,
+					     tr->index, lkb->trans->index) < 0)
+					goto fail;
+
+				if (!waiting_lkb->waitfor_trans)
+					waiting_lkb->waitfor_trans = lkb->trans;
 			}
 		}
 	}
 
-	log_group(ls, "create_waitfor_graph: depend_count %d", depend_count);
+	log_group(ls, "collect_edges: trans %d depend_count %d edges %d",
+		  g->count, depend_count, count);
+	*edges_out = edges;
+	*count_out = count;
+	return 0;
+ fail:
+	log_error("collect_edges: no memory");
+	return -ENOMEM;
 }
 
-/* Assume a transaction that's not waiting on any locks will complete, release
-   all the locks it currently holds, and exit.  Other transactions that were
-   blocked waiting on the removed transaction's now-released locks may now be
-   unblocked, complete, release all held locks and exit.  Repeat this until
-   no more transactions can be removed.  If there are transactions remaining,
-   then they are deadlocked. */
+/* counting sort of the edges by waiting trans into adj, dropping duplicate
+   edges between the same two trans's (stamp[to] is the last from that
+   added an edge to it) */
 
-static void remove_waitfor(struct trans *tr, struct trans *remove_tr)
+static int create_waitfor_graph(struct lockspace *ls, struct waitfor_graph *g)
 {
-	int i;
-
-	for (i = 0; i < tr->waitfor_alloc; i++) {
-		if (!tr->waitfor_count)
-			break;
-
-		if (!tr->waitfor[i])
-			continue;
+	struct waitfor_edge *edges = NULL;
+	struct dl_arena_mark mark;
+	int *fill = NULL, *stamp = NULL;
+	int edge_count, i, j, from, to, out;
+	int rv;
 
-		if (tr->waitfor[i] == remove_tr) {
-			tr->waitfor[i] = NULL;
-			tr->waitfor_count--;
-			remove_tr->others_waiting_on_us--;
+	rv = collect_edges(ls, g, &edges, &edge_count);
+	if (rv < 0)
+		return rv;
+
+	g->adj_start = dl_zalloc(g->arena, (g->count + 1) * sizeof(int));
+	g->adj = dl_alloc(g->arena, (edge_count ? edge_count : 1) * sizeof(int));
+	if (!g->adj_start || !g->adj)
+		goto fail;
+
+	/* fill and stamp are only needed while the graph is built */
+
+	dl_arena_save(g->arena, &mark);
+	fill = dl_zalloc(g->arena, (g->count + 1) * sizeof(int));
+	stamp = dl_alloc(g->arena, (g->count ? g->count : 1) * sizeof(int));
+	if (!fill || !stamp)
+		goto fail;
+
+	for (i = 0; i < edge_count; i++)
+		fill[edges[i].from + 1]++;
+	for (i = 0; i < g->count; i++)
+		fill[i + 1] += fill[i];
+	for (i = 0; i < edge_count; i++)
+		g->adj[fill[edges[i].from]++] = edges[i].to;
+
+	/* fill[i] is now the end of i's edges, compact out duplicates */
+
+	for (i = 0; i < g->count; i++)
+		stamp[i] = -1;
+
+	out = 0;
+	j = 0;
+	for (from = 0; from < g->count; from++) {
+		g->adj_start[from] = out;
+		for (; j < fill[from]; j++) {
+			to = g->adj[j];
+			if (stamp[to] == from)
+				continue;
+			stamp[to] = from;
+			g->adj[out++] = to;
+			g->trans[from]->waitfor_count++;
+			g->trans[to]->others_waiting_on_us++;
 		}
 	}
+	g->adj_start[g->count] = out;
+	g->edge_count = out;
+
+	log_group(ls, "create_waitfor_graph: trans %d edges %d",
+		  g->count, g->edge_count);
+	dl_arena_rewind(g->arena, &mark);
+	return 0;
+ fail:
+	log_error("create_waitfor_graph: no memory");
+	return -ENOMEM;
 }
 
-/* remove_tr is not waiting for anything, assume it completes and goes away
-   and remove it from any other transaction's waitfor list */
+/*
+ * Tarjan's strongly connected components, iterative so a long chain of
+ * waiting trans's can't overflow the stack.  Canceled trans's are left
+ * out of the graph.  Each SCC with more than one trans is a deadlock, and
+ * for each, victim[] gets the trans to cancel: the one the most others in
+ * the graph are waiting on, and scc[] of each of its trans's gets the
+ * deadlock's number (-1 for trans's not in one).  Returns the number of
+ * deadlocks.
+ */
+
+struct tarjan_frame {
+	int node;
+	int edge;		/* next index in adj to visit */
+};
 
-static void remove_trans(struct lockspace *ls, struct trans *remove_tr)
+static int find_deadlocked(struct waitfor_graph *g, struct trans **victims,
+			   int *scc)
 {
-	struct trans *tr;
+	struct tarjan_frame *frames;
+	struct dl_arena_mark mark;
+	int *index, *low, *stack;
+	char *on_stack;
+	int next_index = 0, sp = 0, fp, found = 0;
+	int i, v, w, size, n;
+	struct trans *best;
+
+	/* the work arrays are given back after each search */
+	dl_arena_save(g->arena, &mark);
+
+	n = g->count ? g->count : 1;
+	index = dl_alloc(g->arena, n * sizeof(int));
+	low = dl_alloc(g->arena, n * sizeof(int));
+	stack = dl_alloc(g->arena, n * sizeof(int));
+	on_stack = dl_zalloc(g->arena, n);
+	frames = dl_alloc(g->arena, n * sizeof(struct tarjan_frame));
+	if (!index || !low || !stack || !on_stack || !frames) {
+		found = -ENOMEM;
+		goto out;
+	}
 
-	list_for_each_entry(tr, &ls->transactions, list) {
-		if (tr == remove_tr)
-			continue;
-		if (!remove_tr->others_waiting_on_us)
-			break;
-		remove_waitfor(tr, remove_tr);
+	for (i = 0; i < g->count; i++) {
+		index[i] = -1;
+		scc[i] = -1;
 	}
 
-	if (remove_tr->others_waiting_on_us)
-		log_group(ls, "trans %llx removed others waiting %d",
-			  (unsigned long long)remove_tr->xid,
-			  remove_tr->others_waiting_on_us);
-}
+	for (i = 0; i < g->count; i++) {
+		if (index[i] != -1 || g->trans[i]->canceled)
+			continue;
 
-static int reduce_waitfor_graph(struct lockspace *ls)
-{
-	struct trans *tr, *safe;
-	int blocked = 0;
-	int removed = 0;
+		fp = 0;
+		frames[fp].node = i;
+		frames[fp].edge = g->adj_start[i];
+		index[i] = low[i] = next_index++;
+		stack[sp++] = i;
+		on_stack[i] = 1;
 
-	list_for_each_entry_safe(tr, safe, &ls->transactions, list) {
-		if (tr->waitfor_count) {
-			blocked++;
-			continue;
-		}
-		remove_trans(ls, tr);
-		list_del(&tr->list);
-		if (tr->waitfor)
-			free(tr->waitfor);
-		free(tr);
-		removed++;
-	}
+		while (fp >= 0) {
+			v = frames[fp].node;
 
-	log_group(ls, "reduce_waitfor_graph: %d blocked, %d removed",
-		  blocked, removed);
-	return removed;
-}
+			if (frames[fp].edge < g->adj_start[v + 1]) {
+				w = g->adj[frames[fp].edge++];
 
-static void reduce_waitfor_graph_loop(struct lockspace *ls)
-{
-	int removed;
+				if (g->trans[w]->canceled)
+					continue;
 
-	while (1) {
-		removed = reduce_waitfor_graph(ls);
-		if (!removed)
-			break;
-	}
-}
+				if (index[w] == -1) {
+					/* descend into w */
+					index[w] = low[w] = next_index++;
+					stack[sp++] = w;
+					on_stack[w] = 1;
+					fp++;
+					frames[fp].node = w;
+					frames[fp].edge = g->adj_start[w];
+				} else if (on_stack[w] && index[w] < low[v]) {
+					low[v] = index[w];
+				}
+				continue;
+			}
 
-static struct trans *find_trans_to_cancel(struct lockspace *ls)
-{
-	struct trans *tr;
+			/* all of v's edges are done */
+
+			if (low[v] == index[v]) {
+				/* v is the root of an SCC, pop it */
+				size = 0;
+				best = NULL;
+				do {
+					w = stack[--sp];
+					on_stack[w] = 0;
+					size++;
+					if (!best || g->trans[w]->others_waiting_on_us >
+						     best->others_waiting_on_us)
+						best = g->trans[w];
+				} while (w != v);
+
+				if (size > 1) {
+					/* the members are above v's old
+					   stack position */
+					for (w = sp; w < sp + size; w++)
+						scc[stack[w]] = found;
+					victims[found++] = best;
+				}
+			}
 
-	list_for_each_entry(tr, &ls->transactions, list) {
-		if (!tr->others_waiting_on_us)
-			continue;
-		return tr;
+			fp--;
+			if (fp >= 0 && low[v] < low[frames[fp].node])
+				low[frames[fp].node] = low[v];
+		}
 	}
-	return NULL;
+ out:
+	dl_arena_rewind(g->arena, &mark);
+	return found;
 }
 
-static void cancel_trans(struct lockspace *ls)
+static void cancel_trans(struct lockspace *ls, struct trans *tr)
 {
-	struct trans *tr;
 	struct dlm_lkb *lkb;
-	int removed;
 
-	tr = find_trans_to_cancel(ls);
-	if (!tr) {
-		log_group(ls, "cancel_trans: no trans found");
-		return;
-	}
+	log_group(ls, "cancel_trans %llx others_waiting_on_us %d",
+		  (unsigned long long)tr->xid, tr->others_waiting_on_us);
 
 	list_for_each_entry(lkb, &tr->locks, trans_list) {
 		if (lkb->lock.status == DLM_LKSTS_GRANTED)
 			continue;
 		send_cancel_lock(ls, tr, lkb);
-
-		/* When this canceled trans has multiple locks all blocked by
-		   locks held by one other trans, that other trans is only
-		   added to tr->waitfor once, and only one of these waiting
-		   locks will have waitfor_trans set.  So, the lkb with
-		   non-null waitfor_trans was the first one responsible
-		   for adding waitfor_trans to tr->waitfor.
-
-		   We could potentially forget about keeping track of lkb->
-		   waitfor_trans, forget about calling remove_waitfor()
-		   here and just set tr->waitfor_count = 0 after this loop.
-		   The loss would be that waitfor_trans->others_waiting_on_us
-		   would not get decremented. */
-
-		if (lkb->waitfor_trans)
-			remove_waitfor(tr, lkb->waitfor_trans);
 	}
 
-	/* this shouldn't happen, if it does something's not working right */
-	if (tr->waitfor_count) {
-		log_group(ls, "cancel_trans: %llx non-zero waitfor_count %d",
-			  (unsigned long long)tr->xid, tr->waitfor_count);
-	}
-
-	/* this should now remove the canceled trans since it now has a zero
-	   waitfor_count */
-	removed = reduce_waitfor_graph(ls);
-
-	if (!removed)
-		log_group(ls, "canceled trans not removed from graph");
-
-	/* now call reduce_waitfor_graph() in another loop and it
-	   should completely reduce */
+	tr->canceled = 1;
 }
 
-static void dump_trans(struct lockspace *ls, struct trans *tr)
+static void dump_trans(struct lockspace *ls, struct waitfor_graph *g,
+		       struct trans *tr)
 {
 	struct dlm_lkb *lkb;
-	struct trans *wf;
 	int i;
 
 	log_group(ls, "trans xid %llx waitfor_count %d others_waiting_on_us %d",
@@ -1497,61 +2082,143 @@ static void dump_trans(struct lockspace *ls, struct trans *tr)
 
 	log_group(ls, "waitfor:");
 
-	for (i = 0; i < tr->waitfor_alloc; i++) {
-		if (!tr->waitfor[i])
-			continue;
-		wf = tr->waitfor[i];
-		log_group(ls, "  xid %llx", (unsigned long long)wf->xid);
-	}
+	for (i = g->adj_start[tr->index]; i < g->adj_start[tr->index + 1]; i++)
+		log_group(ls, "  xid %llx",
+			  (unsigned long long)g->trans[g->adj[i]]->xid);
 }
 
-static void dump_all_trans(struct lockspace *ls)
+static void dump_all_trans(struct lockspace *ls, struct waitfor_graph *g)
 {
-	struct trans *tr;
+	int i;
+
+	if (g->count > DEADLK_DUMP_MAX) {
+		log_group(ls, "Transaction dump skipped: %d transactions",
+			  g->count);
+		return;
+	}
 
 	log_group(ls, "Transaction dump:");
 
-	list_for_each_entry(tr, &ls->transactions, list)
-		dump_trans(ls, tr);
+	for (i = 0; i < g->count; i++)
+		dump_trans(ls, g, g->trans[i]);
+}
+
+/* a deadlock found by a refresh may include locks that weren't refreshed;
+   make those resources pending and return how many there are */
+
+static int pending_stale(struct lockspace *ls, struct waitfor_graph *g,
+			 int *scc)
+{
+	static uint32_t mark;
+	struct dlm_lkb *lkb;
+	struct dlm_rsb *r;
+	int i, count = 0;
+
+	mark++;
+
+	for (i = 0; i < g->count; i++) {
+		if (scc[i] < 0)
+			continue;
+
+		list_for_each_entry(lkb, &g->trans[i]->locks, trans_list) {
+			r = lkb->rsb;
+			if (r->refresh_gen == ls->deadlk_refresh_gen ||
+			    r->mark == mark)
+				continue;
+			r->mark = mark;
+			add_pending(ls, r);
+			count++;
+		}
+	}
+	return count;
 }
 
+/* after canceling one trans in each deadlock, a deadlock that had more
+   than one cycle may still have one, so look again without the canceled
+   trans's */
+
+#define MAX_CANCEL_ROUNDS 16
+
 static void find_deadlock(struct lockspace *ls)
 {
+	struct waitfor_graph g;
+	struct dl_arena arena;
+	struct trans **victims = NULL;
+	struct timeval start, end;
+	int *scc = NULL;
+	int i, found, round, stale = 0, canceled = 0;
+
+	memset(&g, 0, sizeof(g));
+	memset(&arena, 0, sizeof(arena));
+	g.arena = &arena;
+
 	if (list_empty(&ls->resources)) {
 		log_group(ls, "no deadlock: no resources");
 		goto out;
 	}
 
-	if (!list_empty(&ls->transactions)) {
-		log_group(ls, "transactions list should be empty");
-		goto out;
-	}
+	gettimeofday(&start, NULL);
 
-	dump_resources(ls);
-	create_trans_list(ls);
-	create_waitfor_graph(ls);
-	dump_all_trans(ls);
-	reduce_waitfor_graph_loop(ls);
+	if (!ls->cycle_refresh)
+		dump_resources(ls);
+	if (create_waitfor_graph(ls, &g) < 0)
+		goto out;
+	dump_all_trans(ls, &g);
 
-	if (list_empty(&ls->transactions)) {
-		log_group(ls, "no deadlock: all transactions reduced");
+	victims = dl_alloc(&arena, (g.count ? g.count : 1) * sizeof(struct trans *));
+	scc = dl_alloc(&arena, (g.count ? g.count : 1) * sizeof(int));
+	if (!victims || !scc) {
+		log_error("find_deadlock: no memory");
 		goto out;
 	}
 
-	log_group(ls, "found deadlock");
-	dump_all_trans(ls);
+	for (round = 0; round < MAX_CANCEL_ROUNDS; round++) {
+		found = find_deadlocked(&g, victims, scc);
+		if (found < 0) {
+			log_error("find_deadlock: no memory");
+			goto out;
+		}
+		if (!found)
+			break;
+
+		log_group(ls, "found %d deadlocks", found);
 
-	cancel_trans(ls);
-	reduce_waitfor_graph_loop(ls);
+		if (ls->cycle_refresh && !round) {
+			stale = pending_stale(ls, &g, scc);
+			if (stale)
+				goto out;
+		}
 
-	if (list_empty(&ls->transactions)) {
-		log_group(ls, "resolved deadlock with cancel");
-		goto out;
+		for (i = 0; i < found; i++)
+			cancel_trans(ls, victims[i]);
+		canceled += found;
 	}
 
-	log_error("deadlock resolution failed");
-	dump_all_trans(ls);
+	gettimeofday(&end, NULL);
+
+	if (!canceled)
+		log_group(ls, "no deadlock: trans %d edges %d usec %llu",
+			  g.count, g.edge_count,
+			  (unsigned long long)dt_usec(&start, &end));
+	else if (round < MAX_CANCEL_ROUNDS)
+		log_group(ls, "resolved deadlock with %d cancels usec %llu",
+			  canceled, (unsigned long long)dt_usec(&start, &end));
+	else
+		log_error("deadlock resolution failed after %d cancels",
+			  canceled);
  out:
+	dl_arena_free(&arena);
 	send_cycle_end(ls);
-}
 
+	if (!stale)
+		return;
+
+	if (ls->deadlk_refresh_rounds < DEADLK_REFRESH_ROUNDS) {
+		log_group(ls, "deadlock includes %d stale resources", stale);
+		send_refresh(ls, 1);
+	} else {
+		log_group(ls, "deadlock still stale after %d refreshes",
+			  ls->deadlk_refresh_rounds);
+		send_cycle_start(ls);
+	}
+}
@@ -0,0 +1,430 @@
+/*
+ * Copyright 2004-2012 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <linux/dlmconstants.h>
+#include "libdlmcontrol.h"
+
+/*
+ * The debugfs lock tables can be millions of lines.  Lines are read with
+ * large reads into the caller's buffer and handed back in place, and the
+ * fields are picked off with the simple scanners below instead of sscanf,
+ * which spends most of its time reparsing the format string.
+ */
+
+int dlmc_debugfs_open(struct dlmc_debugfs *df, const char *lsname,
+		      const char *suffix, char *buf, int size)
+{
+	char path[PATH_MAX];
+
+	memset(df, 0, sizeof(struct dlmc_debugfs));
+
+	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s%s", lsname, suffix);
+
+	df->fd = open(path, O_RDONLY);
+	if (df->fd < 0)
+		return -errno;
+
+	df->buf = buf;
+	df->size = size;
+	return 0;
+}
+
+void dlmc_debugfs_close(struct dlmc_debugfs *df)
+{
+	if (df->fd >= 0)
+		close(df->fd);
+	df->fd = -1;
+}
+
+/* move the partial line left at the end of buf to the start and read more */
+
+static int fill_buf(struct dlmc_debugfs *df)
+{
+	int len = df->end - df->start;
+	int rv;
+
+	if (df->start) {
+		memmove(df->buf, df->buf + df->start, len);
+		df->start = 0;
+		df->end = len;
+	}
+
+	/* leave room for the nul added to a last line without a newline */
+	while (df->end < df->size - 1) {
+		rv = read(df->fd, df->buf + df->end, df->size - 1 - df->end);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0)
+			return -errno;
+		if (!rv) {
+			df->eof = 1;
+			break;
+		}
+		df->end += rv;
+
+		/* one read is enough if it ended a line */
+		if (df->buf[df->end - 1] == '\n')
+			break;
+	}
+	return 0;
+}
+
+char *dlmc_debugfs_line(struct dlmc_debugfs *df, int *len)
+{
+	char *line, *nl;
+	int searched = 0;
+
+	while (1) {
+		line = df->buf + df->start;
+		nl = memchr(line + searched, '\n',
+			    df->end - df->start - searched);
+		if (nl)
+			break;
+
+		if (df->eof) {
+			/* last line without a newline */
+			if (df->start == df->end)
+				return NULL;
+			nl = df->buf + df->end;
+			break;
+		}
+
+		/* a line that fills the whole buffer is cut short */
+		if (!df->start && df->end >= df->size - 1) {
+			nl = df->buf + df->end;
+			break;
+		}
+
+		searched = df->end - df->start;
+		if (fill_buf(df) < 0)
+			return NULL;
+	}
+
+	*nl = '\0';
+	*len = nl - line;
+	df->start = nl - df->buf;
+	if (df->start < df->end)
+		df->start++;
+	else
+		df->end = df->start;
+	df->lines++;
+	return line;
+}
+
+/*
+ * Field scanners.  Each skips leading blanks, consumes one field, and
+ * returns 0 if there was no field of the expected form.
+ */
+
+static inline char *skip_blanks(char *p, char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	return p;
+}
+
+static inline int hex_val(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static int scan_u64(char **pp, char *end, int base, uint64_t *val)
+{
+	char *p = skip_blanks(*pp, end);
+	char *start;
+	uint64_t v = 0;
+	int d;
+
+	start = p;
+
+	while (p < end) {
+		d = hex_val(*p);
+		if (d < 0 || d >= base)
+			break;
+		v = v * base + d;
+		p++;
+	}
+	if (p == start)
+		return 0;
+
+	*val = v;
+	*pp = p;
+	return 1;
+}
+
+static int scan_s64(char **pp, char *end, int64_t *val)
+{
+	char *p = skip_blanks(*pp, end);
+	uint64_t v;
+	int neg = 0;
+
+	if (p < end && (*p == '-' || *p == '+')) {
+		neg = (*p == '-');
+		p++;
+	}
+	if (!scan_u64(&p, end, 10, &v))
+		return 0;
+
+	*val = neg ? -(int64_t)v : (int64_t)v;
+	*pp = p;
+	return 1;
+}
+
+static int scan_token(char **pp, char *end, char **tok, int *tok_len)
+{
+	char *p = skip_blanks(*pp, end);
+	char *start = p;
+
+	while (p < end && *p != ' ' && *p != '\t')
+		p++;
+	if (p == start)
+		return 0;
+
+	*tok = start;
+	*tok_len = p - start;
+	*pp = p;
+	return 1;
+}
+
+/*
+ * Helpers that store into the sized fields of the structs below, so the
+ * parse functions read like the sscanf formats they replace.
+ */
+
+static inline int scan_x32(char **pp, char *end, uint32_t *val)
+{
+	uint64_t v;
+
+	if (!scan_u64(pp, end, 16, &v))
+		return 0;
+	*val = v;
+	return 1;
+}
+
+static inline int scan_u32(char **pp, char *end, uint32_t *val)
+{
+	uint64_t v;
+
+	if (!scan_u64(pp, end, 10, &v))
+		return 0;
+	*val = v;
+	return 1;
+}
+
+static inline int scan_int(char **pp, char *end, int *val)
+{
+	int64_t v;
+
+	if (!scan_s64(pp, end, &v))
+		return 0;
+	*val = v;
+	return 1;
+}
+
+static inline int scan_s8(char **pp, char *end, int8_t *val)
+{
+	int64_t v;
+
+	if (!scan_s64(pp, end, &v))
+		return 0;
+	*val = v;
+	return 1;
+}
+
+/* count each field parsed, returning the count at the first one missing */
+
+#define FIELD(x) \
+do { \
+	if (!(x)) \
+		return rv; \
+	rv++; \
+} while (0)
+
+/*
+ * The name that follows a "str" or "hex" format field is the rest of the
+ * line after a single space.
+ */
+
+static int scan_namefmt(char **pp, char *end, int *hex, char **name,
+			int *name_len)
+{
+	char *fmt;
+	int fmt_len;
+
+	if (!scan_token(pp, end, &fmt, &fmt_len))
+		return 0;
+
+	if (fmt_len == 3 && !memcmp(fmt, "str", 3))
+		*hex = 0;
+	else if (fmt_len == 3 && !memcmp(fmt, "hex", 3))
+		*hex = 1;
+	else
+		return 0;
+
+	*name = *pp < end ? *pp + 1 : end;
+	*name_len = end - *name;
+	return 1;
+}
+
+/*
+ * id nodeid remid pid xid exflags flags sts grmode rqmode time_ms
+ * r_nodeid r_len "r_name"
+ */
+
+int dlmc_parse_lock(char *line, int len, struct dlmc_debugfs_lock *lk)
+{
+	char *p = line, *end = line + len;
+	char *q;
+	int rv = 0;
+
+	FIELD(scan_x32(&p, end, &lk->id));
+	FIELD(scan_int(&p, end, &lk->nodeid));
+	FIELD(scan_x32(&p, end, &lk->remid));
+	FIELD(scan_int(&p, end, &lk->ownpid));
+	FIELD(scan_u64(&p, end, 10, &lk->xid));
+	FIELD(scan_x32(&p, end, &lk->exflags));
+	FIELD(scan_x32(&p, end, &lk->flags));
+	FIELD(scan_s8(&p, end, &lk->status));
+	FIELD(scan_s8(&p, end, &lk->grmode));
+	FIELD(scan_s8(&p, end, &lk->rqmode));
+	FIELD(scan_u64(&p, end, 10, &lk->wait_time));
+	FIELD(scan_int(&p, end, &lk->r_nodeid));
+	FIELD(scan_int(&p, end, &lk->r_len));
+
+	lk->r_name = end;
+	lk->r_name_len = 0;
+
+	q = memchr(p, '"', end - p);
+	if (!q)
+		return rv;
+	lk->r_name = q + 1;
+
+	/* the name may itself contain quotes, so trust r_len when it fits */
+	if (lk->r_len >= 0 && lk->r_len < end - lk->r_name &&
+	    lk->r_name[lk->r_len] == '"') {
+		lk->r_name_len = lk->r_len;
+	} else {
+		q = memchr(lk->r_name, '"', end - lk->r_name);
+		lk->r_name_len = (q ? q : end) - lk->r_name;
+	}
+	return rv;
+}
+
+/*
+ * rsb addr nodeid first_lkid flags root_list recover_list
+ * recover_locks_count len str|hex name
+ */
+
+int dlmc_parse_rsb(char *line, int len, struct dlmc_debugfs_rsb *r)
+{
+	char *p = line, *end = line + len;
+	char *type;
+	int type_len;
+	int rv = 0;
+
+	FIELD(scan_token(&p, end, &type, &type_len));
+	FIELD(scan_token(&p, end, &r->addr, &r->addr_len));
+	FIELD(scan_int(&p, end, &r->nodeid));
+	FIELD(scan_token(&p, end, &r->first_lkid, &r->first_lkid_len));
+	FIELD(scan_u32(&p, end, &r->flags));
+	FIELD(scan_int(&p, end, &r->root_list));
+	FIELD(scan_int(&p, end, &r->recover_list));
+	FIELD(scan_int(&p, end, &r->recover_locks_count));
+	FIELD(scan_int(&p, end, &r->namelen));
+	FIELD(scan_namefmt(&p, end, &r->hex, &r->name, &r->name_len));
+	return rv;
+}
+
+/*
+ * rsb addr res_nodeid master_nodeid dir_nodeid our_nodeid toss_time
+ * flags len str|hex name
+ */
+
+int dlmc_parse_toss(char *line, int len, struct dlmc_debugfs_toss *t)
+{
+	char *p = line, *end = line + len;
+	char *type;
+	int type_len;
+	int rv = 0;
+
+	FIELD(scan_token(&p, end, &type, &type_len));
+	FIELD(scan_token(&p, end, &t->addr, &t->addr_len));
+	FIELD(scan_int(&p, end, &t->res_nodeid));
+	FIELD(scan_int(&p, end, &t->master_nodeid));
+	FIELD(scan_int(&p, end, &t->dir_nodeid));
+	FIELD(scan_int(&p, end, &t->our_nodeid));
+	FIELD(scan_u64(&p, end, 10, &t->toss_time));
+	FIELD(scan_u32(&p, end, &t->flags));
+	FIELD(scan_int(&p, end, &t->namelen));
+	FIELD(scan_namefmt(&p, end, &t->hex, &t->name, &t->name_len));
+	return rv;
+}
+
+/*
+ * lkb id nodeid remid pid xid exflags flags sts grmode rqmode highbast
+ * rsb_lookup wait_type lvbseq timestamp time_bast
+ */
+
+int dlmc_parse_lkb(char *line, int len, struct dlmc_debugfs_lkb *lkb)
+{
+	char *p = line, *end = line + len;
+	char *type;
+	int type_len;
+	int rv = 0;
+
+	FIELD(scan_token(&p, end, &type, &type_len));
+	FIELD(scan_x32(&p, end, &lkb->id));
+	FIELD(scan_int(&p, end, &lkb->nodeid));
+	FIELD(scan_x32(&p, end, &lkb->remid));
+	FIELD(scan_int(&p, end, &lkb->ownpid));
+	FIELD(scan_u64(&p, end, 10, &lkb->xid));
+	FIELD(scan_x32(&p, end, &lkb->exflags));
+	FIELD(scan_x32(&p, end, &lkb->flags));
+	FIELD(scan_int(&p, end, &lkb->status));
+	FIELD(scan_int(&p, end, &lkb->grmode));
+	FIELD(scan_int(&p, end, &lkb->rqmode));
+	FIELD(scan_int(&p, end, &lkb->highbast));
+	FIELD(scan_int(&p, end, &lkb->rsb_lookup));
+	FIELD(scan_int(&p, end, &lkb->wait_type));
+	FIELD(scan_u32(&p, end, &lkb->lvbseq));
+	FIELD(scan_u64(&p, end, 10, &lkb->timestamp));
+	FIELD(scan_u64(&p, end, 10, &lkb->time_bast));
+	return rv;
+}
+
+/* id wait_type nodeid name */
+
+int dlmc_parse_waiter(char *line, int len, struct dlmc_debugfs_waiter *w)
+{
+	char *p = line, *end = line + len;
+	int rv = 0;
+
+	FIELD(scan_x32(&p, end, &w->id));
+	FIELD(scan_int(&p, end, &w->wait_type));
+	FIELD(scan_int(&p, end, &w->nodeid));
+
+	w->name = p < end ? p + 1 : end;
+	w->name_len = end - w->name;
+	rv++;
+	return rv;
+}
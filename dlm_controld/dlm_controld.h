@@ -32,6 +32,8 @@
 #define DLMC_CMD_FENCE_ACK		12
 #define DLMC_CMD_DUMP_STATUS		13
 #define DLMC_CMD_DUMP_CONFIG		14
+#define DLMC_CMD_DUMP_MSG_STATS		15
+#define DLMC_CMD_DUMP_RECOVERY		16
 
 struct dlmc_header {
 	unsigned int magic;
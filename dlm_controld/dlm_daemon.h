@@ -104,9 +104,13 @@ enum {
         post_join_delay_ind,
         enable_fencing_ind,
         enable_concurrent_fencing_ind,
+        fence_concurrency_ind,
+        fence_executor_ind,
         enable_startup_fencing_ind,
         enable_quorum_fencing_ind,
         enable_quorum_lockspace_ind,
+        join_concurrency_ind,
+        kernel_write_threads_ind,
         help_ind,
         version_ind,
         dlm_options_max,
@@ -148,6 +152,45 @@ EXTERN struct dlm_option dlm_options[dlm_options_max];
 
 #define MAX_NODES	128
 
+/* Per-node state is indexed by a dense node slot, see node_slot() in
+   member.c.  Slots are never reused, so there are more of them than the
+   maximum number of members at once. */
+
+#define NODE_SLOTS	(MAX_NODES * 2)
+#define NODE_MAP_WORDS	(NODE_SLOTS / 64)
+
+struct node_map {
+	uint64_t bits[NODE_MAP_WORDS];
+};
+
+static inline void node_map_set(struct node_map *map, int slot)
+{
+	map->bits[slot / 64] |= 1ULL << (slot % 64);
+}
+
+static inline void node_map_clear(struct node_map *map, int slot)
+{
+	map->bits[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+static inline int node_map_test(struct node_map *map, int slot)
+{
+	return (map->bits[slot / 64] >> (slot % 64)) & 1;
+}
+
+/* all nodes in map a are also in map b */
+
+static inline int node_map_subset(struct node_map *a, struct node_map *b)
+{
+	int i;
+
+	for (i = 0; i < NODE_MAP_WORDS; i++) {
+		if (a->bits[i] & ~b->bits[i])
+			return 0;
+	}
+	return 1;
+}
+
 /* Maximum number of IP addresses per node, when using SCTP and multi-ring in
    corosync  In dlm-kernel this is DLM_MAX_ADDR_COUNT, currently 3. */
 
@@ -164,6 +207,7 @@ EXTERN int poll_fencing;
 EXTERN int poll_fs;
 EXTERN int poll_ignore_plock;
 EXTERN int poll_drop_plock;
+EXTERN int poll_joins;
 EXTERN int plock_fd;
 EXTERN int plock_ci;
 EXTERN struct list_head lockspaces;
@@ -179,10 +223,12 @@ EXTERN uint32_t control_minor;
 EXTERN uint32_t monitor_minor;
 EXTERN uint32_t plock_minor;
 EXTERN struct fence_device fence_all_device;
+EXTERN int config_reloads;
 
 #define LOG_DUMP_SIZE DLMC_DUMP_SIZE
 
 #define LOG_PLOCK 0x00010000
+#define LOG_NODUMP 0x00020000	/* not saved in the dump buffers */
 #define LOG_NONE  0x00001111
 
 void log_level(char *name_in, uint32_t level_in, const char *fmt, ...);
@@ -208,10 +254,13 @@ enum {
 	DLM_MSG_PLOCKS_DATA,
 	DLM_MSG_DEADLK_CYCLE_START,
 	DLM_MSG_DEADLK_CYCLE_END,
-	DLM_MSG_DEADLK_CHECKPOINT_READY,
+	DLM_MSG_DEADLK_LOCKS_DONE,
 	DLM_MSG_DEADLK_CANCEL_LOCK,
 	DLM_MSG_FENCE_RESULT,
 	DLM_MSG_FENCE_CLEAR,
+	DLM_MSG_DEADLK_LOCKS_DATA,
+	DLM_MSG_DEADLK_REFRESH,
+	DLM_MSG_MAX,
 };
 
 /* dlm_header flags */
@@ -230,11 +279,87 @@ struct dlm_header {
 	uint32_t msgdata;       /* in-header payload depends on MSG type; lkid
 				   for deadlock, seq for lockspace membership */
 	uint32_t msgdata2;	/* second MSG-specific data */
-	uint64_t pad;
+	uint64_t send_time;	/* sender's monotonic usec, only compared
+				   against our own clock for msg_stats;
+				   old versions zero it as padding */
 };
 
+/* usec histograms have decade buckets: <10us, <100us, ... <10s, >=10s */
+
+#define USEC_HIST_BUCKETS 8
+
+/* cpg message counters per DLM_MSG_ type, kept for the daemon cpg and
+   for each lockspace cpg.  handle_hist is the usec spent in the deliver
+   handler.  latency is send to delivery of our own messages. */
+
+struct msg_stats {
+	uint64_t send_count;
+	uint64_t send_bytes;
+	uint64_t send_retries;
+	uint64_t recv_count;
+	uint64_t recv_bytes;
+	uint64_t handle_hist[USEC_HIST_BUCKETS];
+	uint64_t handle_usec_max;
+	uint64_t latency_count;
+	uint64_t latency_usec_total;
+	uint64_t latency_usec_max;
+};
+
+/* Recovery stages of a lockspace change, in the order they complete.
+   Each stage is timed from the end of the previous one, the first from
+   the confchg. */
+
+enum {
+	RS_STOP = 0,		/* stop_kernel */
+	RS_RINGID,		/* wait for cpg and quorum ringids to match */
+	RS_QUORUM,		/* wait for quorum */
+	RS_FENCING,		/* wait for failed nodes to be fenced */
+	RS_FS,			/* wait for fs notification of failed nodes */
+	RS_START_SENT,		/* send_start */
+	RS_MESSAGES,		/* wait for start messages from all members */
+	RS_KERNEL,		/* start_kernel */
+	RS_PLOCKS,		/* prepare_plocks */
+	RS_STAGES,
+};
+
+#define RECOVERY_HISTORY 32
+
+struct recovery_record {
+	uint32_t seq;
+	uint32_t combined_seq;
+	int member_count;
+	int joined_count;
+	int remove_count;
+	int failed_count;
+	uint64_t walltime;
+	uint64_t total_usec;
+	uint64_t stage_usec[RS_STAGES];
+};
+
+/* stage RS_STAGES is the whole change */
+
+struct recovery_stats {
+	uint64_t count;
+	uint64_t usec_total[RS_STAGES + 1];
+	uint64_t usec_max[RS_STAGES + 1];
+	uint64_t hist[RS_STAGES + 1][USEC_HIST_BUCKETS];
+};
+
+/* lockspace lookup indexes, see ls_index_add() */
+
+enum {
+	LS_HASH_NAME = 0,
+	LS_HASH_ID,
+	LS_HASH_HANDLE,
+	LS_HASH_CI,
+	LS_HASH_KEYS,
+};
+
+#define LS_HASH_SIZE	1024	/* buckets per index, power of 2 */
+
 struct lockspace {
 	struct list_head	list;
+	struct list_head	hash_list[LS_HASH_KEYS];
 	char			name[DLM_LOCKSPACE_LEN+1];
 	uint32_t		global_id;
 
@@ -257,11 +382,31 @@ struct lockspace {
 	int			kernel_stopped;
 	int			fs_registered;
 	int			wait_debug; /* for status/debugging */
+	int			apply_deferred; /* see process_cpg_lockspace */
+	int			kernel_ops_pending; /* see queue_kernel_op */
+
+	/* configfs nodes dir contents, see set_configfs_members */
+
+	int			configfs_loaded;
+	int			configfs_count;
+	int			configfs_nodes[MAX_NODES];
+
+	/* join pipeline, see process_lockspace_joins */
+
+	struct list_head	join_list;
+	int			join_queued;
+	int			join_inflight;
+	int			join_retries;
+	uint64_t		join_queue_usec;
+	uint64_t		join_cpg_usec;
+	uint64_t		join_confchg_usec;
+
 	uint32_t		change_seq;
 	uint32_t		started_count;
 	struct change		*started_change;
 	struct list_head	changes;
 	struct list_head	node_history;
+	struct node		*node_history_slots[NODE_SLOTS];
 
 	/* plock stuff */
 
@@ -276,28 +421,57 @@ struct lockspace {
 	time_t			last_plock_time;
 	struct timeval		drop_resources_last;
 
+	struct msg_stats	msg_stats[DLM_MSG_MAX];
+
+	/* recovery timeline, see record_recovery */
+
+	int			recovery_next;
+	struct recovery_record	recovery_history[RECOVERY_HISTORY];
+	struct recovery_stats	recovery_stats;
+
 #if 0
 	/* deadlock stuff */
 
 	int			deadlk_low_nodeid;
 	struct list_head	deadlk_nodes;
-	uint64_t		deadlk_ckpt_handle;
 	int			deadlk_confchg_init;
 	struct list_head	transactions;
 	struct list_head	resources;
+	struct deadlk_index	*deadlk_index;
+	struct list_head	deadlk_refresh;
+	struct list_head	deadlk_pending;
+	uint32_t		deadlk_refresh_gen;
+	uint32_t		deadlk_refresh_round;
+	int			deadlk_refresh_rounds;
+	int			deadlk_state_valid;
+	int			deadlk_confchg_seen;
+	int			cycle_refresh;
 	struct timeval		cycle_start_time;
 	struct timeval		cycle_end_time;
 	struct timeval		last_send_cycle_start;
 	int			cycle_running;
-	int			all_checkpoints_ready;
+	int			all_locks_done;
 #endif
 };
 
+/* client_add priority classes, dispatched in this order from loop() */
+
+enum {
+	CLIENT_PRI_HIGH = 0,	/* quorum, cfg and daemon cpg */
+	CLIENT_PRI_LS,		/* lockspace cpgs, uevents, fs clients */
+	CLIENT_PRI_BULK,	/* plock device */
+	CLIENT_PRI_CLASSES,
+};
+
 /* action.c */
-int set_sysfs_control(char *name, int val);
-int set_sysfs_event_done(char *name, int val);
-int set_sysfs_id(char *name, uint32_t id);
-int set_sysfs_nodir(char *name, int val);
+int setup_kernel_ops(void);
+void process_kernel_ops(int ci);
+void kernel_ops_forget(struct lockspace *ls);
+void close_kernel_ops(void);
+int set_sysfs_control(struct lockspace *ls, int val);
+int set_sysfs_event_done(struct lockspace *ls, int val);
+int set_sysfs_id(struct lockspace *ls, uint32_t id);
+int set_sysfs_nodir(struct lockspace *ls, int val);
 int set_configfs_members(struct lockspace *ls, char *name,
 			 int new_count, int *new_members,
 			 int renew_count, int *renew_members);
@@ -314,11 +488,17 @@ int path_exists(const char *path);
 void set_opt_file(int update);
 int get_weight(struct lockspace *ls, int nodeid);
 void setup_lockspace_config(struct lockspace *ls);
+int get_fence_config(int nodeid, struct fence_config *fc);
+int setup_config_watch(void);
+void process_config_watch(int ci);
 
 /* cpg.c */
 void process_lockspace_changes(void);
+void kernel_ops_complete(struct lockspace *ls);
 void process_fencing_changes(void);
 int dlm_join_lockspace(struct lockspace *ls);
+void process_lockspace_joins(void);
+int joins_pending(void);
 int dlm_leave_lockspace(struct lockspace *ls);
 void update_flow_control_status(void);
 int set_node_info(struct lockspace *ls, int nodeid, struct dlmc_node *node);
@@ -327,6 +507,7 @@ int set_lockspaces(int *count, struct dlmc_lockspace **lss_out);
 int set_lockspace_nodes(struct lockspace *ls, int option, int *node_count,
 			struct dlmc_node **nodes_out);
 int set_fs_notified(struct lockspace *ls, int nodeid);
+int copy_recovery(char *name, char *buf, int *len_out);
 
 /* daemon_cpg.c */
 void init_daemon(void);
@@ -337,6 +518,9 @@ const char *msg_name(int type);
 void dlm_send_message(struct lockspace *ls, char *buf, int len);
 void dlm_header_in(struct dlm_header *hd);
 int dlm_header_validate(struct dlm_header *hd, int nodeid);
+void msg_stats_recv(struct msg_stats *stats, struct dlm_header *hd, int len,
+		    uint64_t start_usec);
+int copy_msg_stats(char *name, char *buf, int *len_out);
 int fence_node_time(int nodeid, uint64_t *last_fenced);
 int fence_in_progress(int *in_progress);
 int setup_cpg_daemon(void);
@@ -361,10 +545,11 @@ void log_ringid(const char *name,
                 size_t member_list_entries);
 
 /* deadlock.c */
-void setup_deadlock(void);
 void send_cycle_start(struct lockspace *ls);
-void receive_checkpoint_ready(struct lockspace *ls, struct dlm_header *hd,
-			int len);
+void receive_locks_data(struct lockspace *ls, struct dlm_header *hd, int len);
+void receive_locks_done(struct lockspace *ls, struct dlm_header *hd, int len);
+void receive_refresh(struct lockspace *ls, struct dlm_header *hd, int len);
+int deadlk_timewarn(struct lockspace *ls, char *name, int len);
 void receive_cycle_start(struct lockspace *ls, struct dlm_header *hd, int len);
 void receive_cycle_end(struct lockspace *ls, struct dlm_header *hd, int len);
 void receive_cancel_lock(struct lockspace *ls, struct dlm_header *hd, int len);
@@ -380,13 +565,21 @@ void deadlk_confchg(struct lockspace *ls,
 int do_read(int fd, void *buf, size_t count);
 int do_write(int fd, void *buf, size_t count);
 uint64_t monotime(void);
+uint64_t monotime_usec(void);
+int usec_hist_bucket(uint64_t usec);
 void client_dead(int ci);
-int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci));
+int client_add(int fd, int pri, void (*workfn)(int ci),
+	       void (*deadfn)(int ci));
 int client_fd(int ci);
 void client_ignore(int ci, int fd);
 void client_back(int ci, int fd);
+void ls_index_init(void);
+void ls_index_add(struct lockspace *ls, int key);
+void ls_index_del(struct lockspace *ls);
 struct lockspace *find_ls(char *name);
 struct lockspace *find_ls_id(uint32_t id);
+struct lockspace *find_ls_handle(cpg_handle_t h);
+struct lockspace *find_ls_ci(int ci);
 const char *dlm_mode_str(int mode);
 void cluster_dead(int ci);
 struct dlm_option *get_dlm_option(char *name);
@@ -396,6 +589,8 @@ int setup_cluster(void);
 void close_cluster(void);
 void process_cluster(int ci);
 void update_cluster(void);
+int node_slot(int nodeid);
+int node_slot_find(int nodeid);
 uint64_t cluster_add_time(int nodeid);
 int is_cluster_member(uint32_t nodeid);
 int setup_cluster_cfg(void);
@@ -410,6 +605,12 @@ int fence_request(int nodeid, uint64_t fail_walltime, uint64_t fail_monotime,
 int fence_result(int nodeid, int pid, int *result);
 int unfence_node(int nodeid);
 
+/* fence_exec.c */
+int setup_fence_exec(void);
+void close_fence_exec(void);
+int fence_exec_agent(char *agent, char *args, int *pid_out, int *out_fd);
+int fence_exec_waitpid(int pid, int *status);
+
 /* netlink.c */
 int setup_netlink(void);
 void process_netlink(int ci);
@@ -418,6 +619,7 @@ void process_netlink(int ci);
 int setup_plocks(void);
 void close_plocks(void);
 void process_plocks(int ci);
+void copy_plock_log(char *buf, int *len_out);
 void drop_resources_all(void);
 int limit_plocks(void);
 void receive_plock(struct lockspace *ls, struct dlm_header *hd, int len);
@@ -436,6 +638,8 @@ void clear_plocks_data(struct lockspace *ls);
 
 void init_logging(void);
 void close_logging(void);
+void setup_logging_thread(void);
+unsigned long long log_drops(void);
 void copy_log_dump(char *buf, int *len);
 void copy_log_dump_plock(char *buf, int *len);
 
@@ -8,12 +8,133 @@
 
 #include "dlm_daemon.h"
 
-static int run_agent(char *agent, char *args, int *pid_out)
+/* Agent stdout/stderr is read through a pipe and logged a line at a time.
+   For fence requests the pipe is a client in the main loop so output is
+   logged as the agent runs; unfence_node waits for the agent, so it reads
+   the pipe to EOF before waitpid. */
+
+#define AGENT_LINE_MAX 256
+
+struct agent_output {
+	struct list_head list;
+	int nodeid;
+	int pid;
+	int fd;
+	int ci;
+	int len;
+	char line[AGENT_LINE_MAX];
+};
+
+static LIST_HEAD(agent_outputs);
+
+static void agent_output_line(struct agent_output *ao)
+{
+	if (!ao->len)
+		return;
+	ao->line[ao->len] = '\0';
+	log_error("fence agent %d pid %d: %s", ao->nodeid, ao->pid, ao->line);
+	ao->len = 0;
+}
+
+/* returns 1 at EOF or error, 0 if there may be more to read later */
+
+static int read_agent_output(struct agent_output *ao)
+{
+	char buf[AGENT_LINE_MAX];
+	int rv, i;
+
+	while (1) {
+		rv = read(ao->fd, buf, sizeof(buf));
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0 && errno == EAGAIN)
+			return 0;
+		if (rv <= 0)
+			break;
+
+		for (i = 0; i < rv; i++) {
+			if (buf[i] == '\n') {
+				agent_output_line(ao);
+				continue;
+			}
+			ao->line[ao->len++] = buf[i];
+			if (ao->len == AGENT_LINE_MAX - 1)
+				agent_output_line(ao);
+		}
+	}
+
+	agent_output_line(ao);
+	return 1;
+}
+
+static struct agent_output *find_agent_output(int ci)
+{
+	struct agent_output *ao;
+
+	list_for_each_entry(ao, &agent_outputs, list) {
+		if (ao->ci == ci)
+			return ao;
+	}
+	return NULL;
+}
+
+static void agent_output_dead(int ci)
+{
+	struct agent_output *ao;
+
+	ao = find_agent_output(ci);
+	if (!ao)
+		return;
+
+	read_agent_output(ao);
+	client_dead(ci);
+	list_del(&ao->list);
+	free(ao);
+}
+
+static void process_agent_output(int ci)
+{
+	struct agent_output *ao;
+
+	ao = find_agent_output(ci);
+	if (!ao)
+		return;
+
+	if (read_agent_output(ao))
+		agent_output_dead(ci);
+}
+
+static void add_agent_output(int nodeid, int pid, int fd)
+{
+	struct agent_output *ao;
+
+	ao = malloc(sizeof(struct agent_output));
+	if (!ao) {
+		log_error("fence agent %d pid %d no mem for output", nodeid, pid);
+		close(fd);
+		return;
+	}
+	memset(ao, 0, sizeof(struct agent_output));
+	ao->nodeid = nodeid;
+	ao->pid = pid;
+	ao->fd = fd;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	ao->ci = client_add(fd, CLIENT_PRI_BULK, process_agent_output,
+			    agent_output_dead);
+	list_add_tail(&ao->list, &agent_outputs);
+}
+
+static int run_agent(char *agent, char *args, int *pid_out, int *out_fd)
 {
 	int pid, len;
 	int pw_fd = -1;  /* parent write file descriptor */
 	int cr_fd = -1;  /* child read file descriptor */
+	int pr_fd = -1;  /* parent read file descriptor, agent output */
+	int cw_fd = -1;  /* child write file descriptor, agent output */
 	int pfd[2];
+	int ofd[2];
 
 	len = strlen(args);
 
@@ -23,10 +144,21 @@ static int run_agent(char *agent, char *args, int *pid_out)
 	cr_fd = pfd[0];
 	pw_fd = pfd[1];
 
+	if (pipe2(ofd, O_CLOEXEC)) {
+		close(cr_fd);
+		close(pw_fd);
+		return -errno;
+	}
+
+	pr_fd = ofd[0];
+	cw_fd = ofd[1];
+
 	pid = fork();
 	if (pid < 0) {
 		close(cr_fd);
 		close(pw_fd);
+		close(pr_fd);
+		close(cw_fd);
 		return -errno;
 	}
 
@@ -34,6 +166,9 @@ static int run_agent(char *agent, char *args, int *pid_out)
 		/* parent */
 		int ret;
 
+		close(cw_fd);
+		cw_fd = -1;
+
 		do {
 			ret = write(pw_fd, args, len);
 		} while (ret < 0 && errno == EINTR);
@@ -45,19 +180,20 @@ static int run_agent(char *agent, char *args, int *pid_out)
 		close(pw_fd);
 
 		*pid_out = pid;
+		*out_fd = pr_fd;
 		return 0;
 	} else {
 		/* child */
-		int c_stdout, c_stderr;
+		sigset_t mask;
+
+		/* the daemon blocks SIGCHLD for its signalfd */
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
 
-		/* redirect agent stdout/stderr to /dev/null */
-		close(1);
-		c_stdout = open("/dev/null", O_WRONLY);
-		if (c_stdout < 0)
+		/* redirect agent stdout/stderr to parent */
+		if (dup2(cw_fd, 1) < 0)
 			goto fail;
-		close(2);
-		c_stderr = open("/dev/null", O_WRONLY);
-		if (c_stderr < 0)
+		if (dup2(cw_fd, 2) < 0)
 			goto fail;
 
 		/* redirect agent stdin from parent */
@@ -67,6 +203,8 @@ static int run_agent(char *agent, char *args, int *pid_out)
 
 		close(cr_fd);
 		close(pw_fd);
+		close(pr_fd);
+		close(cw_fd);
 
 		execlp(agent, agent, NULL);
 		exit(EXIT_FAILURE);
@@ -74,6 +212,9 @@ static int run_agent(char *agent, char *args, int *pid_out)
  fail:
 	close(cr_fd);
 	close(pw_fd);
+	close(pr_fd);
+	if (cw_fd >= 0)
+		close(cw_fd);
 	return -1;
 }
 
@@ -83,7 +224,7 @@ int fence_request(int nodeid, uint64_t fail_walltime, uint64_t fail_monotime,
 	struct fence_device *dev;
 	char args[FENCE_CONFIG_ARGS_MAX];
 	char extra[FENCE_CONFIG_NAME_MAX];
-	int rv, pid = -1;
+	int rv, pid = -1, out_fd = -1;
 
 	memset(args, 0, sizeof(args));
 
@@ -102,7 +243,9 @@ int fence_request(int nodeid, uint64_t fail_walltime, uint64_t fail_monotime,
 		return rv;
 	}
 
-	rv = run_agent(dev->agent, args, &pid);
+	rv = fence_exec_agent(dev->agent, args, &pid, &out_fd);
+	if (rv == -ENODEV)
+		rv = run_agent(dev->agent, args, &pid, &out_fd);
 	if (rv < 0) {
 		log_error("fence request %d pid %d %s time %llu %s %s run error %d",
 			  nodeid, pid, reason_str(reason), (unsigned long long)fail_walltime,
@@ -114,6 +257,8 @@ int fence_request(int nodeid, uint64_t fail_walltime, uint64_t fail_monotime,
 		  nodeid, pid, reason_str(reason), (unsigned long long)fail_walltime,
 		  dev->name, dev->agent);
 
+	add_agent_output(nodeid, pid, out_fd);
+
 	*pid_out = pid;
 	return 0;
 }
@@ -133,7 +278,9 @@ int fence_result(int nodeid, int pid, int *result)
 {
 	int status, rv;
 
-	rv = waitpid(pid, &status, WNOHANG);
+	rv = fence_exec_waitpid(pid, &status);
+	if (rv == -ENOENT)
+		rv = waitpid(pid, &status, WNOHANG);
 
 	if (rv < 0) {
 		/* shouldn't happen */
@@ -182,19 +329,20 @@ int unfence_node(int nodeid)
 	struct fence_device *dev;
 	char args[FENCE_CONFIG_ARGS_MAX];
 	char action[FENCE_CONFIG_NAME_MAX];
-	int rv, i, pid, status;
+	struct agent_output ao;
+	int rv, i, pid, status, out_fd;
 	int error = 0;
 
 	memset(&config, 0, sizeof(config));
 
-	rv = fence_config_init(&config, nodeid, (char *)CONF_FILE_PATH);
+	rv = get_fence_config(nodeid, &config);
 	if (rv == -ENOENT) {
 		/* file doesn't exist or doesn't contain config for nodeid */
 		return 0;
 	}
 	if (rv < 0) {
 		/* there's a problem with the config */
-		log_error("unfence %d fence_config_init error %d", nodeid, rv);
+		log_error("unfence %d fence config error %d", nodeid, rv);
 		return rv;
 	}
 
@@ -219,7 +367,7 @@ int unfence_node(int nodeid)
 			break;
 		}
 
-		rv = run_agent(dev->agent, args, &pid);
+		rv = run_agent(dev->agent, args, &pid, &out_fd);
 		if (rv < 0) {
 			log_error("unfence %d %s %s run error %d", nodeid,
 				  dev->name, dev->agent, rv);
@@ -230,6 +378,13 @@ int unfence_node(int nodeid)
 		log_error("unfence %d pid %d %s %s", nodeid, pid,
 			  dev->name, dev->agent);
 
+		memset(&ao, 0, sizeof(ao));
+		ao.nodeid = nodeid;
+		ao.pid = pid;
+		ao.fd = out_fd;
+		read_agent_output(&ao);
+		close(out_fd);
+
 		rv = waitpid(pid, &status, 0);
 		if (rv < 0) {
 			log_error("unfence %d pid %d waitpid errno %d",
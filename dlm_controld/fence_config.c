@@ -84,6 +84,14 @@ unfence foo
 Add unfence line to indicate nodes connected to the device
 should be unfenced.
 
+-
+
+device  foo fence_foo ipaddr=1.1.1.1 login=x password=y agent_timeout=60
+connect foo node=1 port=1
+
+An agent_timeout=<seconds> device arg is not passed to the agent.
+If the agent runs longer than this, it is killed and the device fails.
+
 #endif
 
 #define MAX_LINE (FENCE_CONFIG_ARGS_MAX + (3 * FENCE_CONFIG_NAME_MAX))
@@ -102,6 +110,33 @@ static unsigned int con_args_nodeid(char *args)
 	return v;
 }
 
+/* "agent_timeout=<seconds>" in the device args is used by dlm_controld
+   to kill an agent that runs too long, and is removed from the args
+   passed to the agent. */
+
+static int take_agent_timeout(char *args)
+{
+	char *k, *end;
+	int timeout = 0;
+
+	k = strstr(args, "agent_timeout=");
+	if (!k)
+		return 0;
+
+	sscanf(k, "agent_timeout=%d", &timeout);
+
+	end = strchr(k, ' ');
+	if (end) {
+		memmove(k, end + 1, strlen(end + 1) + 1);
+	} else {
+		*k = '\0';
+		while (k > args && *(k - 1) == ' ')
+			*--k = '\0';
+	}
+
+	return timeout > 0 ? timeout : 0;
+}
+
 static int read_config_section(unsigned int nodeid, FILE *file, char *dev_line,
 			       struct fence_device **dev_out,
 			       struct fence_connect **con_out)
@@ -183,6 +218,7 @@ static int read_config_section(unsigned int nodeid, FILE *file, char *dev_line,
 		strncpy(dev->name, dev_name, FENCE_CONFIG_NAME_MAX-1);
 		strncpy(dev->agent, agent, FENCE_CONFIG_NAME_MAX-1);
 		strncpy(dev->args, dev_args, FENCE_CONFIG_ARGS_MAX-1);
+		dev->timeout = take_agent_timeout(dev->args);
 		strncpy(con->name, con_name, FENCE_CONFIG_NAME_MAX-1);
 		strncpy(con->args, con_args, FENCE_CONFIG_ARGS_MAX-1);
 		dev->unfence = unfence;
@@ -258,6 +294,7 @@ int fence_config_init(struct fence_config *fc, unsigned int nodeid, char *path)
 				rv = -EINVAL;
 				goto out;
 			}
+			dev->timeout = take_agent_timeout(dev->args);
 
 			if (fgets(line, MAX_LINE, file) &&
 			    !strncmp(line, "unfence_all", strlen("unfence_all")))
@@ -379,7 +416,7 @@ int fence_config_next_priority(struct fence_config *fc)
 		if (same_base_name(prev, next))
 			continue;
 
-		fc->pos = d+1;
+		fc->pos = i;
 		return 0;
 	}
 	return -1;
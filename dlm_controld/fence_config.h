@@ -18,6 +18,7 @@ struct fence_device {
 	char agent[FENCE_CONFIG_NAME_MAX];
 	char args[FENCE_CONFIG_ARGS_MAX];
 	int unfence;
+	int timeout;	/* seconds, from agent_timeout= in args, 0 none */
 };
 
 struct fence_connect {
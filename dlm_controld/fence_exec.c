@@ -0,0 +1,637 @@
+/*
+ * Copyright 2004-2012 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#include "dlm_daemon.h"
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+
+/*
+ * fence executor (fence_executor=1)
+ *
+ * A small helper process is forked from dlm_controld at startup, before
+ * the daemon has started threads or grown, and fence agents are started
+ * by the helper rather than by forking dlm_controld itself.  The helper
+ * keeps one child pre-forked and waiting for a job, so running an agent
+ * is just an exec in that child.  When a job is taken, the helper forks
+ * the next standby child.
+ *
+ * The daemon and helper use a SOCK_SEQPACKET socketpair:
+ *
+ * daemon -> helper  FX_RUN      agent, args, pipe fd for agent output
+ * helper -> daemon  FX_STARTED  job id, pid of the agent (or -errno)
+ * helper -> daemon  FX_EXITED   pid, wait status of the agent
+ *
+ * The daemon waits for FX_STARTED so fence_request can return the agent
+ * pid as before.  FX_EXITED is read in the main loop and saved for
+ * fence_result, which gets the status from here instead of waitpid.
+ * If the helper goes away, agents are run directly by the daemon again.
+ */
+
+#define FX_RUN		1
+#define FX_STARTED	2
+#define FX_EXITED	3
+
+#define FX_REPLY_TIMEOUT_MS 5000
+
+struct fx_msg {
+	int type;
+	int id;
+	int pid;
+	int status;
+	char agent[FENCE_CONFIG_NAME_MAX];
+	char args[FENCE_CONFIG_ARGS_MAX];
+};
+
+struct fx_job {
+	struct list_head list;
+	int pid;
+	int done;
+	int status;
+};
+
+static LIST_HEAD(fx_jobs);
+static int fx_fd = -1;
+static int fx_ci = -1;
+static int fx_pid;
+static int fx_next_id;
+
+static int fx_send(int fd, struct fx_msg *msg, int pass_fd)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int rv;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(struct fx_msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (pass_fd >= 0) {
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+
+	do {
+		rv = sendmsg(fd, &mh, MSG_NOSIGNAL);
+	} while (rv < 0 && errno == EINTR);
+
+	if (rv < 0)
+		return -errno;
+	if (rv != sizeof(struct fx_msg))
+		return -EIO;
+	return 0;
+}
+
+/* returns 0 at EOF, -errno on error, else the message size */
+
+static int fx_recv(int fd, struct fx_msg *msg, int flags, int *pass_fd)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int rv;
+
+	if (pass_fd)
+		*pass_fd = -1;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(struct fx_msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	do {
+		rv = recvmsg(fd, &mh, flags | MSG_CMSG_CLOEXEC);
+	} while (rv < 0 && errno == EINTR);
+
+	if (rv < 0)
+		return -errno;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		if (pass_fd)
+			memcpy(pass_fd, CMSG_DATA(cmsg), sizeof(int));
+		else {
+			int unused;
+			memcpy(&unused, CMSG_DATA(cmsg), sizeof(int));
+			close(unused);
+		}
+	}
+
+	if (rv && rv != sizeof(struct fx_msg))
+		return -EIO;
+	return rv;
+}
+
+/*
+ * helper process
+ *
+ * Nothing here can use the daemon's logging, the helper is a separate
+ * process.  Errors go back to the daemon in FX_STARTED.
+ */
+
+/* standby child: wait for a job from the helper, then exec the agent */
+
+static void fx_standby(int sock)
+{
+	struct fx_msg msg;
+	sigset_t mask;
+	int pfd[2];
+	int out_fd, rv, len;
+
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	rv = fx_recv(sock, &msg, 0, &out_fd);
+	if (rv <= 0 || out_fd < 0)
+		exit(EXIT_FAILURE);
+	close(sock);
+
+	msg.agent[FENCE_CONFIG_NAME_MAX - 1] = '\0';
+	msg.args[FENCE_CONFIG_ARGS_MAX - 1] = '\0';
+	len = strlen(msg.args);
+
+	/* the args fit in the pipe, so they can be written before exec */
+
+	if (pipe(pfd))
+		exit(EXIT_FAILURE);
+
+	if (write(pfd[1], msg.args, len) != len)
+		exit(EXIT_FAILURE);
+	close(pfd[1]);
+
+	if (dup2(pfd[0], 0) < 0)
+		exit(EXIT_FAILURE);
+	if (dup2(out_fd, 1) < 0)
+		exit(EXIT_FAILURE);
+	if (dup2(out_fd, 2) < 0)
+		exit(EXIT_FAILURE);
+	close(pfd[0]);
+	close(out_fd);
+
+	execlp(msg.agent, msg.agent, NULL);
+	exit(EXIT_FAILURE);
+}
+
+/* returns the pid of the standby child, and its socket in sock_out */
+
+static int fx_fork_standby(int helper_fd, int sig_fd, int *sock_out)
+{
+	int sv[2];
+	int pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+		return -errno;
+
+	pid = fork();
+	if (pid < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return -errno;
+	}
+
+	if (!pid) {
+		close(sv[0]);
+		close(helper_fd);
+		close(sig_fd);
+		fx_standby(sv[1]);
+	}
+
+	close(sv[1]);
+	*sock_out = sv[0];
+	return pid;
+}
+
+/* don't keep the daemon's fds (cluster connections, etc) open */
+
+static void fx_close_fds(int keep_fd)
+{
+	struct dirent *de;
+	DIR *d;
+	int fd;
+
+	d = opendir("/proc/self/fd");
+	if (!d)
+		return;
+
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		fd = atoi(de->d_name);
+		if (fd > 2 && fd != keep_fd && fd != dirfd(d))
+			close(fd);
+	}
+	closedir(d);
+}
+
+static void fx_helper(int fd)
+{
+	struct signalfd_siginfo si;
+	struct pollfd pollfd[2];
+	struct fx_msg msg;
+	sigset_t mask;
+	int standby_pid, standby_sock = -1;
+	int sig_fd, out_fd, status, pid, rv;
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+	fx_close_fds(fd);
+
+	/* SIGCHLD is already blocked, inherited from the daemon */
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	sig_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (sig_fd < 0)
+		exit(EXIT_FAILURE);
+
+	standby_pid = fx_fork_standby(fd, sig_fd, &standby_sock);
+
+	pollfd[0].fd = fd;
+	pollfd[0].events = POLLIN;
+	pollfd[1].fd = sig_fd;
+	pollfd[1].events = POLLIN;
+
+	while (1) {
+		rv = poll(pollfd, 2, -1);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0)
+			exit(EXIT_FAILURE);
+
+		if (pollfd[1].revents & POLLIN) {
+			while (read(sig_fd, &si, sizeof(si)) == sizeof(si))
+				;
+
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				if (pid == standby_pid) {
+					/* shouldn't happen, replace it */
+					close(standby_sock);
+					standby_pid = fx_fork_standby(fd, sig_fd,
+								      &standby_sock);
+					continue;
+				}
+
+				memset(&msg, 0, sizeof(msg));
+				msg.type = FX_EXITED;
+				msg.pid = pid;
+				msg.status = status;
+				fx_send(fd, &msg, -1);
+			}
+		}
+
+		if (pollfd[0].revents & POLLIN) {
+			rv = fx_recv(fd, &msg, 0, &out_fd);
+			if (!rv)
+				exit(EXIT_SUCCESS);
+			if (rv < 0)
+				continue;
+
+			if (msg.type != FX_RUN || out_fd < 0) {
+				if (out_fd >= 0)
+					close(out_fd);
+				continue;
+			}
+
+			if (standby_pid < 0) {
+				/* a previous fork failed, try again */
+				standby_pid = fx_fork_standby(fd, sig_fd,
+							      &standby_sock);
+			}
+
+			pid = standby_pid;
+			if (pid > 0) {
+				rv = fx_send(standby_sock, &msg, out_fd);
+				close(standby_sock);
+				standby_sock = -1;
+				standby_pid = -1;
+				if (rv < 0) {
+					kill(pid, SIGKILL);
+					pid = rv;
+				}
+			}
+
+			/* closed before the next fork so the agent holds
+			   the only write end, and the daemon sees EOF */
+			close(out_fd);
+
+			msg.type = FX_STARTED;
+			msg.pid = pid;
+			msg.status = 0;
+			msg.agent[0] = '\0';
+			msg.args[0] = '\0';
+			fx_send(fd, &msg, -1);
+
+			standby_pid = fx_fork_standby(fd, sig_fd, &standby_sock);
+		} else if (pollfd[0].revents & (POLLHUP | POLLERR)) {
+			exit(EXIT_SUCCESS);
+		}
+	}
+}
+
+/*
+ * daemon side
+ */
+
+static struct fx_job *find_fx_job(int pid)
+{
+	struct fx_job *job;
+
+	list_for_each_entry(job, &fx_jobs, list) {
+		if (job->pid == pid)
+			return job;
+	}
+	return NULL;
+}
+
+static void fx_exited(struct fx_msg *msg)
+{
+	struct fx_job *job;
+
+	job = find_fx_job(msg->pid);
+	if (!job) {
+		log_debug("fence_exec exited pid %d unknown", msg->pid);
+		return;
+	}
+
+	job->done = 1;
+	job->status = msg->status;
+
+	/* what SIGCHLD does for agents run by the daemon */
+	poll_fencing++;
+}
+
+static void fx_lost(void)
+{
+	struct fx_job *job;
+
+	if (fx_fd < 0)
+		return;
+
+	log_error("fence_exec helper %d gone, running agents directly", fx_pid);
+
+	/* results from running agents are lost, count them as failed */
+	list_for_each_entry(job, &fx_jobs, list) {
+		if (job->done)
+			continue;
+		kill(job->pid, SIGKILL);
+		job->done = 1;
+		job->status = SIGKILL;	/* wait status for killed by SIGKILL */
+	}
+	poll_fencing++;
+
+	if (fx_ci >= 0)
+		client_dead(fx_ci);
+	else
+		close(fx_fd);
+	fx_fd = -1;
+	fx_ci = -1;
+
+	kill(fx_pid, SIGKILL);
+	waitpid(fx_pid, NULL, 0);
+}
+
+/* read everything the helper has sent, returns -1 if it's gone */
+
+static int fx_read_all(void)
+{
+	struct fx_msg msg;
+	int rv;
+
+	while (fx_fd >= 0) {
+		rv = fx_recv(fx_fd, &msg, MSG_DONTWAIT, NULL);
+		if (rv == -EAGAIN)
+			return 0;
+		if (rv <= 0) {
+			fx_lost();
+			return -1;
+		}
+
+		if (msg.type == FX_EXITED)
+			fx_exited(&msg);
+		else
+			log_debug("fence_exec unexpected msg %d", msg.type);
+	}
+	return -1;
+}
+
+static void process_fence_exec(int ci)
+{
+	fx_read_all();
+}
+
+static void fence_exec_dead(int ci)
+{
+	fx_read_all();
+	fx_lost();
+}
+
+/*
+ * Same as run_agent, returns -ENODEV if the helper isn't being used so
+ * the caller runs the agent itself.
+ */
+
+int fence_exec_agent(char *agent, char *args, int *pid_out, int *out_fd)
+{
+	struct fx_job *job;
+	struct fx_msg *msg;
+	struct pollfd pollfd;
+	uint64_t start;
+	int ofd[2];
+	int id, rv, wait_ms;
+
+	if (fx_fd < 0)
+		return -ENODEV;
+
+	msg = malloc(sizeof(struct fx_msg));
+	job = malloc(sizeof(struct fx_job));
+	if (!msg || !job) {
+		rv = -ENOMEM;
+		goto out;
+	}
+	memset(msg, 0, sizeof(struct fx_msg));
+	memset(job, 0, sizeof(struct fx_job));
+
+	if (pipe2(ofd, O_CLOEXEC)) {
+		rv = -errno;
+		goto out;
+	}
+
+	id = ++fx_next_id;
+	msg->type = FX_RUN;
+	msg->id = id;
+	strncpy(msg->agent, agent, FENCE_CONFIG_NAME_MAX - 1);
+	strncpy(msg->args, args, FENCE_CONFIG_ARGS_MAX - 1);
+
+	rv = fx_send(fx_fd, msg, ofd[1]);
+	close(ofd[1]);
+	if (rv < 0) {
+		close(ofd[0]);
+		fx_lost();
+		rv = -ENODEV;
+		goto out;
+	}
+
+	/* wait for the helper to say the agent is started */
+
+	start = monotime_usec();
+
+	while (1) {
+		wait_ms = FX_REPLY_TIMEOUT_MS - (monotime_usec() - start) / 1000;
+		if (wait_ms <= 0) {
+			log_error("fence_exec helper %d no reply", fx_pid);
+			close(ofd[0]);
+			kill(fx_pid, SIGKILL);
+			fx_lost();
+			rv = -ENODEV;
+			goto out;
+		}
+
+		pollfd.fd = fx_fd;
+		pollfd.events = POLLIN;
+		pollfd.revents = 0;
+
+		rv = poll(&pollfd, 1, wait_ms);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			continue;
+
+		rv = fx_recv(fx_fd, msg, MSG_DONTWAIT, NULL);
+		if (rv == -EAGAIN)
+			continue;
+		if (rv <= 0) {
+			close(ofd[0]);
+			fx_lost();
+			rv = -ENODEV;
+			goto out;
+		}
+
+		if (msg->type == FX_EXITED) {
+			fx_exited(msg);
+			continue;
+		}
+
+		if (msg->type == FX_STARTED && msg->id == id)
+			break;
+	}
+
+	if (msg->pid < 0) {
+		log_error("fence_exec helper %d start error %d", fx_pid, msg->pid);
+		close(ofd[0]);
+		rv = msg->pid;
+		goto out;
+	}
+
+	job->pid = msg->pid;
+	list_add_tail(&job->list, &fx_jobs);
+	job = NULL;
+
+	*pid_out = msg->pid;
+	*out_fd = ofd[0];
+	rv = 0;
+ out:
+	free(msg);
+	free(job);
+	return rv;
+}
+
+/*
+ * Like waitpid(pid, &status, WNOHANG) for an agent started by the helper.
+ * Returns -ENOENT if pid was not started by the helper, 0 if pid is still
+ * running, or pid with status set once it has exited.
+ */
+
+int fence_exec_waitpid(int pid, int *status)
+{
+	struct fx_job *job;
+
+	job = find_fx_job(pid);
+	if (!job)
+		return -ENOENT;
+
+	if (!job->done)
+		fx_read_all();
+
+	if (!job->done)
+		return 0;
+
+	*status = job->status;
+	list_del(&job->list);
+	free(job);
+	return pid;
+}
+
+int setup_fence_exec(void)
+{
+	int sv[2];
+	int pid;
+
+	if (!opt(fence_executor_ind))
+		return 0;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+		log_error("fence_exec socketpair error %d", errno);
+		return 0;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		log_error("fence_exec fork error %d", errno);
+		close(sv[0]);
+		close(sv[1]);
+		return 0;
+	}
+
+	if (!pid) {
+		close(sv[0]);
+		fx_helper(sv[1]);
+		exit(EXIT_SUCCESS);
+	}
+
+	close(sv[1]);
+	fx_fd = sv[0];
+	fx_pid = pid;
+
+	log_debug("fence_exec helper %d", pid);
+
+	fx_ci = client_add(fx_fd, CLIENT_PRI_HIGH, process_fence_exec,
+			   fence_exec_dead);
+	return 0;
+}
+
+void close_fence_exec(void)
+{
+	if (fx_fd < 0)
+		return;
+
+	if (fx_ci >= 0)
+		client_dead(fx_ci);
+	else
+		close(fx_fd);
+	fx_fd = -1;
+	fx_ci = -1;
+
+	waitpid(fx_pid, NULL, 0);
+}
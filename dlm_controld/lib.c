@@ -158,6 +158,16 @@ int dlmc_dump_plocks(char *name, char *buf)
 	return do_dump(DLMC_CMD_DUMP_PLOCKS, name, buf);
 }
 
+int dlmc_dump_msg_stats(char *name, char *buf)
+{
+	return do_dump(DLMC_CMD_DUMP_MSG_STATS, name, buf);
+}
+
+int dlmc_dump_recovery(char *name, char *buf)
+{
+	return do_dump(DLMC_CMD_DUMP_RECOVERY, name, buf);
+}
+
 static int nodeid_compare(const void *va, const void *vb)
 {
 	const int *a = va;
@@ -275,9 +285,24 @@ static void format_daemon_node(struct dlmc_state *st, char *str, char *bin, uint
 			       char *node_line, char *fence_line)
 {
 	unsigned int delay_fencing, result_wait, killed;
+	unsigned int wait_ms, agent_ms, result_ms, timeouts;
+	char latency[64];
+
+	/* how long our last fencing of this node took, if we did it */
+
+	wait_ms = kv(str, "fence_wait_ms");
+	agent_ms = kv(str, "fence_agent_ms");
+	result_ms = kv(str, "fence_result_ms");
+	timeouts = kv(str, "fence_timeouts");
+
+	memset(latency, 0, sizeof(latency));
+	if (wait_ms || agent_ms || result_ms || timeouts)
+		snprintf(latency, sizeof(latency) - 1,
+			 " ms wait %u agent %u result %u timeouts %u",
+			 wait_ms, agent_ms, result_ms, timeouts);
 
 	snprintf(node_line, DLMC_STATE_MAXSTR - 1,
-		"node %d %c add %u rem %u fail %u fence %u at %u %u\n",
+		"node %d %c add %u rem %u fail %u fence %u at %u %u%s\n",
 		st->nodeid,
 		kv(str, "member") ? 'M' : 'X',
 		kv(str, "add_time"),
@@ -285,7 +310,8 @@ static void format_daemon_node(struct dlmc_state *st, char *str, char *bin, uint
 		kv(str, "fail_monotime"),
 		kv(str, "fence_monotime"),
 		kv(str, "actor_done"),
-		kv(str, "fence_walltime"));
+		kv(str, "fence_walltime"),
+		latency);
 
 	if (!kv(str, "need_fencing"))
 		return;
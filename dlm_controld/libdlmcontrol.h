@@ -31,6 +31,7 @@ struct dlmc_node {
 #define DLMC_LS_WAIT_QUORUM	2
 #define DLMC_LS_WAIT_FENCING	3
 #define DLMC_LS_WAIT_FSDONE	4
+#define DLMC_LS_WAIT_KERNEL	5
 
 struct dlmc_change {
 	int member_count;
@@ -84,6 +85,8 @@ int dlmc_dump_debug(char *buf);
 int dlmc_dump_config(char *buf);
 int dlmc_dump_log_plock(char *buf);
 int dlmc_dump_plocks(char *name, char *buf);
+int dlmc_dump_msg_stats(char *name, char *buf);
+int dlmc_dump_recovery(char *name, char *buf);
 int dlmc_lockspace_info(char *lsname, struct dlmc_lockspace *ls);
 int dlmc_node_info(char *lsname, int nodeid, struct dlmc_node *node);
 int dlmc_lockspaces(int max, int *count, struct dlmc_lockspace *lss);
@@ -104,5 +107,132 @@ int dlmc_fs_result(int fd, char *name, int *type, int *nodeid, int *result);
 int dlmc_deadlock_check(char *name);
 int dlmc_fence_ack(char *name);
 
+/*
+ * Reading the dlm debugfs files (/sys/kernel/debug/dlm/<ls><suffix>)
+ * without allocating or copying.  The caller provides the buffer that
+ * file data is read into with large reads; it must be larger than the
+ * longest line (DLMC_DEBUGFS_BUF is plenty).  dlmc_debugfs_line() returns
+ * each line in turn, nul terminated in place of the newline, valid until
+ * the next call.  The parse functions fill in the fields of one line and
+ * return the number parsed, like sscanf; names point into the line and
+ * are not nul terminated.
+ */
+
+#define DLMC_DEBUGFS_BUF	(1024 * 1024)
+
+struct dlmc_debugfs {
+	int fd;
+	int eof;
+	char *buf;
+	int size;
+	int start;		/* next line in buf */
+	int end;		/* end of data in buf */
+	uint64_t lines;
+};
+
+/* <ls>_locks */
+
+#define DLMC_LOCK_FIELDS	13
+
+struct dlmc_debugfs_lock {
+	uint32_t id;
+	int nodeid;
+	uint32_t remid;
+	int ownpid;
+	uint64_t xid;
+	uint32_t exflags;
+	uint32_t flags;
+	int8_t status;
+	int8_t grmode;
+	int8_t rqmode;
+	uint64_t wait_time;
+	int r_nodeid;
+	int r_len;
+	char *r_name;		/* between the quotes, r_name_len bytes */
+	int r_name_len;
+};
+
+/* "rsb" lines of <ls>_all and <ls>_toss */
+
+#define DLMC_RSB_FIELDS		10
+
+struct dlmc_debugfs_rsb {
+	char *addr;
+	int addr_len;
+	int nodeid;
+	char *first_lkid;
+	int first_lkid_len;
+	uint32_t flags;
+	int root_list;
+	int recover_list;
+	int recover_locks_count;
+	int namelen;
+	int hex;		/* name is printed in hex */
+	char *name;		/* rest of the line, name_len bytes */
+	int name_len;
+};
+
+#define DLMC_TOSS_FIELDS	10
+
+struct dlmc_debugfs_toss {
+	char *addr;
+	int addr_len;
+	int res_nodeid;
+	int master_nodeid;
+	int dir_nodeid;
+	int our_nodeid;
+	uint64_t toss_time;
+	uint32_t flags;
+	int namelen;
+	int hex;
+	char *name;
+	int name_len;
+};
+
+/* "lkb" lines of <ls>_all */
+
+#define DLMC_LKB_FIELDS		17
+
+struct dlmc_debugfs_lkb {
+	uint32_t id;
+	int nodeid;
+	uint32_t remid;
+	int ownpid;
+	uint64_t xid;
+	uint32_t exflags;
+	uint32_t flags;
+	int status;
+	int grmode;
+	int rqmode;
+	int highbast;
+	int rsb_lookup;
+	int wait_type;
+	uint32_t lvbseq;
+	uint64_t timestamp;
+	uint64_t time_bast;
+};
+
+/* <ls>_waiters */
+
+#define DLMC_WAITER_FIELDS	4
+
+struct dlmc_debugfs_waiter {
+	uint32_t id;
+	int wait_type;
+	int nodeid;
+	char *name;		/* rest of the line */
+	int name_len;
+};
+
+int dlmc_debugfs_open(struct dlmc_debugfs *df, const char *lsname,
+		      const char *suffix, char *buf, int size);
+void dlmc_debugfs_close(struct dlmc_debugfs *df);
+char *dlmc_debugfs_line(struct dlmc_debugfs *df, int *len);
+int dlmc_parse_lock(char *line, int len, struct dlmc_debugfs_lock *lk);
+int dlmc_parse_rsb(char *line, int len, struct dlmc_debugfs_rsb *r);
+int dlmc_parse_toss(char *line, int len, struct dlmc_debugfs_toss *t);
+int dlmc_parse_lkb(char *line, int len, struct dlmc_debugfs_lkb *lkb);
+int dlmc_parse_waiter(char *line, int len, struct dlmc_debugfs_waiter *w);
+
 #endif
 
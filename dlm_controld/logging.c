@@ -7,15 +7,70 @@
  */
 
 #include "dlm_daemon.h"
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/*
+ * log_level() formats each message in the caller's own buffer, copies it
+ * to the dump buffers, and puts it in log_ring for the log writer thread,
+ * which does the syslog and logfile output.  Any thread can log.
+ *
+ * log_ring is a bounded multi-producer, single-consumer queue.  Each slot
+ * has a sequence number: a producer claims a position with a CAS on
+ * log_head and fills the slot, then sets seq to mark it ready; the writer
+ * reads it and sets seq to free it for the next lap.  If the ring is
+ * full the message is counted in log_dropped rather than waiting for the
+ * writer.  The writer sleeps on log_efd when the ring is empty, and
+ * producers only write log_efd when log_writer_sleeping is set.  A full
+ * fence after the producer's seq store and after the writer's sleeping
+ * store means at least one of them sees the other's store, so a message
+ * can't be left in the ring with the writer asleep.
+ *
+ * The writer takes all ready messages at once, and writes their logfile
+ * lines with a single write().
+ *
+ * Before the writer is started, or if it fails to start, messages are
+ * written directly by the caller.
+ */
+
+#define LOG_RING_SLOTS 1024	/* power of 2 */
+#define LOG_BATCH_SIZE (64 * 1024)
 
 static int syslog_facility;
 static int syslog_priority;
 static int logfile_priority;
 static char logfile[PATH_MAX];
-static FILE *logfile_fp;
+static int logfile_fd = -1;
+
+#define NAME_ID_SIZE 32
+#define LOG_STR_LEN 512
+
+struct log_slot {
+	uint32_t seq;
+	uint32_t level;		/* level_in from log_level */
+	time_t walltime;
+	int len;		/* not including the terminating 0 */
+	char str[LOG_STR_LEN];
+};
+
+static struct log_slot log_ring[LOG_RING_SLOTS];
+static uint32_t log_head;	/* next position for producers */
+static uint32_t log_tail;	/* next position for the writer */
+static uint64_t log_dropped;
+static int log_writer_sleeping;
+static int log_writer_quit;
+static int log_writer_running;
+static int log_efd = -1;
+static pthread_t log_thread;
+static pthread_mutex_t log_direct_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* protects the dump buffers, which are copied from by the query thread */
+static pthread_mutex_t log_dump_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void init_logging(void)
 {
+	int i;
+
 	syslog_facility = DEFAULT_SYSLOG_FACILITY;
 	syslog_priority = DEFAULT_SYSLOG_PRIORITY;
 	logfile_priority = DEFAULT_LOGFILE_PRIORITY;
@@ -27,28 +82,15 @@ void init_logging(void)
 	if (opt(debug_logfile_ind))
 		logfile_priority = LOG_DEBUG;
 
-	if (logfile[0]) {
-		logfile_fp = fopen(logfile, "a+");
-		if (logfile_fp != NULL) {
-			int fd = fileno(logfile_fp);
-			fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
-		}
-	}
+	if (logfile[0])
+		logfile_fd = open(logfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
 
 	openlog(DAEMON_NAME, LOG_CONS | LOG_PID, syslog_facility);
-}
 
-void close_logging(void)
-{
-	closelog();
-	if (logfile_fp)
-		fclose(logfile_fp);
+	for (i = 0; i < LOG_RING_SLOTS; i++)
+		log_ring[i].seq = i;
 }
 
-#define NAME_ID_SIZE 32
-#define LOG_STR_LEN 512
-static char log_str[LOG_STR_LEN];
-
 static char log_dump[LOG_DUMP_SIZE];
 static unsigned int log_point;
 static unsigned int log_wrap;
@@ -80,16 +122,25 @@ static void log_copy(char *buf, int *len, char *log_buf,
 
 void copy_log_dump(char *buf, int *len)
 {
+	pthread_mutex_lock(&log_dump_mutex);
 	log_copy(buf, len, log_dump, &log_point, &log_wrap);
+	pthread_mutex_unlock(&log_dump_mutex);
 }
 
 void copy_log_dump_plock(char *buf, int *len)
 {
+	pthread_mutex_lock(&log_dump_mutex);
 	log_copy(buf, len, log_dump_plock, &log_point_plock, &log_wrap_plock);
+	pthread_mutex_unlock(&log_dump_mutex);
 }
 
-static void log_save_str(int len, char *log_buf, unsigned int *point,
-			 unsigned int *wrap)
+unsigned long long log_drops(void)
+{
+	return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
+
+static void log_save_str(char *log_str, int len, char *log_buf,
+			 unsigned int *point, unsigned int *wrap)
 {
 	unsigned int p = *point;
 	unsigned int w = *wrap;
@@ -119,10 +170,256 @@ static void log_save_str(int len, char *log_buf, unsigned int *point,
 	*wrap = w;
 }
 
+/* append one logfile line to buf, returns the new length */
+
+static int log_file_line(char *buf, int pos, time_t walltime, char *str, int len)
+{
+	static time_t last_time;
+	static char tbuf[64];
+	static int tlen;
+
+	/* strftime once per second, not for every line */
+	if (walltime != last_time || !tlen) {
+		struct tm tm;
+		localtime_r(&walltime, &tm);
+		tlen = strftime(tbuf, sizeof(tbuf), "%b %d %T ", &tm);
+		last_time = walltime;
+	}
+
+	memcpy(buf + pos, tbuf, tlen);
+	memcpy(buf + pos + tlen, str, len);
+	return pos + tlen + len;
+}
+
+static void log_write_all(int fd, char *buf, int len)
+{
+	int rv, done = 0;
+
+	while (done < len) {
+		rv = write(fd, buf + done, len - done);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			break;
+		done += rv;
+	}
+}
+
+/* the output that used to be done in log_level */
+
+static void log_output(struct log_slot *sl, char *buf, int *pos)
+{
+	uint32_t level = sl->level & 0x0000FFFF;
+	int plock = sl->level & LOG_PLOCK;
+
+	if (level <= syslog_priority)
+		syslog(level, "%s", sl->str);
+
+	if (level <= logfile_priority && logfile_fd >= 0) {
+		if (*pos + 64 + sl->len > LOG_BATCH_SIZE) {
+			log_write_all(logfile_fd, buf, *pos);
+			*pos = 0;
+		}
+		*pos = log_file_line(buf, *pos, sl->walltime, sl->str, sl->len);
+	}
+
+	if (!dlm_options[daemon_debug_ind].use_int)
+		return;
+
+	if ((level < LOG_NONE) || (plock && opt(plock_debug_ind)))
+		fprintf(stderr, "%s", sl->str);
+}
+
+static void log_direct(struct log_slot *sl)
+{
+	char buf[LOG_STR_LEN + 64];
+	int pos = 0;
+
+	pthread_mutex_lock(&log_direct_mutex);
+	log_output(sl, buf, &pos);
+	if (pos)
+		log_write_all(logfile_fd, buf, pos);
+	pthread_mutex_unlock(&log_direct_mutex);
+}
+
+static void log_report_dropped(char *buf, int *pos)
+{
+	static uint64_t reported;
+	struct log_slot sl;
+	uint64_t dropped;
+
+	dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+	if (dropped == reported)
+		return;
+
+	memset(&sl, 0, sizeof(sl));
+	sl.level = LOG_ERR;
+	sl.walltime = time(NULL);
+	sl.len = snprintf(sl.str, LOG_STR_LEN, "%llu log dropped %llu messages\n",
+			  (unsigned long long)monotime(),
+			  (unsigned long long)(dropped - reported));
+	log_output(&sl, buf, pos);
+	reported = dropped;
+}
+
+/* write out all ready messages, returns the number written */
+
+static int log_drain(char *buf)
+{
+	struct log_slot *sl;
+	int pos = 0, count = 0;
+
+	while (1) {
+		sl = &log_ring[log_tail & (LOG_RING_SLOTS - 1)];
+
+		if (__atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+			break;
+
+		log_output(sl, buf, &pos);
+
+		__atomic_store_n(&sl->seq, log_tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+		log_tail++;
+		count++;
+	}
+
+	log_report_dropped(buf, &pos);
+
+	if (pos)
+		log_write_all(logfile_fd, buf, pos);
+
+	if (count && dlm_options[daemon_debug_ind].use_int)
+		fflush(stderr);
+
+	return count;
+}
+
+static void *log_writer(void *arg)
+{
+	static char batch[LOG_BATCH_SIZE];
+	uint64_t val;
+	int rv;
+
+	while (1) {
+		if (log_drain(batch))
+			continue;
+
+		if (__atomic_load_n(&log_writer_quit, __ATOMIC_SEQ_CST))
+			break;
+
+		/* recheck after setting sleeping, see log_queue */
+		__atomic_store_n(&log_writer_sleeping, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (!log_drain(batch)) {
+			do {
+				rv = read(log_efd, &val, sizeof(val));
+			} while (rv < 0 && errno == EINTR);
+		}
+
+		__atomic_store_n(&log_writer_sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+
+	log_drain(batch);
+	return NULL;
+}
+
+void setup_logging_thread(void)
+{
+	sigset_t mask, old;
+	int rv;
+
+	log_efd = eventfd(0, EFD_CLOEXEC);
+	if (log_efd < 0)
+		return;
+
+	/* signals are for the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	rv = pthread_create(&log_thread, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (rv) {
+		close(log_efd);
+		log_efd = -1;
+		return;
+	}
+
+	__atomic_store_n(&log_writer_running, 1, __ATOMIC_SEQ_CST);
+}
+
+void close_logging(void)
+{
+	uint64_t val = 1;
+
+	if (__atomic_load_n(&log_writer_running, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&log_writer_quit, 1, __ATOMIC_SEQ_CST);
+		if (write(log_efd, &val, sizeof(val)) < 0) {
+			/* the writer will see quit after its next wakeup */
+		}
+		pthread_join(log_thread, NULL);
+		__atomic_store_n(&log_writer_running, 0, __ATOMIC_SEQ_CST);
+		close(log_efd);
+		log_efd = -1;
+	}
+
+	closelog();
+	if (logfile_fd >= 0)
+		close(logfile_fd);
+	logfile_fd = -1;
+}
+
+/* returns 0 if queued for the writer, -1 if the ring is full */
+
+static int log_queue(uint32_t level_in, time_t walltime, char *str, int len)
+{
+	struct log_slot *sl;
+	uint32_t pos, seq;
+	uint64_t val = 1;
+
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+
+	while (1) {
+		sl = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+		seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			/* slot is free for this lap, try to claim it */
+			if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 0,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+			/* pos was updated with the current head */
+		} else if ((int32_t)(seq - pos) < 0) {
+			/* the writer has not freed this slot, full */
+			return -1;
+		} else {
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	sl->level = level_in;
+	sl->walltime = walltime;
+	sl->len = len;
+	memcpy(sl->str, str, len + 1);
+
+	__atomic_store_n(&sl->seq, pos + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&log_writer_sleeping, __ATOMIC_SEQ_CST)) {
+		if (write(log_efd, &val, sizeof(val)) < 0) {
+			/* eventfd counter can't overflow from this */
+		}
+	}
+	return 0;
+}
+
 void log_level(char *name_in, uint32_t level_in, const char *fmt, ...)
 {
 	va_list ap;
 	char name[NAME_ID_SIZE + 1];
+	char log_str[LOG_STR_LEN];
+	struct log_slot sl;
+	time_t walltime;
 	uint32_t level = level_in & 0x0000FFFF;
 	uint32_t extra = level_in & 0xFFFF0000;
 	int ret, pos = 0;
@@ -151,26 +448,31 @@ void log_level(char *name_in, uint32_t level_in, const char *fmt, ...)
 	log_str[pos++] = '\n';
 	log_str[pos++] = '\0';
 
-	if (level < LOG_NONE)
-		log_save_str(pos - 1, log_dump, &log_point, &log_wrap);
-	if (plock)
-		log_save_str(pos - 1, log_dump_plock, &log_point_plock, &log_wrap_plock);
-
-	if (level <= syslog_priority)
-		syslog(level, "%s", log_str);
-
-	if (level <= logfile_priority && logfile_fp) {
-		time_t logtime = time(NULL);
-		char tbuf[64];
-		strftime(tbuf, sizeof(tbuf), "%b %d %T", localtime(&logtime));
-		fprintf(logfile_fp, "%s %s", tbuf, log_str);
-		fflush(logfile_fp);
+	if (!(extra & LOG_NODUMP)) {
+		pthread_mutex_lock(&log_dump_mutex);
+		if (level < LOG_NONE)
+			log_save_str(log_str, pos - 1, log_dump, &log_point, &log_wrap);
+		if (plock)
+			log_save_str(log_str, pos - 1, log_dump_plock, &log_point_plock, &log_wrap_plock);
+		pthread_mutex_unlock(&log_dump_mutex);
 	}
 
-	if (!dlm_options[daemon_debug_ind].use_int)
+	/* nothing else to do for plock-only messages unless debugging */
+	if (level > syslog_priority && level > logfile_priority &&
+	    !dlm_options[daemon_debug_ind].use_int)
 		return;
 
-	if ((level < LOG_NONE) || (plock && opt(plock_debug_ind)))
-		fprintf(stderr, "%s", log_str);
-}
+	walltime = time(NULL);
 
+	if (__atomic_load_n(&log_writer_running, __ATOMIC_SEQ_CST)) {
+		if (log_queue(level_in, walltime, log_str, pos - 1) < 0)
+			__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	sl.level = level_in;
+	sl.walltime = walltime;
+	sl.len = pos - 1;
+	memcpy(sl.str, log_str, pos);
+	log_direct(&sl);
+}
@@ -10,6 +10,7 @@
 #include "dlm_daemon.h"
 #include <ctype.h>
 #include <pthread.h>
+#include <sys/signalfd.h>
 #include <linux/netlink.h>
 #include <linux/genetlink.h>
 #include <linux/dlm_netlink.h>
@@ -26,9 +27,11 @@ static pthread_t query_thread;
 static pthread_mutex_t query_mutex;
 static struct list_head fs_register_list;
 static int kernel_monitor_fd;
+static int sigchld_fd;
 
 struct client {
 	int fd;
+	int pri;
 	void *workfn;
 	void *deadfn;
 	struct lockspace *ls;
@@ -79,6 +82,25 @@ uint64_t monotime(void)
 	return ts.tv_sec;
 }
 
+uint64_t monotime_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int usec_hist_bucket(uint64_t usec)
+{
+	int i;
+
+	for (i = 0; i < USEC_HIST_BUCKETS - 1; i++) {
+		if (usec < 10)
+			break;
+		usec /= 10;
+	}
+	return i;
+}
+
 static void client_alloc(void)
 {
 	int i;
@@ -115,7 +137,8 @@ void client_dead(int ci)
 	pollfd[ci].fd = -1;
 }
 
-int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
+int client_add(int fd, int pri, void (*workfn)(int ci),
+	       void (*deadfn)(int ci))
 {
 	int i;
 
@@ -130,8 +153,10 @@ int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
 			else
 				client[i].deadfn = client_dead;
 			client[i].fd = fd;
+			client[i].pri = pri;
 			pollfd[i].fd = fd;
 			pollfd[i].events = POLLIN;
+			pollfd[i].revents = 0;
 			if (i > client_maxi)
 				client_maxi = i;
 			return i;
@@ -164,13 +189,44 @@ static void sigterm_handler(int sig)
 	daemon_quit = 1;
 }
 
-static void sigchld_handler(int sig)
+/* SIGCHLD is blocked and read from a signalfd, so a fence agent exiting
+   wakes the main loop and its result is collected right away instead of
+   at the next poll_fencing timeout. */
+
+static void process_sigchld(int ci)
 {
+	struct signalfd_siginfo si;
+	int rv;
+
+	do {
+		rv = read(client_fd(ci), &si, sizeof(si));
+	} while (rv == sizeof(si));
+
+	poll_fencing++;
+}
+
+static int setup_sigchld(void)
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+		return -errno;
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
 }
 
 static struct lockspace *create_ls(char *name)
 {
 	struct lockspace *ls;
+	int i;
 
 	ls = malloc(sizeof(*ls));
 	if (!ls)
@@ -178,6 +234,9 @@ static struct lockspace *create_ls(char *name)
 	memset(ls, 0, sizeof(struct lockspace));
 	strncpy(ls->name, name, DLM_LOCKSPACE_LEN);
 
+	for (i = 0; i < LS_HASH_KEYS; i++)
+		INIT_LIST_HEAD(&ls->hash_list[i]);
+	INIT_LIST_HEAD(&ls->join_list);
 	INIT_LIST_HEAD(&ls->changes);
 	INIT_LIST_HEAD(&ls->node_history);
 	INIT_LIST_HEAD(&ls->saved_messages);
@@ -187,17 +246,89 @@ static struct lockspace *create_ls(char *name)
 	INIT_LIST_HEAD(&ls->deadlk_nodes);
 	INIT_LIST_HEAD(&ls->transactions);
 	INIT_LIST_HEAD(&ls->resources);
+	INIT_LIST_HEAD(&ls->deadlk_refresh);
+	INIT_LIST_HEAD(&ls->deadlk_pending);
 #endif
 	setup_lockspace_config(ls);
  out:
 	return ls;
 }
 
+/* Hash indexes over the lockspaces list.  find_ls_id() runs for each plock
+   op from the kernel, and find_ls_handle() for each cpg callback, so these
+   shouldn't walk the list when there are thousands of lockspaces.  An ls is
+   indexed by name and global_id when its join is queued, by cpg handle and
+   client once its cpg is initialized, and removed in free_ls. */
+
+static struct list_head ls_hash[LS_HASH_KEYS][LS_HASH_SIZE];
+
+static uint32_t ls_hash_int(uint64_t val)
+{
+	val ^= val >> 33;
+	val *= 0xff51afd7ed558ccdULL;
+	val ^= val >> 33;
+	return (uint32_t)val & (LS_HASH_SIZE - 1);
+}
+
+static uint32_t ls_hash_name(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h & (LS_HASH_SIZE - 1);
+}
+
+void ls_index_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < LS_HASH_KEYS; i++) {
+		for (j = 0; j < LS_HASH_SIZE; j++)
+			INIT_LIST_HEAD(&ls_hash[i][j]);
+	}
+}
+
+void ls_index_add(struct lockspace *ls, int key)
+{
+	uint32_t h;
+
+	switch (key) {
+	case LS_HASH_NAME:
+		h = ls_hash_name(ls->name);
+		break;
+	case LS_HASH_ID:
+		h = ls_hash_int(ls->global_id);
+		break;
+	case LS_HASH_HANDLE:
+		h = ls_hash_int(ls->cpg_handle);
+		break;
+	case LS_HASH_CI:
+		h = ls_hash_int(ls->cpg_client);
+		break;
+	default:
+		return;
+	}
+
+	list_add(&ls->hash_list[key], &ls_hash[key][h]);
+}
+
+void ls_index_del(struct lockspace *ls)
+{
+	int i;
+
+	for (i = 0; i < LS_HASH_KEYS; i++)
+		list_del_init(&ls->hash_list[i]);
+}
+
 struct lockspace *find_ls(char *name)
 {
+	struct list_head *head = &ls_hash[LS_HASH_NAME][ls_hash_name(name)];
 	struct lockspace *ls;
 
-	list_for_each_entry(ls, &lockspaces, list) {
+	list_for_each_entry(ls, head, hash_list[LS_HASH_NAME]) {
 		if ((strlen(ls->name) == strlen(name)) &&
 		    !strncmp(ls->name, name, strlen(name)))
 			return ls;
@@ -207,15 +338,40 @@ struct lockspace *find_ls(char *name)
 
 struct lockspace *find_ls_id(uint32_t id)
 {
+	struct list_head *head = &ls_hash[LS_HASH_ID][ls_hash_int(id)];
 	struct lockspace *ls;
 
-	list_for_each_entry(ls, &lockspaces, list) {
+	list_for_each_entry(ls, head, hash_list[LS_HASH_ID]) {
 		if (ls->global_id == id)
 			return ls;
 	}
 	return NULL;
 }
 
+struct lockspace *find_ls_handle(cpg_handle_t h)
+{
+	struct list_head *head = &ls_hash[LS_HASH_HANDLE][ls_hash_int(h)];
+	struct lockspace *ls;
+
+	list_for_each_entry(ls, head, hash_list[LS_HASH_HANDLE]) {
+		if (ls->cpg_handle == h)
+			return ls;
+	}
+	return NULL;
+}
+
+struct lockspace *find_ls_ci(int ci)
+{
+	struct list_head *head = &ls_hash[LS_HASH_CI][ls_hash_int(ci)];
+	struct lockspace *ls;
+
+	list_for_each_entry(ls, head, hash_list[LS_HASH_CI]) {
+		if (ls->cpg_client == ci)
+			return ls;
+	}
+	return NULL;
+}
+
 struct fs_reg {
 	struct list_head list;
 	char name[DLM_LOCKSPACE_LEN+1];
@@ -470,6 +626,18 @@ static void copy_options(char *buf, int *len)
 		pos += ret;
 	}
 
+	memset(tmp, 0, sizeof(tmp));
+	snprintf(tmp, 255, "config_reloads=%d\n", config_reloads);
+
+	if (pos + strlen(tmp) < LOG_DUMP_SIZE)
+		pos += sprintf(buf + pos, "%s", tmp);
+
+	memset(tmp, 0, sizeof(tmp));
+	snprintf(tmp, 255, "log_dropped=%llu\n", log_drops());
+
+	if (pos + strlen(tmp) < LOG_DUMP_SIZE)
+		pos += sprintf(buf + pos, "%s", tmp);
+
 	*len = pos;
 }
 
@@ -492,7 +660,7 @@ static void query_dump_log_plock(int fd)
 	struct dlmc_header h;
 	int len = 0;
 
-	copy_log_dump_plock(copy_buf, &len);
+	copy_plock_log(copy_buf, &len);
 
 	init_header(&h, DLMC_CMD_DUMP_DEBUG, NULL, 0, len);
 	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
@@ -551,6 +719,36 @@ static void do_reply(int fd, int cmd, char *name, int result, int option,
 	free(reply);
 }
 
+static void query_dump_msg_stats(int fd, char *name)
+{
+	struct dlmc_header h;
+	int len = 0;
+	int rv;
+
+	rv = copy_msg_stats(name, copy_buf, &len);
+
+	init_header(&h, DLMC_CMD_DUMP_MSG_STATS, name, rv, len);
+	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+
+	if (len)
+		send(fd, copy_buf, len, MSG_NOSIGNAL);
+}
+
+static void query_dump_recovery(int fd, char *name)
+{
+	struct dlmc_header h;
+	int len = 0;
+	int rv;
+
+	rv = copy_recovery(name, copy_buf, &len);
+
+	init_header(&h, DLMC_CMD_DUMP_RECOVERY, name, rv, len);
+	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+
+	if (len)
+		send(fd, copy_buf, len, MSG_NOSIGNAL);
+}
+
 static void query_lockspace_info(int fd, char *name)
 {
 	struct lockspace *ls;
@@ -759,7 +957,7 @@ static void process_listener(int ci)
 		return;
 	}
 	
-	i = client_add(fd, process_connection, NULL);
+	i = client_add(fd, CLIENT_PRI_LS, process_connection, NULL);
 
 	log_debug("client connection %d fd %d", i, fd);
 }
@@ -811,8 +1009,8 @@ static void query_unlock(void)
 
 /* This is a thread, so we have to be careful, don't call log_ functions.
    We need a thread to process queries because the main thread may block
-   for long periods when writing to sysfs to stop dlm-kernel (any maybe
-   other places). */
+   for long periods, e.g. when writing to sysfs to stop dlm-kernel with
+   kernel_write_threads 0 (and maybe other places). */
 
 static void *process_queries(void *arg)
 {
@@ -858,6 +1056,12 @@ static void *process_queries(void *arg)
 		case DLMC_CMD_DUMP_PLOCKS:
 			query_dump_plocks(f, h.name);
 			break;
+		case DLMC_CMD_DUMP_MSG_STATS:
+			query_dump_msg_stats(f, h.name);
+			break;
+		case DLMC_CMD_DUMP_RECOVERY:
+			query_dump_recovery(f, h.name);
+			break;
 		case DLMC_CMD_LOCKSPACE_INFO:
 			query_lockspace_info(f, h.name);
 			break;
@@ -920,13 +1124,86 @@ void cluster_dead(int ci)
 	cluster_down = 1;
 }
 
+/* Max rounds of dispatch_clients in which each class is serviced. */
+
+static const int client_pri_budget[CLIENT_PRI_CLASSES] = {
+	[CLIENT_PRI_HIGH] = 64,
+	[CLIENT_PRI_LS]   = 16,
+	[CLIENT_PRI_BULK] = 64,
+};
+
+static int dispatch_class(int pri)
+{
+	void (*workfn) (int ci);
+	void (*deadfn) (int ci);
+	int i, count = 0;
+
+	for (i = 0; i <= client_maxi; i++) {
+		if (client[i].fd < 0 || client[i].pri != pri)
+			continue;
+		if (pollfd[i].revents & POLLIN) {
+			workfn = client[i].workfn;
+			workfn(i);
+			count++;
+		}
+		if (pollfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			deadfn = client[i].deadfn;
+			deadfn(i);
+			count++;
+		}
+		pollfd[i].revents = 0;
+	}
+	return count;
+}
+
+/* Each poll wakeup is handled in rounds.  A round services the ready
+   clients of each class in priority order, then polls again without
+   waiting, so membership and fencing events (quorum, cfg, daemon cpg)
+   that arrive while we are working through plock requests are handled
+   before the next plock request.  A class is serviced in at most
+   client_pri_budget rounds per wakeup, which bounds the bulk work done
+   before the poll_ work below gets to run. */
+
+static void dispatch_clients(void)
+{
+	int rounds[CLIENT_PRI_CLASSES];
+	int pri, count, rv;
+
+	memset(rounds, 0, sizeof(rounds));
+
+	while (!daemon_quit) {
+		count = 0;
+
+		for (pri = 0; pri < CLIENT_PRI_CLASSES; pri++) {
+			if (rounds[pri] >= client_pri_budget[pri])
+				continue;
+			rv = dispatch_class(pri);
+			if (rv)
+				rounds[pri]++;
+			count += rv;
+		}
+
+		if (!count)
+			break;
+
+		rv = poll(pollfd, client_maxi + 1, 0);
+		if (rv <= 0)
+			break;
+	}
+}
+
 static void loop(void)
 {
 	struct lockspace *ls;
 	int poll_timeout = -1;
-	int rv, i;
-	void (*workfn) (int ci);
-	void (*deadfn) (int ci);
+	int rv;
+
+	client_add(sigchld_fd, CLIENT_PRI_HIGH, process_sigchld, NULL);
+
+	/* before any threads are started */
+	setup_fence_exec();
+
+	setup_logging_thread();
 
 	rv = setup_queries();
 	if (rv < 0)
@@ -935,13 +1212,13 @@ static void loop(void)
 	rv = setup_listener(DLMC_SOCK_PATH);
 	if (rv < 0)
 		goto out;
-	client_add(rv, process_listener, NULL);
+	client_add(rv, CLIENT_PRI_LS, process_listener, NULL);
 
 	rv = setup_cluster_cfg();
 	if (rv < 0)
 		goto out;
 	if (rv > 0) 
-		client_add(rv, process_cluster_cfg, cluster_dead);
+		client_add(rv, CLIENT_PRI_HIGH, process_cluster_cfg, cluster_dead);
 
 	rv = check_uncontrolled_lockspaces();
 	if (rv < 0)
@@ -965,7 +1242,7 @@ static void loop(void)
 	rv = setup_cluster();
 	if (rv < 0)
 		goto out;
-	client_add(rv, process_cluster, cluster_dead);
+	client_add(rv, CLIENT_PRI_HIGH, process_cluster, cluster_dead);
 
 	rv = setup_misc_devices();
 	if (rv < 0)
@@ -975,6 +1252,12 @@ static void loop(void)
 	if (rv < 0)
 		goto out;
 
+	rv = setup_kernel_ops();
+	if (rv < 0)
+		goto out;
+	if (rv > 0)
+		client_add(rv, CLIENT_PRI_HIGH, process_kernel_ops, NULL);
+
 	setup_monitor();
 
 	rv = setup_configfs_members();		/* calls update_cluster() */
@@ -984,12 +1267,16 @@ static void loop(void)
 	rv = setup_uevent();
 	if (rv < 0)
 		goto out;
-	client_add(rv, process_uevent, NULL);
+	client_add(rv, CLIENT_PRI_LS, process_uevent, NULL);
+
+	rv = setup_config_watch();
+	if (rv > 0)
+		client_add(rv, CLIENT_PRI_LS, process_config_watch, NULL);
 
 	rv = setup_cpg_daemon();
 	if (rv < 0)
 		goto out;
-	client_add(rv, process_cpg_daemon, cluster_dead);
+	client_add(rv, CLIENT_PRI_HIGH, process_cpg_daemon, cluster_dead);
 
 	rv = set_protocol();
 	if (rv < 0)
@@ -1000,9 +1287,7 @@ static void loop(void)
 		rv = setup_netlink();
 		if (rv < 0)
 			goto out;
-		client_add(rv, process_netlink, NULL);
-
-		setup_deadlock();
+		client_add(rv, CLIENT_PRI_BULK, process_netlink, NULL);
 	}
 #endif
 
@@ -1010,12 +1295,13 @@ static void loop(void)
 	if (rv < 0)
 		goto out;
 	plock_fd = rv;
-	plock_ci = client_add(rv, process_plocks, NULL);
+	plock_ci = client_add(rv, CLIENT_PRI_BULK, process_plocks, NULL);
 
 	for (;;) {
 		rv = poll(pollfd, client_maxi + 1, poll_timeout);
 		if (rv == -1 && errno == EINTR) {
-			if (daemon_quit && list_empty(&lockspaces))
+			if (daemon_quit && list_empty(&lockspaces) &&
+			    !joins_pending())
 				goto out;
 			if (daemon_quit) {
 				log_error("shutdown ignored, active lockspaces");
@@ -1029,19 +1315,7 @@ static void loop(void)
 		}
 
 		query_lock();
-
-		for (i = 0; i <= client_maxi; i++) {
-			if (client[i].fd < 0)
-				continue;
-			if (pollfd[i].revents & POLLIN) {
-				workfn = client[i].workfn;
-				workfn(i);
-			}
-			if (pollfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-				deadfn = client[i].deadfn;
-				deadfn(i);
-			}
-		}
+		dispatch_clients();
 		query_unlock();
 
 		if (daemon_quit)
@@ -1075,10 +1349,18 @@ static void loop(void)
 				poll_timeout = 1000;
 		}
 
+		if (poll_joins) {
+			process_lockspace_joins();
+			if (poll_joins)
+				poll_timeout = 1000;
+		}
+
 		query_unlock();
 	}
  out:
 	log_debug("shutdown");
+	close_kernel_ops();
+	close_fence_exec();
 	close_plocks();
 	close_cpg_daemon();
 	clear_configfs();
@@ -1320,6 +1602,16 @@ static void set_opt_defaults(void)
 			0, NULL,
 			"enable/disable concurrent fencing");
 
+	set_opt_default(fence_concurrency_ind,
+			"fence_concurrency", '\0', req_arg_int,
+			0, NULL,
+			"max nodes fenced at once with concurrent fencing (0 for no limit)");
+
+	set_opt_default(fence_executor_ind,
+			"fence_executor", '\0', req_arg_bool,
+			0, NULL,
+			"run fence agents from a pre-forked helper process");
+
 	set_opt_default(enable_startup_fencing_ind,
 			"enable_startup_fencing", 's', req_arg_bool,
 			1, NULL,
@@ -1335,6 +1627,16 @@ static void set_opt_defaults(void)
 			1, NULL,
 			"enable/disable quorum requirement for lockspace operations");
 
+	set_opt_default(join_concurrency_ind,
+			"join_concurrency", '\0', req_arg_int,
+			16, NULL,
+			"max lockspace joins in progress at once (0 for no limit)");
+
+	set_opt_default(kernel_write_threads_ind,
+			"kernel_write_threads", '\0', req_arg_int,
+			4, NULL,
+			"threads for writes to dlm-kernel sysfs/configfs (0 writes from main loop)");
+
 	set_opt_default(help_ind,
 			"help", 'h', no_arg,
 			-1, NULL,
@@ -1559,6 +1861,7 @@ int main(int argc, char **argv)
 	fence_all_device.unfence = 0;
 
 	INIT_LIST_HEAD(&lockspaces);
+	ls_index_init();
 	INIT_LIST_HEAD(&fs_register_list);
 	init_daemon();
 
@@ -1583,12 +1886,9 @@ int main(int argc, char **argv)
 	if (rv < 0)
 		return -rv;
 
-	memset(&act, 0, sizeof(act));
-	act.sa_handler = sigchld_handler;
-	act.sa_flags = SA_NOCLDSTOP;
-	rv = sigaction(SIGCHLD, &act, NULL);
-	if (rv < 0)
-		return -rv;
+	sigchld_fd = setup_sigchld();
+	if (sigchld_fd < 0)
+		return -sigchld_fd;
 
 	set_scheduler();
 
@@ -19,6 +19,8 @@ static uint32_t			old_nodes[MAX_NODES];
 static int			old_node_count;
 static uint32_t			quorum_nodes[MAX_NODES];
 static int			quorum_node_count;
+static struct node_map		old_map;
+static struct node_map		quorum_map;
 static struct list_head		cluster_nodes;
 
 struct node_cluster {
@@ -29,13 +31,89 @@ struct node_cluster {
 	uint64_t cluster_rem_time;
 };
 
+static struct node_cluster	*cluster_node_slots[NODE_SLOTS];
+
+/* Nodeids can be any 32 bit value, so each nodeid is given a dense slot
+   number the first time it's seen, and per-node state in member.c,
+   daemon_cpg.c and cpg.c is kept in arrays and node_maps indexed by slot.
+   Slots are never reused.  If more than NODE_SLOTS different nodeids are
+   seen, node_slot() returns -1 for the rest and the callers fall back to
+   searching their lists. */
+
+#define NODE_SLOT_HASH_BITS	9
+#define NODE_SLOT_HASH		(1 << NODE_SLOT_HASH_BITS)
+
+static int slot_nodeids[NODE_SLOTS];
+static int slot_count;
+static int slot_hash[NODE_SLOT_HASH];	/* slot + 1, 0 if unused */
+static int slots_full;
+
+static unsigned int nodeid_hash(int nodeid)
+{
+	return ((uint32_t)nodeid * 2654435761U) >> (32 - NODE_SLOT_HASH_BITS);
+}
+
+/* the hash is never more than half full, so there's always an empty
+   entry to stop the search */
+
+static int slot_lookup(int nodeid, unsigned int *hash_out)
+{
+	unsigned int h = nodeid_hash(nodeid);
+	int slot;
+
+	while ((slot = slot_hash[h])) {
+		if (slot_nodeids[slot - 1] == nodeid)
+			return slot - 1;
+		h = (h + 1) & (NODE_SLOT_HASH - 1);
+	}
+	*hash_out = h;
+	return -1;
+}
+
+int node_slot_find(int nodeid)
+{
+	unsigned int h;
+
+	return slot_lookup(nodeid, &h);
+}
+
+int node_slot(int nodeid)
+{
+	unsigned int h = 0;
+	int slot;
+
+	slot = slot_lookup(nodeid, &h);
+	if (slot >= 0)
+		return slot;
+
+	if (slot_count == NODE_SLOTS) {
+		if (!slots_full) {
+			log_error("node slots full at nodeid %d", nodeid);
+			slots_full = 1;
+		}
+		return -1;
+	}
+
+	slot = slot_count++;
+	slot_nodeids[slot] = nodeid;
+	slot_hash[h] = slot + 1;
+	return slot;
+}
+
 static struct node_cluster *get_cluster_node(int nodeid, int create)
 {
 	struct node_cluster *node;
+	int slot;
+
+	slot = create ? node_slot(nodeid) : node_slot_find(nodeid);
+	if (slot >= 0 && cluster_node_slots[slot])
+		return cluster_node_slots[slot];
 
-	list_for_each_entry(node, &cluster_nodes, list) {
-		if (node->nodeid == nodeid)
-			return node;
+	if (slot < 0) {
+		list_for_each_entry(node, &cluster_nodes, list) {
+			if (node->nodeid == nodeid)
+				return node;
+		}
 	}
 
 	if (!create)
@@ -48,6 +126,8 @@ static struct node_cluster *get_cluster_node(int nodeid, int create)
 	memset(node, 0, sizeof(struct node_cluster));
 	node->nodeid = nodeid;
 	list_add(&node->list, &cluster_nodes);
+	if (slot >= 0)
+		cluster_node_slots[slot] = node;
 	return node;
 }
 
@@ -95,11 +175,21 @@ static int is_member(uint32_t *node_list, int count, uint32_t nodeid)
 
 static int is_old_member(uint32_t nodeid)
 {
+	int slot = node_slot_find(nodeid);
+
+	if (slot >= 0)
+		return node_map_test(&old_map, slot);
+
 	return is_member(old_nodes, old_node_count, nodeid);
 }
 
 int is_cluster_member(uint32_t nodeid)
 {
+	int slot = node_slot_find(nodeid);
+
+	if (slot >= 0)
+		return node_map_test(&quorum_map, slot);
+
 	return is_member(quorum_nodes, quorum_node_count, nodeid);
 }
 
@@ -110,7 +200,7 @@ static void quorum_callback(quorum_handle_t h, uint32_t quorate,
 	corosync_cfg_node_address_t addrs[MAX_NODE_ADDRESSES];
 	corosync_cfg_node_address_t *addrptr = addrs;
 	cs_error_t err;
-	int i, j, num_addrs;
+	int i, j, num_addrs, slot;
 	uint64_t now = monotime();
 
 	if (!cluster_joined_monotime) {
@@ -129,12 +219,18 @@ static void quorum_callback(quorum_handle_t h, uint32_t quorate,
 
 	old_node_count = quorum_node_count;
 	memcpy(&old_nodes, &quorum_nodes, sizeof(old_nodes));
+	memcpy(&old_map, &quorum_map, sizeof(old_map));
 
 	quorum_node_count = 0;
 	memset(&quorum_nodes, 0, sizeof(quorum_nodes));
+	memset(&quorum_map, 0, sizeof(quorum_map));
 
-	for (i = 0; i < node_list_entries; i++)
+	for (i = 0; i < node_list_entries; i++) {
 		quorum_nodes[quorum_node_count++] = node_list[i];
+		slot = node_slot(node_list[i]);
+		if (slot >= 0)
+			node_map_set(&quorum_map, slot);
+	}
 
 	for (i = 0; i < old_node_count; i++) {
 		if (!is_cluster_member(old_nodes[i])) {
@@ -265,7 +361,7 @@ static void shutdown_callback(corosync_cfg_handle_t h,
 			      corosync_cfg_shutdown_flags_t flags)
 {
 	if (flags & COROSYNC_CFG_SHUTDOWN_FLAG_REQUEST) {
-		if (list_empty(&lockspaces)) {
+		if (list_empty(&lockspaces) && !joins_pending()) {
 			log_debug("shutdown request yes");
 			corosync_cfg_replyto_shutdown(ch, COROSYNC_CFG_SHUTDOWN_FLAG_YES);
 		} else {
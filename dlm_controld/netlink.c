@@ -161,6 +161,12 @@ static void process_timewarn(struct dlm_lock_data *data)
 	log_group(ls, "timewarn: lkid %x pid %d name %s",
 		  data->id, data->ownpid, data->resource_name);
 
+	/* with the lock state kept from a previous cycle, refresh just this
+	   resource and its neighbours, without waiting */
+
+	if (!deadlk_timewarn(ls, data->resource_name, data->resource_namelen))
+		return;
+
 	/* Problem: we don't want to get a timewarn, assume it's resolved
 	   by the current cycle, but in fact it's from a deadlock that
 	   formed after the checkpoints for the current cycle.  Then we'd
@@ -199,7 +205,7 @@ static void process_timewarn(struct dlm_lock_data *data)
 
 	gettimeofday(&ls->last_send_cycle_start, NULL);
 
-	if (cfgd_enable_deadlk)
+	if (opt(enable_deadlk_ind))
 		send_cycle_start(ls);
 }
 
@@ -160,6 +160,305 @@ static const char *ex_str(int optype, int ex)
 		return "RD";
 }
 
+/*
+ * plock trace
+ *
+ * The messages logged for every plock op are saved as fixed size binary
+ * records in plock_trace instead of being formatted into the plock log.
+ * Saving one is a struct copy and a coarse clock read; records are only
+ * formatted when dlm_tool log_plock reads them (or right away for
+ * plock_debug).  Other plock messages (errors, recovery) are still text
+ * in the plock log, and copy_plock_log merges the two by time.
+ */
+
+#define PLOCK_TRACE_SIZE 8192	/* records, power of 2 */
+#define PLOCK_TRACE_STR 256
+
+enum {
+	PT_READ = 1,
+	PT_NO_LS,
+	PT_RECEIVE,
+	PT_RECEIVE_NO_R,
+	PT_RECEIVE_OWNER,
+	PT_SAVE,
+	PT_OWN_PENDING,
+	PT_RECEIVE_OWN,
+	PT_RECEIVE_SYNC,
+	PT_RECEIVE_DROP,
+	PT_DROP_NO_R,
+	PT_DROP_OWNER,
+	PT_DROP_IN_USE,
+};
+
+struct plock_trace {
+	uint64_t usec;		/* CLOCK_MONOTONIC_COARSE */
+	uint64_t number;
+	uint64_t start;
+	uint64_t end;
+	uint64_t owner;
+	uint32_t ls_id;
+	uint32_t pid;
+	int nodeid;
+	int from;
+	int arg;		/* r owner or msg type, per event */
+	int len;		/* msg len */
+	uint8_t event;
+	uint8_t optype;
+	uint8_t ex;
+	uint8_t wait;
+};
+
+static struct plock_trace plock_traces[PLOCK_TRACE_SIZE];
+static uint64_t plock_trace_count;
+
+static int format_plock_trace_msg(struct plock_trace *pt, char *buf, int len)
+{
+	switch (pt->event) {
+	case PT_READ:
+	case PT_RECEIVE:
+		return snprintf(buf, len, "%s plock %llx %s %s %llx-%llx %d/%u/%llx w %d",
+				pt->event == PT_READ ? "read" : "receive",
+				(unsigned long long)pt->number,
+				op_str(pt->optype),
+				ex_str(pt->optype, pt->ex),
+				(unsigned long long)pt->start,
+				(unsigned long long)pt->end,
+				pt->nodeid, pt->pid, (unsigned long long)pt->owner,
+				pt->wait);
+	case PT_NO_LS:
+		return snprintf(buf, len, "process_plocks: no ls id %x",
+				(uint32_t)pt->number);
+	case PT_RECEIVE_NO_R:
+		return snprintf(buf, len, "receive_plock from %d no r %llx",
+				pt->from, (unsigned long long)pt->number);
+	case PT_RECEIVE_OWNER:
+		return snprintf(buf, len, "receive_plock from %d r %llx owner %d",
+				pt->from, (unsigned long long)pt->number, pt->arg);
+	case PT_SAVE:
+		return snprintf(buf, len, "save %s from %d len %d",
+				msg_name(pt->arg), pt->from, pt->len);
+	case PT_OWN_PENDING:
+		return snprintf(buf, len, "send_own %llx already pending",
+				(unsigned long long)pt->number);
+	case PT_RECEIVE_OWN:
+		return snprintf(buf, len, "receive_own %llx from %u owner %u",
+				(unsigned long long)pt->number, pt->from, pt->nodeid);
+	case PT_RECEIVE_SYNC:
+		return snprintf(buf, len, "receive sync %llx from %u %s %llx-%llx %d/%u/%llx",
+				(unsigned long long)pt->number, pt->from,
+				pt->ex ? "WR" : "RD",
+				(unsigned long long)pt->start,
+				(unsigned long long)pt->end,
+				pt->nodeid, pt->pid, (unsigned long long)pt->owner);
+	case PT_RECEIVE_DROP:
+		return snprintf(buf, len, "receive_drop %llx from %u",
+				(unsigned long long)pt->number, pt->from);
+	case PT_DROP_NO_R:
+		return snprintf(buf, len, "receive_drop from %d no r %llx",
+				pt->from, (unsigned long long)pt->number);
+	case PT_DROP_OWNER:
+		return snprintf(buf, len, "receive_drop from %d r %llx owner %d",
+				pt->from, (unsigned long long)pt->number, pt->arg);
+	case PT_DROP_IN_USE:
+		return snprintf(buf, len, "receive_drop from %d r %llx in use",
+				pt->from, (unsigned long long)pt->number);
+	}
+	return snprintf(buf, len, "plock trace event %d", pt->event);
+}
+
+/* the same format as log_level uses for the text plock log */
+
+static int format_plock_trace(struct plock_trace *pt, char *buf, int len)
+{
+	struct lockspace *ls = NULL;
+	char name[33];
+	int pos;
+
+	memset(name, 0, sizeof(name));
+
+	if (pt->event != PT_NO_LS)
+		ls = find_ls_id(pt->ls_id);
+	if (ls)
+		snprintf(name, 32, "%.30s ", ls->name);
+	else if (pt->event != PT_NO_LS)
+		snprintf(name, 32, "%x ", pt->ls_id);
+
+	pos = snprintf(buf, len, "%llu %s",
+		       (unsigned long long)(pt->usec / 1000000), name);
+	pos += format_plock_trace_msg(pt, buf + pos, len - pos - 1);
+	if (pos > len - 2)
+		pos = len - 2;
+	buf[pos++] = '\n';
+	buf[pos] = '\0';
+	return pos;
+}
+
+static struct plock_trace *plock_trace(struct lockspace *ls, int event,
+				       struct dlm_plock_info *in)
+{
+	struct plock_trace *pt;
+	struct timespec ts;
+
+	pt = &plock_traces[plock_trace_count++ & (PLOCK_TRACE_SIZE - 1)];
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	pt->usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	pt->event = event;
+	pt->ls_id = ls ? ls->global_id : 0;
+	pt->from = 0;
+	pt->arg = 0;
+	pt->len = 0;
+
+	if (in) {
+		pt->number = in->number;
+		pt->start = in->start;
+		pt->end = in->end;
+		pt->owner = in->owner;
+		pt->pid = in->pid;
+		pt->nodeid = in->nodeid;
+		pt->optype = in->optype;
+		pt->ex = in->ex;
+		pt->wait = in->wait;
+	} else {
+		pt->number = 0;
+		pt->start = 0;
+		pt->end = 0;
+		pt->owner = 0;
+		pt->pid = 0;
+		pt->nodeid = 0;
+		pt->optype = 0;
+		pt->ex = 0;
+		pt->wait = 0;
+	}
+	return pt;
+}
+
+/* for plock_debug, format the record as log_plock would have */
+
+static void plock_trace_debug(struct lockspace *ls, struct plock_trace *pt)
+{
+	char buf[PLOCK_TRACE_STR];
+
+	if (!opt(plock_debug_ind) || !opt(daemon_debug_ind))
+		return;
+
+	format_plock_trace_msg(pt, buf, sizeof(buf));
+	log_level(ls ? ls->name : NULL, LOG_PLOCK|LOG_NONE|LOG_NODUMP, "%s", buf);
+}
+
+static void trace_info(struct lockspace *ls, int event, struct dlm_plock_info *in,
+		       int from)
+{
+	struct plock_trace *pt;
+
+	pt = plock_trace(ls, event, in);
+	pt->from = from;
+	plock_trace_debug(ls, pt);
+}
+
+static void trace_r(struct lockspace *ls, int event, uint64_t number,
+		    int from, int arg)
+{
+	struct plock_trace *pt;
+
+	pt = plock_trace(ls, event, NULL);
+	pt->number = number;
+	pt->from = from;
+	pt->arg = arg;
+	plock_trace_debug(ls, pt);
+}
+
+/* the text plock log lines start with monotime seconds */
+
+static uint64_t text_line_sec(char *line)
+{
+	return strtoull(line, NULL, 10);
+}
+
+/*
+ * for dlm_tool log_plock: the text plock log and the trace records, each
+ * in order, merged by second.  If it's more than buf can hold, the
+ * newest LOG_DUMP_SIZE bytes are kept.
+ */
+
+void copy_plock_log(char *buf, int *len_out)
+{
+	struct plock_trace *pt;
+	char *text, *out, *tp, *tend, *nl, *start;
+	uint64_t i, first, tsec = 0;
+	int text_len = 0, out_size, pos = 0, len;
+
+	*len_out = 0;
+
+	/* room for all of both, so the merge never stops short; the
+	   newest LOG_DUMP_SIZE are kept below.  The text gains at most one
+	   newline, the extra PLOCK_TRACE_STR is for the loop's check. */
+	text = malloc(LOG_DUMP_SIZE);
+	out_size = LOG_DUMP_SIZE + 1 + (PLOCK_TRACE_SIZE + 1) * PLOCK_TRACE_STR;
+	out = malloc(out_size);
+	if (!text || !out)
+		goto out;
+
+	copy_log_dump_plock(text, &text_len);
+
+	tp = text;
+	tend = text + text_len;
+
+	/* a wrapped buffer starts in the middle of a line */
+	if (text_len == LOG_DUMP_SIZE) {
+		nl = memchr(tp, '\n', tend - tp);
+		tp = nl ? nl + 1 : tend;
+	}
+
+	if (plock_trace_count > PLOCK_TRACE_SIZE)
+		first = plock_trace_count - PLOCK_TRACE_SIZE;
+	else
+		first = 0;
+	i = first;
+
+	while (tp < tend || i < plock_trace_count) {
+		if (out_size - pos < PLOCK_TRACE_STR)
+			break;
+
+		pt = &plock_traces[i & (PLOCK_TRACE_SIZE - 1)];
+
+		if (tp < tend)
+			tsec = text_line_sec(tp);
+
+		if (tp < tend &&
+		    (i == plock_trace_count || tsec < pt->usec / 1000000)) {
+			nl = memchr(tp, '\n', tend - tp);
+			len = nl ? nl + 1 - tp : tend - tp;
+			if (len + 1 > out_size - pos)
+				break;
+			memcpy(out + pos, tp, len);
+			pos += len;
+			tp += len;
+			/* the last line in the copy has no newline */
+			if (out[pos - 1] != '\n')
+				out[pos++] = '\n';
+			continue;
+		}
+
+		pos += format_plock_trace(pt, out + pos, PLOCK_TRACE_STR);
+		i++;
+	}
+
+	start = out;
+	if (pos > LOG_DUMP_SIZE) {
+		start = out + pos - LOG_DUMP_SIZE;
+		nl = memchr(start, '\n', out + pos - start);
+		start = nl ? nl + 1 : out + pos;
+	}
+
+	len = out + pos - start;
+	memcpy(buf, start, len);
+	*len_out = len;
+ out:
+	free(text);
+	free(out);
+}
+
 int setup_plocks(void)
 {
 	plock_read_count = 0;
@@ -789,6 +1088,7 @@ static void do_get(struct lockspace *ls, struct dlm_plock_info *in,
 static void save_message(struct lockspace *ls, struct dlm_header *hd, int len,
 			 int from, int type)
 {
+	struct plock_trace *pt;
 	struct save_msg *sm;
 
 	sm = malloc(sizeof(struct save_msg) + len);
@@ -801,7 +1101,11 @@ static void save_message(struct lockspace *ls, struct dlm_header *hd, int len,
 	sm->len = len;
 	sm->nodeid = from;
 
-	log_plock(ls, "save %s from %d len %d", msg_name(type), from, len);
+	pt = plock_trace(ls, PT_SAVE, NULL);
+	pt->from = from;
+	pt->arg = type;
+	pt->len = len;
+	plock_trace_debug(ls, pt);
 
 	list_add_tail(&sm->list, &ls->saved_messages);
 }
@@ -851,13 +1155,7 @@ static void _receive_plock(struct lockspace *ls, struct dlm_header *hd, int len)
 	memcpy(&info, (char *)hd + sizeof(struct dlm_header), sizeof(info));
 	info_bswap_in(&info);
 
-	log_plock(ls, "receive plock %llx %s %s %llx-%llx %d/%u/%llx w %d",
-		  (unsigned long long)info.number,
-		  op_str(info.optype),
-		  ex_str(info.optype, info.ex),
-		  (unsigned long long)info.start, (unsigned long long)info.end,
-		  info.nodeid, info.pid, (unsigned long long)info.owner,
-		  info.wait);
+	trace_info(ls, PT_RECEIVE, &info, from);
 
 	plock_recv_count++;
 	if (!(plock_recv_count % 1000)) {
@@ -887,8 +1185,7 @@ static void _receive_plock(struct lockspace *ls, struct dlm_header *hd, int len)
 		   who sent the plock, we need to send_own() and put it on the
 		   pending list to resend once the owner is established. */
 
-		log_plock(ls, "receive_plock from %d no r %llx", from,
-			  (unsigned long long)info.number);
+		trace_r(ls, PT_RECEIVE_NO_R, info.number, from, 0);
 
 		if (from != our_nodeid)
 			return;
@@ -935,22 +1232,19 @@ static void _receive_plock(struct lockspace *ls, struct dlm_header *hd, int len)
 		__receive_plock(ls, &info, from, r);
 
 	} else if (r->owner == -1) {
-		log_plock(ls, "receive_plock from %d r %llx owner %d", from,
-			  (unsigned long long)info.number, r->owner);
+		trace_r(ls, PT_RECEIVE_OWNER, info.number, from, r->owner);
 
 		if (from == our_nodeid)
 			save_pending_plock(ls, r, &info);
 
 	} else if (r->owner != our_nodeid) {
-		log_plock(ls, "receive_plock from %d r %llx owner %d", from,
-			  (unsigned long long)info.number, r->owner);
+		trace_r(ls, PT_RECEIVE_OWNER, info.number, from, r->owner);
 
 		if (from == our_nodeid)
 			save_pending_plock(ls, r, &info);
 
 	} else if (r->owner == our_nodeid) {
-		log_plock(ls, "receive_plock from %d r %llx owner %d", from,
-			  (unsigned long long)info.number, r->owner);
+		trace_r(ls, PT_RECEIVE_OWNER, info.number, from, r->owner);
 
 		if (from == our_nodeid)
 			__receive_plock(ls, &info, from, r);
@@ -1012,8 +1306,7 @@ static void send_own(struct lockspace *ls, struct resource *r, int owner)
 	   (pending list is not empty), then we shouldn't send another */
 
 	if (!list_empty(&r->pending)) {
-		log_plock(ls, "send_own %llx already pending",
-			  (unsigned long long)r->number);
+		trace_r(ls, PT_OWN_PENDING, r->number, 0, 0);
 		return;
 	}
 
@@ -1135,8 +1428,7 @@ static void _receive_own(struct lockspace *ls, struct dlm_header *hd, int len)
 	memcpy(&info, (char *)hd + sizeof(struct dlm_header), sizeof(info));
 	info_bswap_in(&info);
 
-	log_plock(ls, "receive_own %llx from %u owner %u",
-		  (unsigned long long)info.number, hd->nodeid, info.nodeid);
+	trace_info(ls, PT_RECEIVE_OWN, &info, hd->nodeid);
 
 	rv = find_resource(ls, info.number, 1, &r);
 	if (rv)
@@ -1308,10 +1600,7 @@ static void _receive_sync(struct lockspace *ls, struct dlm_header *hd, int len)
 	memcpy(&info, (char *)hd + sizeof(struct dlm_header), sizeof(info));
 	info_bswap_in(&info);
 
-	log_plock(ls, "receive sync %llx from %u %s %llx-%llx %d/%u/%llx",
-		  (unsigned long long)info.number, from, info.ex ? "WR" : "RD",
-		  (unsigned long long)info.start, (unsigned long long)info.end,
-		  info.nodeid, info.pid, (unsigned long long)info.owner);
+	trace_info(ls, PT_RECEIVE_SYNC, &info, from);
 
 	rv = find_resource(ls, info.number, 0, &r);
 	if (rv) {
@@ -1355,14 +1644,12 @@ static void _receive_drop(struct lockspace *ls, struct dlm_header *hd, int len)
 	memcpy(&info, (char *)hd + sizeof(struct dlm_header), sizeof(info));
 	info_bswap_in(&info);
 
-	log_plock(ls, "receive_drop %llx from %u",
-		  (unsigned long long)info.number, from);
+	trace_r(ls, PT_RECEIVE_DROP, info.number, from, 0);
 
 	rv = find_resource(ls, info.number, 0, &r);
 	if (rv) {
 		/* we'll find no r if two nodes sent drop at once */
-		log_plock(ls, "receive_drop from %d no r %llx", from,
-			  (unsigned long long)info.number);
+		trace_r(ls, PT_DROP_NO_R, info.number, from, 0);
 		return;
 	}
 
@@ -1372,8 +1659,7 @@ static void _receive_drop(struct lockspace *ls, struct dlm_header *hd, int len)
 	   	   - A sent drop, B sent drop, receive drop A, A sent own,
 		     receive own A, receive drop B (this warning on all,
 		     owner A) */
-		log_plock(ls, "receive_drop from %d r %llx owner %d", from,
-			  (unsigned long long)r->number, r->owner);
+		trace_r(ls, PT_DROP_OWNER, r->number, from, r->owner);
 		return;
 	}
 
@@ -1393,8 +1679,7 @@ static void _receive_drop(struct lockspace *ls, struct dlm_header *hd, int len)
 		free(r);
 	} else {
 		/* A sent drop, B sent a plock, receive plock, receive drop */
-		log_plock(ls, "receive_drop from %d r %llx in use", from,
-			  (unsigned long long)r->number);
+		trace_r(ls, PT_DROP_IN_USE, r->number, from, 0);
 	}
 }
 
@@ -1536,7 +1821,7 @@ void process_plocks(int ci)
 
 	ls = find_ls_id(info.fsid);
 	if (!ls) {
-		log_plock(ls, "process_plocks: no ls id %x", info.fsid);
+		trace_r(NULL, PT_NO_LS, info.fsid, 0, 0);
 		rv = -EEXIST;
 		goto fail;
 	}
@@ -1546,13 +1831,7 @@ void process_plocks(int ci)
 		goto fail;
 	}
 
-	log_plock(ls, "read plock %llx %s %s %llx-%llx %d/%u/%llx w %d",
-		  (unsigned long long)info.number,
-		  op_str(info.optype),
-		  ex_str(info.optype, info.ex),
-		  (unsigned long long)info.start, (unsigned long long)info.end,
-		  info.nodeid, info.pid, (unsigned long long)info.owner,
-		  info.wait);
+	trace_info(ls, PT_READ, &info, 0);
 
 	/* report plock rate and any delays since the last report */
 	plock_read_count++;
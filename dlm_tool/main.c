@@ -41,6 +41,8 @@
 #define OP_FENCE_ACK			11
 #define OP_STATUS			12
 #define OP_DUMP_CONFIG			13
+#define OP_MSG_STATS			14
+#define OP_RECOVERY			15
 
 static char *prog_name;
 static char *lsname;
@@ -187,7 +189,7 @@ static void print_usage(void)
 	printf("\n");
 	printf("Commands:\n");
 	printf("ls, status, dump, dump_config, fence_ack\n");
-	printf("log_plock, plocks\n");
+	printf("log_plock, plocks, msg_stats, recovery\n");
 	printf("join, leave, lockdebug\n");
 	printf("\n");
 	printf("Options:\n");
@@ -353,6 +355,18 @@ static void decode_arguments(int argc, char **argv)
 			opt_ind = optind + 1;
 			need_lsname = 0;
 			break;
+		} else if (!strncmp(argv[optind], "msg_stats", 9) &&
+			   (strlen(argv[optind]) == 9)) {
+			operation = OP_MSG_STATS;
+			opt_ind = optind + 1;
+			need_lsname = 0;
+			break;
+		} else if (!strncmp(argv[optind], "recovery", 8) &&
+			   (strlen(argv[optind]) == 8)) {
+			operation = OP_RECOVERY;
+			opt_ind = optind + 1;
+			need_lsname = 0;
+			break;
 		}
 
 		/*
@@ -483,75 +497,48 @@ static char *pr_master(int nodeid)
 	return buf;
 }
 
-static char *pr_extra(uint32_t flags, int root_list, int recover_list,
-	       int recover_locks_count, char *first_lkid)
+static char *pr_extra(struct dlmc_debugfs_rsb *r)
 {
 	static char buf[128];
 	int first = 0;
 
 	memset(buf, 0, sizeof(buf));
 
-	if (strcmp(first_lkid, "0"))
+	if (r->first_lkid_len != 1 || r->first_lkid[0] != '0')
 		first = 1;
 
-	if (flags || first || root_list || recover_list || recover_locks_count)
-		sprintf(buf,
-		   "flags %08x first_lkid %s root %d recover %d locks %d",
-		   flags, first_lkid, root_list, recover_list, recover_locks_count);
+	if (r->flags || first || r->root_list || r->recover_list ||
+	    r->recover_locks_count)
+		snprintf(buf, sizeof(buf),
+		   "flags %08x first_lkid %.*s root %d recover %d locks %d",
+		   r->flags, r->first_lkid_len, r->first_lkid, r->root_list,
+		   r->recover_list, r->recover_locks_count);
 
 	return buf;
 }
 
-static void print_rsb(char *line, struct rinfo *ri)
+static void print_rsb(char *line, int len, struct rinfo *ri)
 {
-	char type[4], namefmt[4], *p;
-	char addr[64];
-	char first_lkid[64];
-	int rv, nodeid, root_list, recover_list, recover_locks_count, namelen;
-	uint32_t flags;
-
-	rv = sscanf(line, "%s %s %d %s %u %d %d %u %u %s",
-		    type,
-		    addr,
-		    &nodeid,
-		    first_lkid,
-		    &flags,
-		    &root_list,
-		    &recover_list,
-		    &recover_locks_count,
-		    &namelen,
-		    namefmt);
-
-	if (rv != 10)
-		goto fail;
-
-	/* used for lkb prints */
-	ri->nodeid = nodeid;
+	struct dlmc_debugfs_rsb r;
+	int rv;
 
-	ri->namelen = namelen;
-	
-	p = strchr(line, '\n');
-	if (!p)
+	rv = dlmc_parse_rsb(line, len, &r);
+	if (rv != DLMC_RSB_FIELDS)
 		goto fail;
-	*p = '\0';
 
-	p = strstr(line, namefmt);
-	if (!p)
-		goto fail;
-	p += 4;
+	/* used for lkb prints */
+	ri->nodeid = r.nodeid;
 
-	strcat(addr, " ");
+	ri->namelen = r.namelen;
 
-	if (!strncmp(namefmt, "str", 3))
-		printf("Resource len %2d  \"%s\"\n", namelen, p);
-	else if (!strncmp(namefmt, "hex", 3))
-		printf("Resource len %2d hex %s\n", namelen, p);
+	if (!r.hex)
+		printf("Resource len %2d  \"%.*s\"\n", r.namelen,
+		       r.name_len, r.name);
 	else
-		goto fail;
+		printf("Resource len %2d hex %.*s\n", r.namelen,
+		       r.name_len, r.name);
 
-	printf("%-16s %s\n",
-		pr_master(nodeid),
-		pr_extra(flags, root_list, recover_list, recover_locks_count, first_lkid));
+	printf("%-16s %s\n", pr_master(r.nodeid), pr_extra(&r));
 	return;
 
  fail:
@@ -588,13 +575,7 @@ static void print_lvb(char *line)
 	printf("\n");
 }
 
-struct lkb {
-	uint64_t xid, timestamp, time_bast;
-	uint32_t id, remid, exflags, flags, lvbseq;
-	int nodeid, ownpid, status, grmode, rqmode, highbast, rsb_lookup, wait_type;
-};
-
-static const char *pr_grmode(struct lkb *lkb)
+static const char *pr_grmode(struct dlmc_debugfs_lkb *lkb)
 {
 	if (lkb->status == DLM_LKSTS_GRANTED || lkb->status == DLM_LKSTS_CONVERT)
 		return mode_str(lkb->grmode);
@@ -604,7 +585,7 @@ static const char *pr_grmode(struct lkb *lkb)
 		return "XX";
 }
 
-static const char *pr_rqmode(struct lkb *lkb)
+static const char *pr_rqmode(struct dlmc_debugfs_lkb *lkb)
 {
 	static char buf[5];
 
@@ -622,7 +603,7 @@ static const char *pr_rqmode(struct lkb *lkb)
 	}
 }
 
-static const char *pr_remote(struct lkb *lkb, struct rinfo *ri)
+static const char *pr_remote(struct dlmc_debugfs_lkb *lkb, struct rinfo *ri)
 {
 	static char buf[64];
 
@@ -639,7 +620,7 @@ static const char *pr_remote(struct lkb *lkb, struct rinfo *ri)
 	}
 }
 
-static const char *pr_wait(struct lkb *lkb)
+static const char *pr_wait(struct dlmc_debugfs_lkb *lkb)
 {
 	static char buf[16];
 
@@ -653,7 +634,7 @@ static const char *pr_wait(struct lkb *lkb)
 	}
 }
 
-static char *pr_verbose(struct lkb *lkb)
+static char *pr_verbose(struct dlmc_debugfs_lkb *lkb)
 {
 	static char buf[128];
 
@@ -667,30 +648,12 @@ static char *pr_verbose(struct lkb *lkb)
 	return buf;
 }
 
-static void print_lkb(char *line, struct rinfo *ri)
+static void print_lkb(char *line, int len, struct rinfo *ri)
 {
-	struct lkb lkb;
-	char type[4];
-	int rv;
+	struct dlmc_debugfs_lkb lkb;
 
-	rv = sscanf(line, "%s %x %d %x %u %llu %x %x %d %d %d %d %d %d %u %llu %llu",
-		    type,
-		    &lkb.id,
-		    &lkb.nodeid,
-		    &lkb.remid,
-		    &lkb.ownpid,
-		    (unsigned long long *)&lkb.xid,
-		    &lkb.exflags,
-		    &lkb.flags,
-		    &lkb.status,
-		    &lkb.grmode,
-		    &lkb.rqmode,
-		    &lkb.highbast,
-		    &lkb.rsb_lookup,
-		    &lkb.wait_type,
-		    &lkb.lvbseq,
-		    (unsigned long long *)&lkb.timestamp,
-		    (unsigned long long *)&lkb.time_bast);
+	memset(&lkb, 0, sizeof(lkb));
+	dlmc_parse_lkb(line, len, &lkb);
 
 	ri->lkb_count++;
 
@@ -736,61 +699,34 @@ static void print_lkb(char *line, struct rinfo *ri)
 		printf("%s\n", pr_verbose(&lkb));
 }
 
-static void print_rsb_toss(char *line)
+static void print_rsb_toss(char *line, int len)
 {
-	char type[4], namefmt[4], *p;
-	char addr[64];
-	char toss_time[16];
-	int res_nodeid, master_nodeid, dir_nodeid, our_nodeid;
-	int rv, namelen;
-	uint32_t flags;
-
-	rv = sscanf(line, "%s %s %d %d %d %d %s %u %u %s",
-		    type,
-		    addr,
-		    &res_nodeid,
-		    &master_nodeid,
-		    &dir_nodeid,
-		    &our_nodeid,
-		    toss_time,
-		    &flags,
-		    &namelen,
-		    namefmt);
-
-	if (rv != 10)
-		goto fail;
-
-	p = strchr(line, '\n');
-	if (!p)
-		goto fail;
-	*p = '\0';
+	struct dlmc_debugfs_toss t;
+	int rv;
 
-	p = strstr(line, namefmt);
-	if (!p)
+	rv = dlmc_parse_toss(line, len, &t);
+	if (rv != DLMC_TOSS_FIELDS)
 		goto fail;
-	p += 4;
-
-	strcat(addr, " ");
 
-	if (!strncmp(namefmt, "str", 3))
-		printf("Resource len %2d  \"%s\"\n", namelen, p);
-	else if (!strncmp(namefmt, "hex", 3))
-		printf("Resource len %2d hex %s\n", namelen, p);
+	if (!t.hex)
+		printf("Resource len %2d  \"%.*s\"\n", t.namelen,
+		       t.name_len, t.name);
 	else
-		goto fail;
+		printf("Resource len %2d hex %.*s\n", t.namelen,
+		       t.name_len, t.name);
 
-	if (master_nodeid != our_nodeid)
-		printf("Master:%d", master_nodeid);
+	if (t.master_nodeid != t.our_nodeid)
+		printf("Master:%d", t.master_nodeid);
 	else
 		printf("Master");
 
-	if (dir_nodeid != our_nodeid)
-		printf(" Dir:%d", dir_nodeid);
+	if (t.dir_nodeid != t.our_nodeid)
+		printf(" Dir:%d", t.dir_nodeid);
 	else
 		printf(" Dir");
 
-	if (master_nodeid == our_nodeid && res_nodeid != 0)
-		printf(" res_nodeid %d", res_nodeid);
+	if (t.master_nodeid == t.our_nodeid && t.res_nodeid != 0)
+		printf(" res_nodeid %d", t.res_nodeid);
 
 	printf("\n");
 
@@ -868,107 +804,87 @@ static void print_summary(struct summary *s)
 	printf("  expect reply  %u\n", s->expect_replies);
 }
 
-#define LOCK_LINE_MAX 1024
+/* the debugfs files are read through this, one at a time */
+static char debugfs_buf[DLMC_DEBUGFS_BUF];
 
 static void do_waiters(char *name, struct summary *sum)
 {
-	FILE *file;
-	char path[PATH_MAX];
-	char line[LOCK_LINE_MAX];
-	char rname[DLM_RESNAME_MAXLEN+1];
+	struct dlmc_debugfs df;
+	struct dlmc_debugfs_waiter w;
+	char *line;
 	int header = 0;
-	int i, j, spaces;
-	int rv, nodeid, wait_type;
-	uint32_t id;
-
-	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_waiters", name);
+	int rv, len;
 
-	file = fopen(path, "r");
-	if (!file)
+	if (dlmc_debugfs_open(&df, name, "_waiters", debugfs_buf,
+			      sizeof(debugfs_buf)) < 0)
 		return;
 
-	while (fgets(line, LOCK_LINE_MAX, file)) {
+	while ((line = dlmc_debugfs_line(&df, &len))) {
 		if (!header) {
 			printf("\n");
 			printf("Expecting reply\n");
 			header = 1;
 		}
 
-		rv = sscanf(line, "%x %d %d",
-			    &id, &wait_type, &nodeid);
+		rv = dlmc_parse_waiter(line, len, &w);
 
-		if (rv != 3) {
-			printf("waiters: %s", line);
+		if (rv != DLMC_WAITER_FIELDS) {
+			printf("waiters: %s\n", line);
 			continue;
 		}
 
-		/* parse the resource name from the remainder of the line */
-		j = 0;
-		spaces = 0;
-		memset(rname, 0, sizeof(rname));
-
-		for (i = 0; i < LOCK_LINE_MAX; i++) {
-			if (line[i] == '\n')
-				break;
-			if (spaces == 3) {
-				rname[j++] = line[i];
-				if (j == (sizeof(rname) - 1))
-					break;
-			} else if (line[i] == ' ') {
-				spaces++;
-			}
-		}
+		if (w.name_len > DLM_RESNAME_MAXLEN)
+			w.name_len = DLM_RESNAME_MAXLEN;
 
-		printf("nodeid %2d msg %s lkid %08x resource \"%s\"\n",
-		       nodeid, msg_str(wait_type), id, rname);
+		printf("nodeid %2d msg %s lkid %08x resource \"%.*s\"\n",
+		       w.nodeid, msg_str(w.wait_type), w.id,
+		       w.name_len, w.name);
 
 		sum->expect_replies++;
 	}
-	fclose(file);
+	dlmc_debugfs_close(&df);
 }
 
 static void do_toss(char *name, struct summary *sum)
 {
-	FILE *file;
-	char path[PATH_MAX];
-	char line[LOCK_LINE_MAX];
-
-	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_toss", name);
+	struct dlmc_debugfs df;
+	char *line;
+	int len;
 
-	file = fopen(path, "r");
-	if (!file)
+	if (dlmc_debugfs_open(&df, name, "_toss", debugfs_buf,
+			      sizeof(debugfs_buf)) < 0)
 		return;
 
-	while (fgets(line, LOCK_LINE_MAX, file)) {
+	while ((line = dlmc_debugfs_line(&df, &len))) {
 		if (!strncmp(line, "version", 7))
 			continue;
 
 		if (!strncmp(line, "rsb", 3)) {
-			print_rsb_toss(line);
+			print_rsb_toss(line, len);
 			sum->toss_total++;
 			printf("\n");
 		}
 	}
-	fclose(file);
+	dlmc_debugfs_close(&df);
 }
 
 static void do_lockdebug(char *name)
 {
 	struct summary summary;
 	struct rinfo info;
-	FILE *file;
-	char path[PATH_MAX];
-	char line[LOCK_LINE_MAX];
+	struct dlmc_debugfs df;
+	char *line;
 	int old = 0;
+	int rv, len;
 
-	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_all", name);
-
-	file = fopen(path, "r");
-	if (!file) {
-		snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s", name);
-		file = fopen(path, "r");
-		if (!file) {
-			fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+	rv = dlmc_debugfs_open(&df, name, "_all", debugfs_buf,
+			       sizeof(debugfs_buf));
+	if (rv < 0) {
+		rv = dlmc_debugfs_open(&df, name, "", debugfs_buf,
+				       sizeof(debugfs_buf));
+		if (rv < 0) {
+			fprintf(stderr, "can't open /sys/kernel/debug/dlm/%s: %s\n",
+				name, strerror(-rv));
 			return;
 		}
 		old = 1;
@@ -977,7 +893,7 @@ static void do_lockdebug(char *name)
 	memset(&summary, 0, sizeof(struct summary));
 	memset(&info, 0, sizeof(struct rinfo));
 
-	while (fgets(line, LOCK_LINE_MAX, file)) {
+	while ((line = dlmc_debugfs_line(&df, &len))) {
 
 		if (old)
 			goto raw;
@@ -989,7 +905,7 @@ static void do_lockdebug(char *name)
 			count_rinfo(&summary, &info);
 			clear_rinfo(&info);
 			printf("\n");
-			print_rsb(line, &info);
+			print_rsb(line, len, &info);
 			continue;
 		}
 		
@@ -1000,16 +916,16 @@ static void do_lockdebug(char *name)
 		}
 		
 		if (!strncmp(line, "lkb", 3)) {
-			print_lkb(line, &info);
+			print_lkb(line, len, &info);
 			continue;
 		}
  raw:
-		printf("%s", line);
+		printf("%s\n", line);
 	}
 	count_rinfo(&summary, &info);
 	clear_rinfo(&info);
 	printf("\n");
-	fclose(file);
+	dlmc_debugfs_close(&df);
 
 	do_toss(name, &summary);
 
@@ -1021,89 +937,44 @@ static void do_lockdebug(char *name)
 	}
 }
 
-static void parse_r_name(char *line, char *name)
-{
-	char *p;
-	int i = 0;
-	int begin = 0;
-
-	for (p = line; ; p++) {
-		if (*p == '"') {
-			if (begin)
-				break;
-			begin = 1;
-			continue;
-		}
-		if (begin)
-			name[i++] = *p;
-	}
-}
-
 static void do_lockdump(char *name)
 {
-	FILE *file;
-	char path[PATH_MAX];
-	char line[LOCK_LINE_MAX];
-	char r_name[DLM_RESNAME_MAXLEN+1];
-	int r_nodeid;
-	int r_len;
-	int rv;
-	unsigned int tm;
-	unsigned long long xid;
-	uint32_t	id;
-	int		nodeid;
-	uint32_t	remid;
-	int		ownpid;
-	uint32_t	exflags;
-	uint32_t	flags;
-	int8_t		status;
-	int8_t		grmode;
-	int8_t		rqmode;
-
-	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_locks", name);
-
-	file = fopen(path, "r");
-	if (!file) {
-		fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+	struct dlmc_debugfs df;
+	struct dlmc_debugfs_lock lk;
+	char *line;
+	int rv, len;
+
+	rv = dlmc_debugfs_open(&df, name, "_locks", debugfs_buf,
+			       sizeof(debugfs_buf));
+	if (rv < 0) {
+		fprintf(stderr, "can't open /sys/kernel/debug/dlm/%s_locks: %s\n",
+			name, strerror(-rv));
 		return;
 	}
 
 	/* skip the header on the first line */
-	if (!fgets(line, LOCK_LINE_MAX, file))
-		return;
+	if (!dlmc_debugfs_line(&df, &len))
+		goto out;
 
-	while (fgets(line, LOCK_LINE_MAX, file)) {
-		rv = sscanf(line, "%x %d %x %u %llu %x %x %hhd %hhd %hhd %u %d %d",
-		       &id,
-		       &nodeid,
-		       &remid,
-		       &ownpid,
-		       &xid,
-		       &exflags,
-		       &flags,
-		       &status,
-		       &grmode,
-		       &rqmode,
-		       &tm,
-		       &r_nodeid,
-		       &r_len);
-
-		if (rv != 13) {
+	while ((line = dlmc_debugfs_line(&df, &len))) {
+		rv = dlmc_parse_lock(line, len, &lk);
+
+		if (rv != DLMC_LOCK_FIELDS) {
 			fprintf(stderr, "invalid debugfs line %d: %s\n",
 				rv, line);
-			return;
+			goto out;
 		}
 
-		memset(r_name, 0, sizeof(r_name));
-		parse_r_name(line, r_name);
+		if (lk.r_name_len > DLM_RESNAME_MAXLEN)
+			lk.r_name_len = DLM_RESNAME_MAXLEN;
 
 		/* don't print MSTCPY locks without -M */
-		if (!r_nodeid && nodeid) {
+		if (!lk.r_nodeid && lk.nodeid) {
 			if (!dump_mstcpy)
 				continue;
-			printf("id %08x gr %s rq %s pid %u MSTCPY %d \"%s\"\n",
-				id, mode_str(grmode), mode_str(rqmode),
-				ownpid, nodeid, r_name);
+			printf("id %08x gr %s rq %s pid %u MSTCPY %d \"%.*s\"\n",
+				lk.id, mode_str(lk.grmode), mode_str(lk.rqmode),
+				lk.ownpid, lk.nodeid, lk.r_name_len, lk.r_name);
 			continue;
 		}
 
@@ -1113,15 +984,15 @@ static void do_lockdump(char *name)
 		   IV.  (does it make sense to include status in the output,
 		   e.g. G,C,W?) */
 
-		if (status == DLM_LKSTS_GRANTED)
-			rqmode = LKM_IVMODE;
+		if (lk.status == DLM_LKSTS_GRANTED)
+			lk.rqmode = LKM_IVMODE;
 
-		printf("id %08x gr %s rq %s pid %u master %d \"%s\"\n",
-			id, mode_str(grmode), mode_str(rqmode),
-			ownpid, nodeid, r_name);
+		printf("id %08x gr %s rq %s pid %u master %d \"%.*s\"\n",
+			lk.id, mode_str(lk.grmode), mode_str(lk.rqmode),
+			lk.ownpid, lk.nodeid, lk.r_name_len, lk.r_name);
 	}
-
-	fclose(file);
+ out:
+	dlmc_debugfs_close(&df);
 }
 
 static char *dlmc_lf_str(uint32_t flags)
@@ -1187,6 +1058,8 @@ static const char *condition_str(int cond)
 		return "fencing";
 	case DLMC_LS_WAIT_FSDONE:
 		return "fsdone";
+	case DLMC_LS_WAIT_KERNEL:
+		return "kernel";
 	default:
 		return "unknown";
 	}
@@ -1365,6 +1238,22 @@ static void do_plocks(char *name)
 	do_write(STDOUT_FILENO, buf, strlen(buf));
 }
 
+static void do_stats(int op, char *name)
+{
+	char buf[DLMC_DUMP_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+
+	if (op == OP_MSG_STATS)
+		dlmc_dump_msg_stats(name, buf);
+	else if (op == OP_RECOVERY)
+		dlmc_dump_recovery(name, buf);
+
+	buf[DLMC_DUMP_SIZE-1] = '\0';
+
+	do_write(STDOUT_FILENO, buf, strlen(buf));
+}
+
 static void do_dump(int op)
 {
 	char buf[DLMC_DUMP_SIZE];
@@ -1444,6 +1333,14 @@ int main(int argc, char **argv)
 		do_plocks(lsname);
 		break;
 
+	case OP_MSG_STATS:
+		do_stats(operation, lsname);
+		break;
+
+	case OP_RECOVERY:
+		do_stats(operation, lsname);
+		break;
+
 	case OP_DEADLOCK_CHECK:
 		do_deadlock_check(lsname);
 		break;
@@ -9,11 +9,14 @@
 
 #ifdef _REENTRANT
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #endif
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <inttypes.h>
@@ -23,6 +26,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 #include <linux/major.h>
 #ifdef HAVE_SELINUX
 #include <selinux/selinux.h>
@@ -88,10 +93,15 @@ struct dlm_lock_result_v5 {
  * One of these per lockspace in use by the application
  */
 
+struct ast_pool;
+struct lock_cache;
+
 struct dlm_ls_info {
     int fd;
 #ifdef _REENTRANT
     pthread_t tid;
+    struct ast_pool *pool;
+    struct lock_cache *cache;
 #else
     int tid;
 #endif
@@ -122,22 +132,115 @@ static void dummy_ast_routine(void *arg)
 {
 }
 
+/* the ast addresses of queue requests, never called; their asts are
+   posted to the queue by queue_post() instead */
+
+static void queue_cast_ast(void *arg)
+{
+}
+
+static void queue_bast_ast(void *arg)
+{
+}
+
+static void queue_post(int fd, struct dlm_lksb *lksb, void *user_data,
+		       int bast_mode);
+
+#ifdef _REENTRANT
+/* the bast address of cached locks, never called; their basts are passed
+   to cache_bast() with the blocked mode instead */
+
+static void cache_bast_ast(void *arg)
+{
+}
+
+static void cache_bast(void *arg, int bast_mode);
+#endif
+
 #ifdef _REENTRANT
-/* Used for the synchronous and "simplified, synchronous" API routines */
+/* Used for the synchronous and "simplified, synchronous" API routines.
+ * done is a futex word: LOCK_WAIT_PENDING until the ast thread runs
+ * sync_ast_routine, which sets LOCK_WAIT_DONE and only makes the wake
+ * syscall if the waiter has gone to sleep (LOCK_WAIT_SLEEPING).  It
+ * needs no setup beyond clearing done, so the waiting thread keeps it on
+ * its stack.  An ast pool worker waits on its own queue instead, see
+ * ast_worker_wait(). */
+struct ast_worker;
+
 struct lock_wait
 {
-    pthread_cond_t  cond;
-    pthread_mutex_t mutex;
+    uint32_t        done;
     struct dlm_lksb lksb;
+    struct ast_worker *worker;
 };
 
+#define LOCK_WAIT_PENDING  0
+#define LOCK_WAIT_DONE     1
+#define LOCK_WAIT_SLEEPING 2
+
+/* times to check for the ast before sleeping, see dlm_set_sync_spin() */
+static unsigned int sync_spin;
+
+static long futex(uint32_t *uaddr, int op, uint32_t val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void ast_worker_done(struct lock_wait *lwait);
+static void ast_worker_wait(struct lock_wait *lwait);
+
+static void lock_wait_init(struct lock_wait *lwait)
+{
+    lwait->done = LOCK_WAIT_PENDING;
+    lwait->worker = NULL;
+}
+
 static void sync_ast_routine(void *arg)
 {
     struct lock_wait *lwait = arg;
 
-    pthread_mutex_lock(&lwait->mutex);
-    pthread_cond_signal(&lwait->cond);
-    pthread_mutex_unlock(&lwait->mutex);
+    if (lwait->worker)
+	ast_worker_done(lwait);
+    else if (__atomic_exchange_n(&lwait->done, LOCK_WAIT_DONE,
+			    __ATOMIC_ACQ_REL) == LOCK_WAIT_SLEEPING)
+	futex(&lwait->done, FUTEX_WAKE_PRIVATE, 1);
+}
+
+/* The ast sets done after it has filled in the lksb, so done is what's
+   spun on rather than sb_status, which the dispatch code writes in more
+   than one step. */
+
+static void lock_wait_wait(struct lock_wait *lwait)
+{
+    uint32_t old = LOCK_WAIT_PENDING;
+    unsigned int i;
+
+    if (lwait->worker)
+    {
+	ast_worker_wait(lwait);
+	return;
+    }
+
+    for (i = 0; i < sync_spin; i++)
+    {
+	if (__atomic_load_n(&lwait->done, __ATOMIC_ACQUIRE) == LOCK_WAIT_DONE)
+	    return;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+    }
+
+    if (!__atomic_compare_exchange_n(&lwait->done, &old, LOCK_WAIT_SLEEPING,
+				     0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	return; /* done */
+
+    while (__atomic_load_n(&lwait->done, __ATOMIC_ACQUIRE) != LOCK_WAIT_DONE)
+	futex(&lwait->done, FUTEX_WAIT_PRIVATE, LOCK_WAIT_SLEEPING);
+}
+
+void dlm_set_sync_spin(unsigned int spins)
+{
+    sync_spin = spins;
 }
 
 /* lock_resource & unlock_resource
@@ -167,9 +270,7 @@ int lock_resource(const char *resource, int mode, int flags, int *lockid)
     if (flags & LKF_CONVERT)
 	lwait.lksb.sb_lkid = *lockid;
 
-    pthread_cond_init(&lwait.cond, NULL);
-    pthread_mutex_init(&lwait.mutex, NULL);
-    pthread_mutex_lock(&lwait.mutex);
+    lock_wait_init(&lwait);
 
     status = dlm_lock(mode,
 		      &lwait.lksb,
@@ -185,8 +286,7 @@ int lock_resource(const char *resource, int mode, int flags, int *lockid)
 	return status;
 
     /* Wait for it to complete */
-    pthread_cond_wait(&lwait.cond, &lwait.mutex);
-    pthread_mutex_unlock(&lwait.mutex);
+    lock_wait_wait(&lwait);
 
     *lockid = lwait.lksb.sb_lkid;
 
@@ -209,9 +309,7 @@ int unlock_resource(int lockid)
 	return -1;
     }
 
-    pthread_cond_init(&lwait.cond, NULL);
-    pthread_mutex_init(&lwait.mutex, NULL);
-    pthread_mutex_lock(&lwait.mutex);
+    lock_wait_init(&lwait);
 
     status = dlm_unlock(lockid, 0, &lwait.lksb, &lwait);
 
@@ -219,8 +317,7 @@ int unlock_resource(int lockid)
 	return status;
 
     /* Wait for it to complete */
-    pthread_cond_wait(&lwait.cond, &lwait.mutex);
-    pthread_mutex_unlock(&lwait.mutex);
+    lock_wait_wait(&lwait);
 
     errno = lwait.lksb.sb_status;
     if (lwait.lksb.sb_status != DLM_EUNLOCK)
@@ -229,6 +326,10 @@ int unlock_resource(int lockid)
 	return 0;
 }
 
+static void ast_pool_destroy(struct ast_pool *pool);
+static void cache_stop(struct lock_cache *c);
+static void cache_free(struct lock_cache *c);
+
 /* Tidy up threads after a lockspace is closed */
 static int ls_pthread_cleanup(struct dlm_ls_info *lsinfo)
 {
@@ -237,12 +338,18 @@ static int ls_pthread_cleanup(struct dlm_ls_info *lsinfo)
 
     /* Must close the fd after the thread has finished */
     fd = lsinfo->fd;
+    if (lsinfo->cache)
+	cache_stop(lsinfo->cache);
     if (lsinfo->tid)
     {
 	status = pthread_cancel(lsinfo->tid);
 	if (!status)
 	    pthread_join(lsinfo->tid, NULL);
     }
+    if (!status && lsinfo->pool)
+	ast_pool_destroy(lsinfo->pool);
+    if (!status && lsinfo->cache)
+	cache_free(lsinfo->cache);
     if (!status)
     {
 	free(lsinfo);
@@ -463,18 +570,333 @@ static int find_udev_device(const char *lockspace, int minor, char *udev_path)
 	return -1;
 }
 
+/*
+ * deliver_ast()
+ * Copy an ast read from the kernel into the caller's lksb and call the
+ * ast routine.
+ */
+
+static void deliver_ast_v5(int fd, struct dlm_lock_result_v5 *result,
+			   char *fullresult)
+{
+	void (*astaddr)(void *astarg);
+
+	/* Copy lksb to user's buffer - except the LVB ptr */
+	memcpy(result->user_lksb, &result->lksb,
+	       sizeof(struct dlm_lksb) - sizeof(char*));
+
+	/* Flip the status. Kernel space likes negative return codes,
+	   userspace positive ones */
+	result->user_lksb->sb_status = -result->user_lksb->sb_status;
+
+	/* Copy optional items */
+	if (result->lvb_offset)
+		memcpy(result->user_lksb->sb_lvbptr,
+		       fullresult + result->lvb_offset, DLM_LVB_LEN);
+
+	/* Call AST */
+	if (result->user_astaddr == queue_cast_ast ||
+	    result->user_astaddr == queue_bast_ast) {
+		queue_post(fd, result->user_lksb, result->user_astparam,
+			   result->user_astaddr == queue_bast_ast ?
+			   result->bast_mode : 0);
+#ifdef _REENTRANT
+	} else if (result->user_astaddr == cache_bast_ast) {
+		cache_bast(result->user_astparam, result->bast_mode);
+#endif
+	} else if (result->user_astaddr) {
+		astaddr = result->user_astaddr;
+		astaddr(result->user_astparam);
+	}
+}
+
+static void deliver_ast_v6(int fd, struct dlm_lock_result *result)
+{
+	void (*astaddr)(void *astarg);
+
+	/* Copy lksb to user's buffer - except the LVB ptr */
+	memcpy(result->user_lksb, &result->lksb,
+	       sizeof(struct dlm_lksb) - sizeof(char*));
+
+	/* Copy lvb to user's buffer */
+	if (result->lvb_offset)
+		memcpy(result->user_lksb->sb_lvbptr,
+		       (char *)result + result->lvb_offset, DLM_LVB_LEN);
+
+	result->user_lksb->sb_status = -result->user_lksb->sb_status;
+
+	if (result->user_astaddr == queue_cast_ast ||
+	    result->user_astaddr == queue_bast_ast) {
+		queue_post(fd, result->user_lksb, result->user_astparam,
+			   result->user_astaddr == queue_bast_ast ?
+			   result->bast_mode : 0);
+#ifdef _REENTRANT
+	} else if (result->user_astaddr == cache_bast_ast) {
+		cache_bast(result->user_astparam, result->bast_mode);
+#endif
+	} else if (result->user_astaddr) {
+		astaddr = result->user_astaddr;
+		astaddr(result->user_astparam);
+	}
+}
+
+#ifdef _REENTRANT
+/*
+ * AST pool, see dlm_ls_pthread_init_pool().
+ * The receiving thread reads each ast from the kernel and hands it to
+ * worker (lkid % count), which delivers it.  All the asts for one lock go
+ * through the same worker in the order the kernel sent them, so a lock's
+ * completion ast can't overtake its blocking ast, while a slow ast
+ * routine only holds up the locks that share its worker.
+ *
+ * That includes the completions of the _wait calls.  An ast routine
+ * that makes a _wait call keeps delivering its worker's queue while it
+ * waits, as the receiving thread does in sync_write, so the asts queued
+ * ahead of its completion (or that another waiting worker needs) still
+ * run.  Only the queue API's asts are delivered by the receiving thread;
+ * they never reach the application.
+ */
+
+struct ast_item {
+	struct ast_item *next;
+	int fd;
+	union {
+		struct dlm_lock_result v6;
+		struct dlm_lock_result_v5 v5;
+	} result;	/* followed by the rest of what was read */
+};
+
+struct ast_worker {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct ast_item *head;
+	struct ast_item *tail;
+	int stop;
+	pthread_t tid;
+};
+
+struct ast_pool {
+	int count;
+	struct ast_worker workers[];
+};
+
+static int pool_ast(void *astaddr)
+{
+	return astaddr && astaddr != queue_cast_ast &&
+	       astaddr != queue_bast_ast;
+}
+
+static void ast_pool_add(struct ast_pool *pool, int fd, uint32_t lkid,
+			 void *result, int len)
+{
+	struct ast_worker *w = &pool->workers[lkid % pool->count];
+	struct ast_item *item;
+	int wake;
+
+	/* delivering it here would put it ahead of the lock's queued asts,
+	   so wait for the memory instead */
+	while (!(item = malloc(offsetof(struct ast_item, result) +
+			       MAX((size_t)len, sizeof(item->result)))))
+		usleep(1000);
+	item->next = NULL;
+	item->fd = fd;
+	memcpy(&item->result, result, len);
+
+	/* the worker only sleeps on an empty list */
+	pthread_mutex_lock(&w->mutex);
+	wake = !w->head;
+	if (w->tail)
+		w->tail->next = item;
+	else
+		w->head = item;
+	w->tail = item;
+	pthread_mutex_unlock(&w->mutex);
+
+	if (wake)
+		pthread_cond_signal(&w->cond);
+}
+
+/* called with w locked; items are taken one at a time so that a _wait
+   call made by one of them carries on from the next */
+
+static struct ast_item *ast_worker_next(struct ast_worker *w)
+{
+	struct ast_item *item = w->head;
+
+	if (item) {
+		w->head = item->next;
+		if (!w->head)
+			w->tail = NULL;
+	}
+	return item;
+}
+
+/* A blocking ast carries nothing new for the lksb, and the lock's
+   completion has already filled it in, so only the routine is called. */
+
+static void deliver_bast(void *astaddr, void *astparam, int bast_mode)
+{
+	void (*bastaddr)(void *astarg) = astaddr;
+
+	if (astaddr == cache_bast_ast)
+		cache_bast(astparam, bast_mode);
+	else
+		bastaddr(astparam);
+}
+
+static void deliver_item(struct ast_item *item)
+{
+	struct dlm_lock_result_v5 *r5 = &item->result.v5;
+	struct dlm_lock_result *r6 = &item->result.v6;
+
+	if (kernel_version.version[0] == 5) {
+		if (r5->bast_mode)
+			deliver_bast(r5->user_astaddr, r5->user_astparam,
+				     r5->bast_mode);
+		else
+			deliver_ast_v5(item->fd, r5, (char *)r5);
+	} else {
+		if (r6->bast_mode)
+			deliver_bast(r6->user_astaddr, r6->user_astparam,
+				     r6->bast_mode);
+		else
+			deliver_ast_v6(item->fd, r6);
+	}
+	free(item);
+}
+
+static void *ast_worker_thread(void *arg)
+{
+	struct ast_worker *w = arg;
+	struct ast_item *item;
+
+	for (;;) {
+		pthread_mutex_lock(&w->mutex);
+		while (!w->head && !w->stop)
+			pthread_cond_wait(&w->cond, &w->mutex);
+		item = ast_worker_next(w);
+		pthread_mutex_unlock(&w->mutex);
+
+		/* stop once everything queued has been delivered */
+		if (!item)
+			break;
+
+		deliver_item(item);
+	}
+
+	return NULL;
+}
+
+static struct ast_worker *pool_worker_self(struct dlm_ls_info *lsinfo)
+{
+	struct ast_pool *pool = lsinfo->pool;
+	pthread_t self = pthread_self();
+	int i;
+
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < pool->count; i++) {
+		if (pthread_equal(pool->workers[i].tid, self))
+			return &pool->workers[i];
+	}
+	return NULL;
+}
+
+/* sync_ast_routine for a worker waiting in ast_worker_wait; done is set
+   under the worker's mutex, so the waiter can't return (and take lwait
+   off its stack) before this has finished with it */
+
+static void ast_worker_done(struct lock_wait *lwait)
+{
+	struct ast_worker *w = lwait->worker;
+
+	pthread_mutex_lock(&w->mutex);
+	lwait->done = LOCK_WAIT_DONE;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static void ast_worker_wait(struct lock_wait *lwait)
+{
+	struct ast_worker *w = lwait->worker;
+	struct ast_item *item;
+
+	pthread_mutex_lock(&w->mutex);
+	while (lwait->done != LOCK_WAIT_DONE) {
+		item = ast_worker_next(w);
+		if (!item) {
+			pthread_cond_wait(&w->cond, &w->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&w->mutex);
+		deliver_item(item);
+		pthread_mutex_lock(&w->mutex);
+	}
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static void ast_pool_destroy(struct ast_pool *pool)
+{
+	struct ast_worker *w;
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		w = &pool->workers[i];
+		pthread_mutex_lock(&w->mutex);
+		w->stop = 1;
+		pthread_mutex_unlock(&w->mutex);
+		pthread_cond_signal(&w->cond);
+		pthread_join(w->tid, NULL);
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->mutex);
+	}
+	free(pool);
+}
+
+static struct ast_pool *ast_pool_create(int count)
+{
+	struct ast_pool *pool;
+	struct ast_worker *w;
+	int i, rv;
+
+	pool = calloc(1, sizeof(*pool) + count * sizeof(struct ast_worker));
+	if (!pool)
+		return NULL;
+	pool->count = count;
+
+	for (i = 0; i < count; i++) {
+		w = &pool->workers[i];
+		pthread_mutex_init(&w->mutex, NULL);
+		pthread_cond_init(&w->cond, NULL);
+
+		rv = pthread_create(&w->tid, NULL, ast_worker_thread, w);
+		if (rv) {
+			pthread_cond_destroy(&w->cond);
+			pthread_mutex_destroy(&w->mutex);
+			pool->count = i;
+			ast_pool_destroy(pool);
+			errno = rv;
+			return NULL;
+		}
+	}
+	return pool;
+}
+#endif
+
 /*
  * do_dlm_dispatch()
- * Read an ast from the kernel.
+ * Read an ast from the kernel.  With a pool (only ever set by
+ * dlm_recv_thread) the ast is passed to a worker to be delivered,
+ * otherwise it's delivered here.
  */
 
-static int do_dlm_dispatch_v5(int fd)
+static int dispatch_v5(int fd, struct ast_pool *pool)
 {
 	char resultbuf[sizeof(struct dlm_lock_result_v5) + DLM_USER_LVB_LEN];
 	struct dlm_lock_result_v5 *result = (struct dlm_lock_result_v5 *)resultbuf;
 	char *fullresult = NULL;
 	int status;
-	void (*astaddr)(void *astarg);
 
 	status = read(fd, result, sizeof(resultbuf));
 	if (status <= 0)
@@ -496,31 +918,20 @@ static int do_dlm_dispatch_v5(int fd)
 		   still deliver the AST, it just might not have all the
 		   info in it...hmmm */
 
-		if (newstat == result->length)
+		if (newstat == result->length) {
 			result = (struct dlm_lock_result_v5 *)fullresult;
+			status = newstat;
+		}
 	} else {
 		fullresult = resultbuf;
 	}
 
-
-	/* Copy lksb to user's buffer - except the LVB ptr */
-	memcpy(result->user_lksb, &result->lksb,
-	       sizeof(struct dlm_lksb) - sizeof(char*));
-
-	/* Flip the status. Kernel space likes negative return codes,
-	   userspace positive ones */
-	result->user_lksb->sb_status = -result->user_lksb->sb_status;
-
-	/* Copy optional items */
-	if (result->lvb_offset)
-		memcpy(result->user_lksb->sb_lvbptr,
-		       fullresult + result->lvb_offset, DLM_LVB_LEN);
-
-	/* Call AST */
-	if (result->user_astaddr) {
-		astaddr = result->user_astaddr;
-		astaddr(result->user_astparam);
-	}
+#ifdef _REENTRANT
+	if (pool && pool_ast(result->user_astaddr))
+		ast_pool_add(pool, fd, result->lksb.sb_lkid, result, status);
+	else
+#endif
+		deliver_ast_v5(fd, result, fullresult);
 
 	if (fullresult != resultbuf)
 		free(fullresult);
@@ -528,34 +939,34 @@ static int do_dlm_dispatch_v5(int fd)
 	return 0;
 }
 
-static int do_dlm_dispatch_v6(int fd)
+static int dispatch_v6(int fd, struct ast_pool *pool)
 {
 	char resultbuf[sizeof(struct dlm_lock_result) + DLM_USER_LVB_LEN];
 	struct dlm_lock_result *result = (struct dlm_lock_result *)resultbuf;
 	int status;
-	void (*astaddr)(void *astarg);
 
 	status = read(fd, result, sizeof(resultbuf));
 	if (status <= 0)
 		return -1;
 
-	/* Copy lksb to user's buffer - except the LVB ptr */
-	memcpy(result->user_lksb, &result->lksb,
-	       sizeof(struct dlm_lksb) - sizeof(char*));
-
-	/* Copy lvb to user's buffer */
-	if (result->lvb_offset)
-		memcpy(result->user_lksb->sb_lvbptr,
-		       (char *)result + result->lvb_offset, DLM_LVB_LEN);
+#ifdef _REENTRANT
+	if (pool && pool_ast(result->user_astaddr))
+		ast_pool_add(pool, fd, result->lksb.sb_lkid, result, status);
+	else
+#endif
+		deliver_ast_v6(fd, result);
 
-	result->user_lksb->sb_status = -result->user_lksb->sb_status;
+	return 0;
+}
 
-	if (result->user_astaddr) {
-		astaddr = result->user_astaddr;
-		astaddr(result->user_astparam);
-	}
+static int do_dlm_dispatch_v5(int fd)
+{
+	return dispatch_v5(fd, NULL);
+}
 
-	return 0;
+static int do_dlm_dispatch_v6(int fd)
+{
+	return dispatch_v6(fd, NULL);
 }
 
 static int do_dlm_dispatch(int fd)
@@ -596,9 +1007,8 @@ static int sync_write_v5(struct dlm_ls_info *lsinfo,
 			do_dlm_dispatch_v5(lsinfo->fd);
 		}
 	} else {
-		pthread_cond_init(&lwait.cond, NULL);
-		pthread_mutex_init(&lwait.mutex, NULL);
-		pthread_mutex_lock(&lwait.mutex);
+		lock_wait_init(&lwait);
+		lwait.worker = pool_worker_self(lsinfo);
 
 		req->i.lock.castaddr  = sync_ast_routine;
 		req->i.lock.castparam = &lwait;
@@ -607,8 +1017,7 @@ static int sync_write_v5(struct dlm_ls_info *lsinfo,
 		if (status < 0)
 			return -1;
 
-		pthread_cond_wait(&lwait.cond, &lwait.mutex);
-		pthread_mutex_unlock(&lwait.mutex);
+		lock_wait_wait(&lwait);
 	}
 
 	return status; /* lock status is in the lksb */
@@ -633,9 +1042,8 @@ static int sync_write_v6(struct dlm_ls_info *lsinfo,
 			do_dlm_dispatch_v6(lsinfo->fd);
 		}
 	} else {
-		pthread_cond_init(&lwait.cond, NULL);
-		pthread_mutex_init(&lwait.mutex, NULL);
-		pthread_mutex_lock(&lwait.mutex);
+		lock_wait_init(&lwait);
+		lwait.worker = pool_worker_self(lsinfo);
 
 		req->i.lock.castaddr  = sync_ast_routine;
 		req->i.lock.castparam = &lwait;
@@ -644,8 +1052,7 @@ static int sync_write_v6(struct dlm_ls_info *lsinfo,
 		if (status < 0)
 			return -1;
 
-		pthread_cond_wait(&lwait.cond, &lwait.mutex);
-		pthread_mutex_unlock(&lwait.mutex);
+		lock_wait_wait(&lwait);
 	}
 
 	return status; /* lock status is in the lksb */
@@ -1157,8 +1564,10 @@ int dlm_dispatch(int fd)
     int status;
     int fdflags;
 
+    /* an fd the caller already made non-blocking is left alone */
     fdflags = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL,  fdflags | O_NONBLOCK);
+    if (!(fdflags & O_NONBLOCK))
+	fcntl(fd, F_SETFL,  fdflags | O_NONBLOCK);
     do
     {
 	status = do_dlm_dispatch(fd);
@@ -1168,10 +1577,56 @@ int dlm_dispatch(int fd)
     if (status < 0 && errno == EAGAIN)
 	status = 0;
 
-    fcntl(fd, F_SETFL, fdflags);
+    if (!(fdflags & O_NONBLOCK))
+	fcntl(fd, F_SETFL, fdflags);
     return status;
 }
 
+/*
+ * For event loops: the fd is expected to be non-blocking already (set
+ * O_NONBLOCK on it once), so no fcntl calls are made, and at most budget
+ * ASTs are delivered (all pending ones if budget is 0) so one busy
+ * lockspace can't starve the rest of the loop.  Returns the number
+ * delivered; if that's less than budget, either none are left or an
+ * error stopped delivery, and the next call returns -1 for it.
+ */
+
+int dlm_dispatch_budget(int fd, int budget)
+{
+    int (*dispatch)(int fd);
+    int count = 0;
+
+    if (budget < 0)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+
+    if (kernel_version.version[0] == 5)
+	dispatch = do_dlm_dispatch_v5;
+    else
+	dispatch = do_dlm_dispatch_v6;
+
+    while (!budget || count < budget)
+    {
+	errno = 0;
+	if (dispatch(fd))
+	{
+	    /* no errno means read returned 0, the device has gone */
+	    if (!errno)
+		errno = EIO;
+
+	    /* EAGAIN means we've emptied it.  Other errors after some
+	       asts are left for the next call, which will hit them first. */
+	    if (!count && errno != EAGAIN)
+		return -1;
+	    break;
+	}
+	count++;
+    }
+    return count;
+}
+
 /* Converts a lockspace handle into a file descriptor */
 int dlm_ls_get_fd(dlm_lshandle_t lockspace)
 {
@@ -1180,22 +1635,973 @@ int dlm_ls_get_fd(dlm_lshandle_t lockspace)
     return lsinfo->fd;
 }
 
+/*
+ * Submission and completion queues
+ *
+ * The device takes one request per write and returns one ast per read,
+ * so the queue can't batch the syscalls themselves; what it saves is the
+ * callback per ast and the thread to run them.  Queue requests carry
+ * queue_cast_ast/queue_bast_ast as their ast addresses and the user_data
+ * as the ast arg.  Whatever reads their asts from the lockspace fd (the
+ * ast thread, dlm_queue_reap, or a dlm_dispatch/sync call) recognizes
+ * them in do_dlm_dispatch and adds a dlm_cqe to the queue's cq ring
+ * instead of calling anything.
+ *
+ * Every request that's submitted gets one completion ast, so limiting
+ * the requests queued or in flight (until their completion is reaped) to
+ * entries means completions always fit in the cq ring.  The ring has
+ * another entries slots for blocking asts; when those are used up, the
+ * ast thread waits for dlm_queue_reap to make room, and other callers
+ * drop the blocking ast (counted in overflow).
+ */
+
+struct dlm_queue {
+	struct dlm_queue *next;		/* queues */
+	struct dlm_ls_info *lsinfo;
+	int efd;			/* eventfd, counts posted cqe's */
+	int pollfd;			/* epoll of efd and lsinfo->fd */
+	int reaping;
+	unsigned int entries;		/* power of 2 */
+	unsigned int inflight;		/* completions not reaped */
+	unsigned int overflow;		/* blocking asts dropped */
+	unsigned int sq_head;
+	unsigned int sq_tail;
+	unsigned int cq_head;
+	unsigned int cq_tail;
+	struct dlm_sqe *sq;		/* entries */
+	struct dlm_cqe *cq;		/* 2 * entries */
 #ifdef _REENTRANT
-static void *dlm_recv_thread(void *lsinfo)
-{
-	struct dlm_ls_info *lsi = lsinfo;
+	pthread_mutex_t mutex;
+	pthread_cond_t room;
+	int waiting;			/* queue_post waiting for room */
+	int destroying;
+#endif
+};
 
-	for (;;)
-		do_dlm_dispatch(lsi->fd);
+#define DLM_QUEUE_MAX 65536
 
-	return NULL;
-}
+static struct dlm_queue *queues;
+#ifdef _REENTRANT
+static pthread_mutex_t queues_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-/* Multi-threaded callers normally use this */
-int dlm_pthread_init(void)
+static void queue_lock(struct dlm_queue *q)
 {
-    if (open_default_lockspace())
-	return -1;
+#ifdef _REENTRANT
+	pthread_mutex_lock(&q->mutex);
+#endif
+}
+
+static void queue_unlock(struct dlm_queue *q)
+{
+#ifdef _REENTRANT
+	pthread_mutex_unlock(&q->mutex);
+#endif
+}
+
+static void queues_lock(void)
+{
+#ifdef _REENTRANT
+	pthread_mutex_lock(&queues_mutex);
+#endif
+}
+
+static void queues_unlock(void)
+{
+#ifdef _REENTRANT
+	pthread_mutex_unlock(&queues_mutex);
+#endif
+}
+
+static struct dlm_queue *find_queue(int fd)
+{
+	struct dlm_queue *q;
+
+	for (q = queues; q; q = q->next) {
+		if (q->lsinfo->fd == fd)
+			return q;
+	}
+	return NULL;
+}
+
+/* called with q locked, and room in the cq ring */
+
+static void queue_add_cqe(struct dlm_queue *q, struct dlm_lksb *lksb,
+			  int status, void *user_data, int bast_mode)
+{
+	struct dlm_cqe *cqe = &q->cq[q->cq_tail & (2 * q->entries - 1)];
+	uint64_t one = 1;
+
+	cqe->lksb = lksb;
+	cqe->status = status;
+	cqe->bast_mode = bast_mode;
+	cqe->user_data = user_data;
+	q->cq_tail++;
+
+	/* dlm_queue_reap doesn't need waking for what it reads itself */
+	if (!q->reaping && write(q->efd, &one, sizeof(one)) < 0) {
+		/* the count can't overflow, nothing to do */
+	}
+}
+
+#ifdef _REENTRANT
+/* the ast thread is cancelled by ls_pthread_cleanup while waiting for
+   room, leave q unlocked for dlm_queue_destroy */
+
+static void queue_post_cancel(void *arg)
+{
+	struct dlm_queue *q = arg;
+
+	q->waiting--;
+	if (q->destroying)
+		pthread_cond_broadcast(&q->room);
+	pthread_mutex_unlock(&q->mutex);
+}
+#endif
+
+static void queue_post(int fd, struct dlm_lksb *lksb, void *user_data,
+		       int bast_mode)
+{
+	struct dlm_queue *q;
+
+	/* q is locked before queues is released so that dlm_queue_destroy
+	   can't free it under us */
+	queues_lock();
+	q = find_queue(fd);
+	if (q)
+		queue_lock(q);
+	queues_unlock();
+	if (!q)
+		return;
+
+	while (q->cq_tail - q->cq_head == 2 * q->entries) {
+#ifdef _REENTRANT
+		if (q->lsinfo->tid && pthread_self() == q->lsinfo->tid &&
+		    !q->destroying) {
+			q->waiting++;
+			pthread_cleanup_push(queue_post_cancel, q);
+			pthread_cond_wait(&q->room, &q->mutex);
+			pthread_cleanup_pop(0);
+			q->waiting--;
+			if (q->destroying)
+				pthread_cond_broadcast(&q->room);
+			continue;
+		}
+#endif
+		q->overflow++;
+		queue_unlock(q);
+		return;
+	}
+	queue_add_cqe(q, lksb, lksb->sb_status, user_data, bast_mode);
+	queue_unlock(q);
+}
+
+dlm_queue_t dlm_queue_create(dlm_lshandle_t ls, unsigned int entries)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct epoll_event ev;
+	struct dlm_queue *q;
+	unsigned int n;
+	int saved_errno;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return NULL;
+	}
+
+	if (!entries || entries > DLM_QUEUE_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (n = 1; n < entries; n <<= 1)
+		;
+
+	q = malloc(sizeof(struct dlm_queue) + n * sizeof(struct dlm_sqe) +
+		   2 * n * sizeof(struct dlm_cqe));
+	if (!q)
+		return NULL;
+	memset(q, 0, sizeof(struct dlm_queue));
+
+	q->lsinfo = lsinfo;
+	q->entries = n;
+	q->sq = (struct dlm_sqe *)(q + 1);
+	q->cq = (struct dlm_cqe *)(q->sq + n);
+	q->pollfd = -1;
+
+	q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (q->efd < 0)
+		goto fail;
+
+	/* without an ast thread, dlm_queue_reap reads the lockspace fd */
+
+	q->pollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (q->pollfd < 0)
+		goto fail;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = q->efd;
+	if (epoll_ctl(q->pollfd, EPOLL_CTL_ADD, q->efd, &ev) < 0)
+		goto fail;
+
+	if (!lsinfo->tid) {
+		ev.data.fd = lsinfo->fd;
+		if (epoll_ctl(q->pollfd, EPOLL_CTL_ADD, lsinfo->fd, &ev) < 0)
+			goto fail;
+	}
+
+#ifdef _REENTRANT
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->room, NULL);
+#endif
+
+	queues_lock();
+	if (find_queue(lsinfo->fd)) {
+		queues_unlock();
+		errno = EEXIST;
+		goto fail;
+	}
+	q->next = queues;
+	queues = q;
+	queues_unlock();
+	return q;
+
+ fail:
+	saved_errno = errno;
+	if (q->pollfd >= 0)
+		close(q->pollfd);
+	if (q->efd >= 0)
+		close(q->efd);
+	free(q);
+	errno = saved_errno;
+	return NULL;
+}
+
+int dlm_queue_destroy(dlm_queue_t queue)
+{
+	struct dlm_queue *q = queue;
+	struct dlm_queue **qp;
+
+	queues_lock();
+	for (qp = &queues; *qp; qp = &(*qp)->next) {
+		if (*qp == q) {
+			*qp = q->next;
+			break;
+		}
+	}
+	queues_unlock();
+
+	/* wait for a queue_post that found it before it was unlinked,
+	   waking it if it's waiting for room (it drops its cqe) */
+	queue_lock(q);
+#ifdef _REENTRANT
+	q->destroying = 1;
+	while (q->waiting) {
+		pthread_cond_broadcast(&q->room);
+		pthread_cond_wait(&q->room, &q->mutex);
+	}
+#endif
+	queue_unlock(q);
+
+	close(q->pollfd);
+	close(q->efd);
+#ifdef _REENTRANT
+	pthread_cond_destroy(&q->room);
+	pthread_mutex_destroy(&q->mutex);
+#endif
+	free(q);
+	return 0;
+}
+
+int dlm_queue_get_fd(dlm_queue_t queue)
+{
+	struct dlm_queue *q = queue;
+
+	return q->pollfd;
+}
+
+struct dlm_sqe *dlm_queue_get_sqe(dlm_queue_t queue)
+{
+	struct dlm_queue *q = queue;
+	struct dlm_sqe *sqe;
+	unsigned int inflight;
+
+	queue_lock(q);
+	inflight = q->inflight;
+	queue_unlock(q);
+
+	if (q->sq_tail - q->sq_head + inflight >= q->entries)
+		return NULL;
+
+	sqe = &q->sq[q->sq_tail & (q->entries - 1)];
+	memset(sqe, 0, sizeof(struct dlm_sqe));
+	q->sq_tail++;
+	return sqe;
+}
+
+static int queue_write(struct dlm_queue *q, struct dlm_sqe *sqe)
+{
+	uint32_t flags = sqe->flags & ~LKF_WAIT;
+
+	switch (sqe->op) {
+	case DLM_SQE_LOCK:
+		return ls_lock(q->lsinfo, sqe->mode, sqe->lksb, flags,
+			       sqe->name, sqe->namelen, sqe->parent,
+			       queue_cast_ast, sqe->user_data,
+			       sqe->bast ? queue_bast_ast : NULL, NULL);
+	case DLM_SQE_UNLOCK:
+		return dlm_ls_unlock(q->lsinfo, sqe->lksb->sb_lkid, flags,
+				     sqe->lksb, sqe->user_data);
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+int dlm_queue_submit(dlm_queue_t queue)
+{
+	struct dlm_queue *q = queue;
+	struct dlm_sqe *sqe;
+	int count = 0;
+
+	while (q->sq_head != q->sq_tail) {
+		sqe = &q->sq[q->sq_head & (q->entries - 1)];
+
+		if (queue_write(q, sqe) < 0) {
+			/* the failure takes the place of its completion,
+			   which get_sqe left room for */
+			sqe->lksb->sb_status = errno;
+			queue_lock(q);
+			q->inflight++;
+			queue_add_cqe(q, sqe->lksb, errno, sqe->user_data, 0);
+			queue_unlock(q);
+		} else if (!(sqe->op == DLM_SQE_UNLOCK &&
+			     (sqe->flags & LKF_CANCEL))) {
+			/* a cancel's ast is the completion of the request
+			   it cancels, which is already counted */
+			queue_lock(q);
+			q->inflight++;
+			queue_unlock(q);
+		}
+
+		q->sq_head++;
+		count++;
+	}
+	return count;
+}
+
+static int queue_take(struct dlm_queue *q, struct dlm_cqe *cqes, int max)
+{
+	int n = 0;
+
+	queue_lock(q);
+	while (n < max && q->cq_head != q->cq_tail) {
+		cqes[n] = q->cq[q->cq_head & (2 * q->entries - 1)];
+		if (!cqes[n].bast_mode)
+			q->inflight--;
+		q->cq_head++;
+		n++;
+	}
+#ifdef _REENTRANT
+	if (n)
+		pthread_cond_signal(&q->room);
+#endif
+	queue_unlock(q);
+	return n;
+}
+
+int dlm_queue_reap(dlm_queue_t queue, struct dlm_cqe *cqes, int max)
+{
+	struct dlm_queue *q = queue;
+	uint64_t count;
+	int fd = q->lsinfo->fd;
+	int n, fdflags;
+
+	/* clear the readiness before taking what it counted */
+	if (read(q->efd, &count, sizeof(count)) < 0) {
+		/* EAGAIN when it's zero */
+	}
+
+	n = queue_take(q, cqes, max);
+
+	if (n == max || q->lsinfo->tid)
+		return n;
+
+	/* no ast thread, read the asts ourselves; each read adds at most
+	   one cqe, which is taken before the next */
+
+	fdflags = fcntl(fd, F_GETFL, 0);
+	if (!(fdflags & O_NONBLOCK))
+		fcntl(fd, F_SETFL, fdflags | O_NONBLOCK);
+
+	q->reaping = 1;
+	while (n < max) {
+		errno = 0;
+		if (do_dlm_dispatch(fd)) {
+			if (!n && errno && errno != EAGAIN)
+				n = -1;
+			break;
+		}
+		n += queue_take(q, cqes + n, max - n);
+	}
+	q->reaping = 0;
+
+	if (!(fdflags & O_NONBLOCK))
+		fcntl(fd, F_SETFL, fdflags);
+	return n;
+}
+
+#ifdef _REENTRANT
+/*
+ * Lock cache, see dlm_ls_cache_init().
+ * A cache_lock is a dlm lock the cache keeps after the application has
+ * unlocked it, so it can be granted again without asking the dlm.  It's
+ * only given up when another node wants it (a blocking ast) or when it's
+ * been unused for idle_ms.  Locks held by more than one caller at once
+ * must be in the same shared mode; anything else waits for the holders
+ * to unlock.
+ *
+ * Only one request for a lock is sent to the dlm at a time, by the
+ * caller that needs it or by the ast thread in response to a blocking
+ * ast.  The cache mutex isn't held while waiting for the dlm, the ast
+ * routines take it to record the result.
+ */
+
+#define CACHE_HASH_SIZE		1024
+
+#define CACHE_LOCKING		1	/* request or convert for a caller */
+#define CACHE_COMPLETE		2	/* its ast has arrived */
+#define CACHE_GRANTED		3
+#define CACHE_CONVERTING	4	/* down-convert for a blocking ast */
+#define CACHE_RELEASING		5
+
+struct cache_lock {
+	struct cache_lock *name_next;
+	struct cache_lock *lkid_next;
+	struct lock_cache *cache;
+	struct dlm_lksb lksb;
+	int state;
+	int mode;			/* granted by the dlm */
+	int target;			/* mode being down-converted to */
+	int bast_mode;			/* blocking ast not yet acted on */
+	int holders;
+	int held_mode;
+	uint64_t used;			/* ms, when holders went to 0 */
+	unsigned int namelen;
+	char name[];
+};
+
+struct lock_cache {
+	struct dlm_ls_info *lsinfo;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;		/* a lock changed state or holders */
+	pthread_cond_t reap_cond;
+	pthread_t reaper;
+	unsigned int idle_ms;
+	int stop;
+	struct dlm_cache_stats stats;
+	struct cache_lock *name_hash[CACHE_HASH_SIZE];
+	struct cache_lock *lkid_hash[CACHE_HASH_SIZE];
+};
+
+/* modes compatible with each mode, by LKM_ */
+static const int cache_compat[6][6] = {
+	{ 1, 1, 1, 1, 1, 1 },		/* NL */
+	{ 1, 1, 1, 1, 1, 0 },		/* CR */
+	{ 1, 1, 1, 0, 0, 0 },		/* CW */
+	{ 1, 1, 0, 1, 0, 0 },		/* PR */
+	{ 1, 1, 0, 0, 0, 0 },		/* PW */
+	{ 1, 0, 0, 0, 0, 0 },		/* EX */
+};
+
+/* holding mode shuts out everything that holding want would */
+
+static int cache_covers(int mode, int want)
+{
+	int i;
+
+	for (i = LKM_NLMODE; i <= LKM_EXMODE; i++) {
+		if (cache_compat[mode][i] && !cache_compat[want][i])
+			return 0;
+	}
+	return 1;
+}
+
+static uint64_t cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int cache_name_hash(const char *name, unsigned int len)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619U;
+	}
+	return h & (CACHE_HASH_SIZE - 1);
+}
+
+static struct cache_lock *cache_find(struct lock_cache *c, const char *name,
+				     unsigned int namelen)
+{
+	struct cache_lock *cl;
+
+	for (cl = c->name_hash[cache_name_hash(name, namelen)]; cl;
+	     cl = cl->name_next) {
+		if (cl->namelen == namelen && !memcmp(cl->name, name, namelen))
+			return cl;
+	}
+	return NULL;
+}
+
+static struct cache_lock *cache_find_lkid(struct lock_cache *c,
+					  uint32_t lkid)
+{
+	struct cache_lock *cl;
+
+	for (cl = c->lkid_hash[lkid & (CACHE_HASH_SIZE - 1)]; cl;
+	     cl = cl->lkid_next) {
+		if (cl->lksb.sb_lkid == lkid)
+			return cl;
+	}
+	return NULL;
+}
+
+static void cache_remove(struct lock_cache *c, struct cache_lock *cl)
+{
+	struct cache_lock **p;
+
+	p = &c->name_hash[cache_name_hash(cl->name, cl->namelen)];
+	for (; *p; p = &(*p)->name_next) {
+		if (*p == cl) {
+			*p = cl->name_next;
+			break;
+		}
+	}
+
+	p = &c->lkid_hash[cl->lksb.sb_lkid & (CACHE_HASH_SIZE - 1)];
+	for (; *p; p = &(*p)->lkid_next) {
+		if (*p == cl) {
+			*p = cl->lkid_next;
+			break;
+		}
+	}
+
+	c->stats.locks--;
+	free(cl);
+}
+
+static void cache_ast(void *arg);
+
+static int cache_request(struct lock_cache *c, struct cache_lock *cl,
+			 int mode, uint32_t flags)
+{
+	return dlm_ls_lock(c->lsinfo, mode, &cl->lksb, flags, cl->name,
+			   cl->namelen, 0, cache_ast, cl, cache_bast_ast,
+			   NULL);
+}
+
+static void cache_release(struct lock_cache *c, struct cache_lock *cl)
+{
+	cl->state = CACHE_RELEASING;
+	if (dlm_ls_unlock(c->lsinfo, cl->lksb.sb_lkid, 0, &cl->lksb, cl))
+		cl->state = CACHE_GRANTED;
+}
+
+/* Give up what another node is waiting for, keeping a read mode that
+   doesn't block it if the lock has one. */
+
+static void cache_yield(struct lock_cache *c, struct cache_lock *cl)
+{
+	static const int keep[] = { LKM_PRMODE, LKM_CRMODE };
+	int bast_mode = cl->bast_mode;
+	unsigned int i;
+
+	cl->bast_mode = 0;
+
+	for (i = 0; i < sizeof(keep) / sizeof(keep[0]); i++) {
+		if (keep[i] == cl->mode || !cache_covers(cl->mode, keep[i]) ||
+		    !cache_compat[keep[i]][bast_mode])
+			continue;
+
+		cl->state = CACHE_CONVERTING;
+		cl->target = keep[i];
+		if (!cache_request(c, cl, keep[i], LKF_CONVERT))
+			return;
+		cl->state = CACHE_GRANTED;
+		break;
+	}
+
+	cache_release(c, cl);
+}
+
+/* called whenever a lock may have become unused */
+
+static void cache_idle(struct lock_cache *c, struct cache_lock *cl)
+{
+	if (cl->state == CACHE_GRANTED && !cl->holders && cl->bast_mode)
+		cache_yield(c, cl);
+	pthread_cond_broadcast(&c->cond);
+}
+
+static void cache_ast(void *arg)
+{
+	struct cache_lock *cl = arg;
+	struct lock_cache *c = cl->cache;
+
+	pthread_mutex_lock(&c->mutex);
+	switch (cl->state) {
+	case CACHE_LOCKING:
+		cl->state = CACHE_COMPLETE;
+		break;
+	case CACHE_CONVERTING:
+		if (!cl->lksb.sb_status)
+			cl->mode = cl->target;
+		cl->state = CACHE_GRANTED;
+		cache_idle(c, cl);
+		break;
+	case CACHE_RELEASING:
+		cache_remove(c, cl);
+		break;
+	}
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->mutex);
+}
+
+static void cache_bast(void *arg, int bast_mode)
+{
+	struct cache_lock *cl = arg;
+	struct lock_cache *c = cl->cache;
+
+	pthread_mutex_lock(&c->mutex);
+	c->stats.basts++;
+	if (cl->state != CACHE_RELEASING) {
+		cl->bast_mode = bast_mode;
+		cache_idle(c, cl);
+	}
+	pthread_mutex_unlock(&c->mutex);
+}
+
+static void *cache_reaper(void *arg)
+{
+	struct lock_cache *c = arg;
+	struct cache_lock *cl, *next;
+	struct timespec ts;
+	uint64_t now;
+	int i;
+
+	pthread_mutex_lock(&c->mutex);
+	while (!c->stop) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += c->idle_ms / 1000;
+		ts.tv_nsec += (c->idle_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&c->reap_cond, &c->mutex, &ts);
+		if (c->stop)
+			break;
+
+		now = cache_now();
+		for (i = 0; i < CACHE_HASH_SIZE; i++) {
+			for (cl = c->name_hash[i]; cl; cl = next) {
+				next = cl->name_next;
+				if (cl->state != CACHE_GRANTED || cl->holders ||
+				    now - cl->used < c->idle_ms)
+					continue;
+				c->stats.idle_releases++;
+				cache_release(c, cl);
+			}
+		}
+	}
+	pthread_mutex_unlock(&c->mutex);
+
+	return NULL;
+}
+
+/* Stop the reaper; before the ast thread is cancelled, which may leave
+   the cache mutex locked. */
+
+static void cache_stop(struct lock_cache *c)
+{
+	if (!c->idle_ms)
+		return;
+
+	pthread_mutex_lock(&c->mutex);
+	c->stop = 1;
+	pthread_cond_signal(&c->reap_cond);
+	pthread_mutex_unlock(&c->mutex);
+	pthread_join(c->reaper, NULL);
+	c->idle_ms = 0;
+}
+
+/* Free the cache once the ast threads are gone.  The locks themselves
+   are dropped by the dlm when the lockspace is closed. */
+
+static void cache_free(struct lock_cache *c)
+{
+	struct cache_lock *cl, *next;
+	int i;
+
+	for (i = 0; i < CACHE_HASH_SIZE; i++) {
+		for (cl = c->name_hash[i]; cl; cl = next) {
+			next = cl->name_next;
+			free(cl);
+		}
+	}
+	pthread_cond_destroy(&c->reap_cond);
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->mutex);
+	free(c);
+}
+
+int dlm_ls_cache_init(dlm_lshandle_t ls, unsigned int idle_ms)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct lock_cache *c;
+	pthread_condattr_t attr;
+	int rv;
+
+	if (!lsinfo->tid) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (lsinfo->cache) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	c = calloc(1, sizeof(struct lock_cache));
+	if (!c)
+		return -1;
+
+	c->lsinfo = lsinfo;
+	c->idle_ms = idle_ms;
+	pthread_mutex_init(&c->mutex, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&c->reap_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (idle_ms) {
+		rv = pthread_create(&c->reaper, NULL, cache_reaper, c);
+		if (rv) {
+			c->idle_ms = 0;
+			cache_free(c);
+			errno = rv;
+			return -1;
+		}
+	}
+
+	lsinfo->cache = c;
+	return 0;
+}
+
+static struct cache_lock *cache_new(struct lock_cache *c, const char *name,
+				    unsigned int namelen)
+{
+	struct cache_lock *cl;
+	unsigned int h = cache_name_hash(name, namelen);
+
+	cl = calloc(1, sizeof(struct cache_lock) + namelen);
+	if (!cl)
+		return NULL;
+
+	cl->cache = c;
+	cl->state = CACHE_LOCKING;
+	cl->namelen = namelen;
+	memcpy(cl->name, name, namelen);
+
+	cl->name_next = c->name_hash[h];
+	c->name_hash[h] = cl;
+	c->stats.locks++;
+	return cl;
+}
+
+int dlm_ls_cache_lock(dlm_lshandle_t ls, uint32_t mode, struct dlm_lksb *lksb,
+		      uint32_t flags, const void *name, unsigned int namelen)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct lock_cache *c = lsinfo->cache;
+	struct cache_lock *cl;
+	unsigned int h;
+	int convert, status;
+
+	if (!c || mode > LKM_EXMODE || (flags & ~LKF_NOQUEUE) ||
+	    namelen > DLM_RESNAME_MAXLEN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->mutex);
+ retry:
+	cl = cache_find(c, name, namelen);
+	if (!cl) {
+		cl = cache_new(c, name, namelen);
+		if (!cl)
+			goto fail;
+		convert = 0;
+		goto request;
+	}
+
+	/* wait for anything in progress, and don't grant it locally
+	   while another node is waiting for it */
+
+	if (cl->state != CACHE_GRANTED || cl->bast_mode ||
+	    (cl->holders && (mode != cl->held_mode ||
+			     !cache_compat[mode][mode]))) {
+		if (flags & LKF_NOQUEUE) {
+			status = EAGAIN;
+			goto out;
+		}
+		pthread_cond_wait(&c->cond, &c->mutex);
+		goto retry;
+	}
+
+	if (cache_covers(cl->mode, mode)) {
+		c->stats.hits++;
+		goto grant;
+	}
+
+	if (cl->holders) {
+		/* a shared mode the dlm hasn't granted, the holders don't
+		   need it converting */
+		if (flags & LKF_NOQUEUE) {
+			status = EAGAIN;
+			goto out;
+		}
+		pthread_cond_wait(&c->cond, &c->mutex);
+		goto retry;
+	}
+
+	cl->state = CACHE_LOCKING;
+	convert = LKF_CONVERT;
+ request:
+	c->stats.misses++;
+	if (cache_request(c, cl, mode, flags | convert)) {
+		if (convert) {
+			cl->state = CACHE_GRANTED;
+			cache_idle(c, cl);
+		} else {
+			cache_remove(c, cl);
+			pthread_cond_broadcast(&c->cond);
+		}
+		goto fail;
+	}
+
+	while (cl->state == CACHE_LOCKING)
+		pthread_cond_wait(&c->cond, &c->mutex);
+
+	status = cl->lksb.sb_status;
+	if (status) {
+		if (convert) {
+			cl->state = CACHE_GRANTED;
+			cache_idle(c, cl);
+		} else {
+			cache_remove(c, cl);
+			pthread_cond_broadcast(&c->cond);
+		}
+		goto out;
+	}
+
+	if (!convert) {
+		h = cl->lksb.sb_lkid & (CACHE_HASH_SIZE - 1);
+		cl->lkid_next = c->lkid_hash[h];
+		c->lkid_hash[h] = cl;
+	}
+	cl->mode = mode;
+	cl->state = CACHE_GRANTED;
+ grant:
+	cl->holders++;
+	cl->held_mode = mode;
+	lksb->sb_lkid = cl->lksb.sb_lkid;
+	status = 0;
+ out:
+	pthread_mutex_unlock(&c->mutex);
+	lksb->sb_flags = 0;
+	lksb->sb_status = status;
+	return 0;
+
+ fail:
+	pthread_mutex_unlock(&c->mutex);
+	return -1;
+}
+
+int dlm_ls_cache_unlock(dlm_lshandle_t ls, struct dlm_lksb *lksb)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct lock_cache *c = lsinfo->cache;
+	struct cache_lock *cl;
+
+	if (!c) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->mutex);
+	cl = cache_find_lkid(c, lksb->sb_lkid);
+	if (!cl || !cl->holders) {
+		pthread_mutex_unlock(&c->mutex);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!--cl->holders) {
+		cl->used = cache_now();
+		cache_idle(c, cl);
+	}
+	pthread_mutex_unlock(&c->mutex);
+
+	lksb->sb_status = EUNLOCK;
+	return 0;
+}
+
+int dlm_ls_cache_stats(dlm_lshandle_t ls, struct dlm_cache_stats *stats)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct lock_cache *c = lsinfo->cache;
+
+	if (!c) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->mutex);
+	*stats = c->stats;
+	pthread_mutex_unlock(&c->mutex);
+	return 0;
+}
+#endif
+
+#ifdef _REENTRANT
+static void *dlm_recv_thread(void *lsinfo)
+{
+	struct dlm_ls_info *lsi = lsinfo;
+
+	for (;;) {
+		if (kernel_version.version[0] == 5)
+			dispatch_v5(lsi->fd, lsi->pool);
+		else
+			dispatch_v6(lsi->fd, lsi->pool);
+	}
+
+	return NULL;
+}
+
+/* Multi-threaded callers normally use this */
+int dlm_pthread_init(void)
+{
+    if (open_default_lockspace())
+	return -1;
 
     if (default_ls->tid)
     {
@@ -1228,6 +2634,40 @@ int dlm_ls_pthread_init(dlm_lshandle_t ls)
 
     return pthread_create(&lsinfo->tid, NULL, dlm_recv_thread, (void *)ls);
 }
+
+/* And again, with the asts delivered by a pool of threads */
+int dlm_ls_pthread_init_pool(dlm_lshandle_t ls, int ast_threads)
+{
+    struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+    int status;
+
+    if (lsinfo->tid)
+    {
+	errno = EEXIST;
+	return -1;
+    }
+
+    if (ast_threads < 0)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+
+    if (ast_threads <= 1)
+	return dlm_ls_pthread_init(ls);
+
+    lsinfo->pool = ast_pool_create(ast_threads);
+    if (!lsinfo->pool)
+	return -1;
+
+    status = pthread_create(&lsinfo->tid, NULL, dlm_recv_thread, (void *)ls);
+    if (status)
+    {
+	ast_pool_destroy(lsinfo->pool);
+	lsinfo->pool = NULL;
+    }
+    return status;
+}
 #endif
 
 /*
@@ -1333,6 +2773,10 @@ static dlm_lshandle_t create_lockspace(const char *name, mode_t mode,
 	if (mode)
 		fchmod(newls->fd, mode);
 	newls->tid = 0;
+#ifdef _REENTRANT
+	newls->pool = NULL;
+	newls->cache = NULL;
+#endif
 	fcntl(newls->fd, F_SETFD, 1);
 	return (dlm_lshandle_t)newls;
 
@@ -1453,6 +2897,10 @@ dlm_lshandle_t dlm_open_lockspace(const char *name)
 		return NULL;
 
 	newls->tid = 0;
+#ifdef _REENTRANT
+	newls->pool = NULL;
+	newls->cache = NULL;
+#endif
 	ls_dev_name(name, dev_name, sizeof(dev_name));
 
 	newls->fd = open(dev_name, O_RDWR);
@@ -106,14 +106,20 @@ extern int dlm_unlock_wait(uint32_t lkid,
 
 
 /* 
- * These two are for users that want to do their own FD handling
+ * These are for users that want to do their own FD handling
  *
  * dlm_get_fd() - returns fd for the default lockspace for polling and dispatch
  * dlm_dispatch() - dispatches pending asts and basts
+ * dlm_dispatch_budget() - dispatches up to budget asts and basts (all if 0)
+ *                         from an fd the caller has made O_NONBLOCK, and
+ *                         returns the number dispatched.  Fewer than budget
+ *                         means none are pending or an error stopped it;
+ *                         the next call returns -1 for the error.
  */
 
 extern int dlm_get_fd(void);
 extern int dlm_dispatch(int fd);
+extern int dlm_dispatch_budget(int fd, int budget);
 
 
 /*
@@ -213,6 +219,68 @@ extern int dlm_ls_purge(dlm_lshandle_t lockspace,
 		int pid);
 
 
+/*
+ * Submission and completion queues
+ *
+ * For applications with many requests in flight that want to collect
+ * completions in batches rather than by callback.  Requests are filled in
+ * dlm_sqe's taken from the queue and submitted together; their completion
+ * and blocking asts are returned as dlm_cqe's.  All memory is allocated
+ * when the queue is created.
+ *
+ * dlm_queue_create() - create the queue for a lockspace (one per
+ *                      lockspace), with room for entries requests in
+ *                      flight.  Create it after dlm_ls_pthread_init()
+ *                      if the lockspace has an ast thread.
+ * dlm_queue_destroy() - free it, once no requests are in flight
+ * dlm_queue_get_fd() - an fd that polls readable when dlm_queue_reap()
+ *                      has completions to return
+ * dlm_queue_get_sqe() - the next free dlm_sqe, or NULL if entries requests
+ *                       are already queued or in flight
+ * dlm_queue_submit() - submit the dlm_sqe's taken since the last submit,
+ *                      returns how many.  A request that fails to submit
+ *                      is returned as a completion with the error as its
+ *                      status.
+ * dlm_queue_reap() - return up to max completions without blocking,
+ *                    returns how many
+ *
+ * An unlock through the queue must be of a lock taken through it.  The
+ * user_data of an unlock (and a cancel) replaces that of the lock.
+ */
+
+typedef void *dlm_queue_t;
+
+#define DLM_SQE_LOCK		1
+#define DLM_SQE_UNLOCK		2
+
+struct dlm_sqe {
+	int op;				/* DLM_SQE_LOCK, DLM_SQE_UNLOCK */
+	uint32_t mode;
+	uint32_t flags;			/* LKF_ */
+	struct dlm_lksb *lksb;		/* unlock uses sb_lkid */
+	const void *name;		/* lock, copied by dlm_queue_submit */
+	unsigned int namelen;
+	uint32_t parent;		/* unused */
+	int bast;			/* lock, return blocking asts */
+	void *user_data;
+};
+
+struct dlm_cqe {
+	struct dlm_lksb *lksb;
+	int status;			/* sb_status */
+	int bast_mode;			/* non-zero for a blocking ast */
+	void *user_data;
+};
+
+extern dlm_queue_t dlm_queue_create(dlm_lshandle_t lockspace,
+		unsigned int entries);
+extern int dlm_queue_destroy(dlm_queue_t q);
+extern int dlm_queue_get_fd(dlm_queue_t q);
+extern struct dlm_sqe *dlm_queue_get_sqe(dlm_queue_t q);
+extern int dlm_queue_submit(dlm_queue_t q);
+extern int dlm_queue_reap(dlm_queue_t q, struct dlm_cqe *cqes, int max);
+
+
 /*
  * For threaded applications
  *
@@ -223,6 +291,22 @@ extern int dlm_ls_purge(dlm_lshandle_t lockspace,
  *			   (optional) or, if the locking functions are in a
  *			   shared library that is to be unloaded.
  *
+ * dlm_ls_pthread_init_pool() - as dlm_ls_pthread_init() but the asts are
+ *                       delivered by ast_threads threads, so a slow ast
+ *                       routine doesn't hold up every lock in the
+ *                       lockspace.  A lock's asts, including the
+ *                       completions of the _wait calls, are always
+ *                       delivered by the same thread, in order.  An ast
+ *                       routine making a _wait call delivers its
+ *                       thread's other asts while it waits.  0 or 1 is
+ *                       the same as dlm_ls_pthread_init().
+ *
+ * dlm_set_sync_spin() - the number of times the _wait calls check for
+ *                       their ast before sleeping until the ast thread
+ *                       wakes them (0, the default, sleeps at once).
+ *                       Spinning saves the sleep and wakeup when locks
+ *                       are usually granted within a few microseconds.
+ *
  * dlm_close/release_lockspace() will tidy the threads for a non-default
  * lockspace
  */
@@ -230,7 +314,54 @@ extern int dlm_ls_purge(dlm_lshandle_t lockspace,
 #ifdef _REENTRANT
 extern int dlm_pthread_init(void);
 extern int dlm_ls_pthread_init(dlm_lshandle_t lockspace);
+extern int dlm_ls_pthread_init_pool(dlm_lshandle_t lockspace, int ast_threads);
 extern int dlm_pthread_cleanup(void);
+extern void dlm_set_sync_spin(unsigned int spins);
+
+/*
+ * Lock cache (threaded applications)
+ *
+ * For applications that lock and unlock the same resources over and over.
+ * A lock taken through the cache is kept after it's unlocked, and locking
+ * it again in a mode it covers doesn't go to the dlm.  The cache gives a
+ * lock up when another node is blocked by it, down-converting it to a
+ * read mode that doesn't block that node if it can, or when it has been
+ * unused for idle_ms.
+ *
+ * dlm_ls_cache_init() - enable the cache for a lockspace, after
+ *                       dlm_ls_pthread_init(_pool)().  idle_ms 0 keeps
+ *                       locks until another node wants them.
+ * dlm_ls_cache_lock() - as dlm_ls_lock_wait(), flags may only be
+ *                       LKF_NOQUEUE.  Callers holding a lock at the same
+ *                       time must use the same shared mode, anything else
+ *                       waits (or with LKF_NOQUEUE, fails with EAGAIN).
+ * dlm_ls_cache_unlock() - unlock a lock taken by dlm_ls_cache_lock(),
+ *                         by lksb->sb_lkid
+ * dlm_ls_cache_stats() - the cache's counters
+ *
+ * These must not be called from ast routines.  Locks taken through the
+ * cache must only be unlocked through it.
+ */
+
+struct dlm_cache_stats {
+	uint64_t hits;			/* granted without the dlm */
+	uint64_t misses;		/* requests and converts sent */
+	uint64_t basts;			/* blocking asts received */
+	uint64_t idle_releases;		/* unlocked after idle_ms */
+	uint32_t locks;			/* locks in the cache */
+};
+
+extern int dlm_ls_cache_init(dlm_lshandle_t lockspace, unsigned int idle_ms);
+extern int dlm_ls_cache_lock(dlm_lshandle_t lockspace,
+		uint32_t mode,
+		struct dlm_lksb *lksb,
+		uint32_t flags,
+		const void *name,
+		unsigned int namelen);
+extern int dlm_ls_cache_unlock(dlm_lshandle_t lockspace,
+		struct dlm_lksb *lksb);
+extern int dlm_ls_cache_stats(dlm_lshandle_t lockspace,
+		struct dlm_cache_stats *stats);
 #endif
 
 